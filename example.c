@@ -4,7 +4,7 @@
 
 #define BUF(x) x // annotates that x is a stretchy buffer
 #define MAX_COUNT 10
-#define PROPERTY_KEY_MAX_SIZE 14
+#define PROPERTY_KEY_MAX_SIZE 14 // In the file; see atom_intern.
 #define MSG_PROPERTY_CHANGED (MSG_USER + 1)
 
 // helper macro for more simply defining button click handlers
@@ -16,6 +16,10 @@
 		return 0; \
 	}
 
+// A property key, interned by atom_intern so keys can be compared as integers. 0 is never a valid key.
+// (Not called Atom, since X11 already has one.)
+typedef uint32_t KeyAtom;
+
 typedef enum {
 	PROPERTY_NONE,
 	PROPERTY_U32,
@@ -28,21 +32,27 @@ typedef enum {
 
 typedef struct Property {
 	PropertyKind kind;
-	char key[PROPERTY_KEY_MAX_SIZE + 1];
+	KeyAtom key;
 	union {
 		uint32_t u32;
 	};
 } Property;
 
+typedef struct {
+	KeyAtom key;
+	Property value;
+} PropertyEntry;
+
 typedef struct {
 	ObjectKind kind;
-	BUF(Property *properties);
+	PropertyEntry *properties; // A hash map from the key to the property.
 } Object;
 
 // The data associated with each element in the UI that mirrors 
 // some property of the selected object in the document.
 typedef struct {
-	char *key; // The property key
+	uint64_t object_id; // The object the element was created for
+	KeyAtom key; // The property key
 	union {
 		// For react_u32_label_create
 		struct {
@@ -60,6 +70,7 @@ typedef struct {
 typedef enum {
 	STATE_CHANGE_NONE,
 	STATE_CHANGE_SET_PROPERTY,
+	STATE_CHANGE_COMPOUND, // Several steps undone and redone together, see state_transaction_begin.
 } StateChangeKind;
 
 typedef enum {
@@ -69,25 +80,103 @@ typedef enum {
 	STATE_CHANGE_MODE_REDO,
 } StateChangeMode;
 
-typedef struct {
+typedef struct StateChange {
 	StateChangeKind kind;
 	uint64_t object_id;
 	union {
 		Property property;
+		BUF(struct StateChange *steps); // Applied in order.
 	};
 } StateChange;
 
+typedef struct { 
+	uint64_t key; 
+	Object value; 
+} ObjectEntry;
+
+// The property an element mirrors, see react_register.
+typedef struct {
+	uint64_t object_id;
+	KeyAtom key;
+	uint32_t padding; // Always 0, since the map hashes the whole struct.
+} ReactKey;
+
+typedef struct {
+	ReactKey key;
+	BUF(Element **value); // The elements bound to the property.
+} ReactEntry;
+
+// A set of the properties a state change modified, so each is only updated once.
+typedef struct {
+	ReactKey key;
+	bool value;
+} ChangedProperty;
+
+// A document read from disk by the load task, waiting to replace the current one.
+typedef struct {
+	ObjectEntry *objects;
+	uint64_t object_id_allocator;
+	uint64_t selected_object_id;
+	int32_t released; // Set by the first of the load task and the load button to be done with it.
+} LoadedDocument;
+
+typedef struct {
+	char *key;
+	KeyAtom value;
+} AtomEntry;
 
 // Global Variables
-struct { uint64_t key; Object value; } *objects;
+AtomEntry *atom_table;      // The interned keys, stored in the string arena of the hash map.
+BUF(char **atom_names);     // The key of each atom; atom_names[0] is unused.
+Mutex atom_mutex;           // The load task interns keys on a worker thread.
+ObjectEntry *objects;
 uint64_t object_id_allocator;
 uint64_t selected_object_id;
 
 Element *container;
-BUF(Element **react_elements);
+ReactEntry *react_map;
 BUF(StateChange *undo_stack);
 BUF(StateChange *redo_stack);
+BUF(ptrdiff_t *transaction_starts);  // For each open transaction, where its steps start in transaction_steps.
+BUF(StateChange *transaction_steps); // The reverse of each step done in the open transactions, in order.
+ChangedProperty *transaction_changed; // The properties the open transactions modified.
+uint64_t transaction_selected_object_id; // The selected object when the outermost transaction began.
+bool document_io_pending; // Set while a save or load task is running.
+LoadedDocument *pending_load; // The document the load task is reading into, until it's swapped in.
+
+
+// Returns the atom for the key, adding it to the table the first time it's seen.
+// Keys have to fit in the file format.
+KeyAtom atom_intern(const char *key) {
+	assert(strlen(key) <= PROPERTY_KEY_MAX_SIZE);
+	mutex_lock(&atom_mutex);
+
+	if (!atom_table) {
+		sh_new_arena(atom_table);
+		arrput(atom_names, NULL);
+	}
 
+	ptrdiff_t index = shgeti(atom_table, key);
+	KeyAtom atom;
+
+	if (index >= 0) {
+		atom = atom_table[index].value;
+	} else {
+		atom = (KeyAtom) arrlen(atom_names);
+		shput(atom_table, key, atom);
+		arrput(atom_names, atom_table[shgeti(atom_table, key)].key);
+	}
+
+	mutex_unlock(&atom_mutex);
+	return atom;
+}
+
+const char *atom_name(KeyAtom atom) {
+	mutex_lock(&atom_mutex);
+	const char *name = atom_names[atom];
+	mutex_unlock(&atom_mutex);
+	return name;
+}
 
 void property_free(Property property) {
 	// Nothing to do yet! None of our property types need freeing.
@@ -96,6 +185,11 @@ void property_free(Property property) {
 void state_change_free(StateChange step) {
 	if (step.kind == STATE_CHANGE_SET_PROPERTY) {
 		property_free(step.property);
+	} else if (step.kind == STATE_CHANGE_COMPOUND) {
+		for (int i = 0; i < arrlen(step.steps); ++i) {
+			state_change_free(step.steps[i]);
+		}
+		arrfree(step.steps);
 	} else {
 		// ... add code here when new step types are introduced.
 	}
@@ -103,11 +197,11 @@ void state_change_free(StateChange step) {
 
 void object_free(Object object) {
 	// Free each property.
-	for (int i = 0; i < arrlen(object.properties); ++i) {
-		property_free(object.properties[i]);
+	for (int i = 0; i < hmlen(object.properties); ++i) {
+		property_free(object.properties[i].value);
 	}
-	// And free the dynamic array used to store the properties.
-	arrfree(object.properties);
+	// And free the hash map used to store the properties.
+	hmfree(object.properties);
 }
 
 void document_free(void) {
@@ -116,7 +210,6 @@ void document_free(void) {
 	}
 
 	hmfree(objects);
-	arrfree(react_elements);
 
 	for (int i = 0; i < arrlen(undo_stack); ++i) {
 		state_change_free(undo_stack[i]);
@@ -130,15 +223,10 @@ void document_free(void) {
 	arrfree(redo_stack);
 }
 
-Property object_read_any(Object *object, char *key) {
-	// Look through each property in the object's array.
-	for (int i = 0; i < arrlen(object->properties); ++i) {
-		// Check if the key matches.
-		if (0 == strcmp(object->properties[i].key, key)) {
-			// If so, return the property.
-			return object->properties[i];
-		}
-	}
+Property object_read_any(Object *object, KeyAtom key) {
+	// Look up the property in the object's map.
+	PropertyEntry *entry = hmgetp_null(object->properties, key);
+	if (entry) return entry->value;
 
 	// The property was not found.
 	// Return an empty property.
@@ -146,7 +234,7 @@ Property object_read_any(Object *object, char *key) {
 	return (Property){0};
 }
 
-uint32_t object_read_u32(Object *object, char *key, uint32_t default_val) {
+uint32_t object_read_u32(Object *object, KeyAtom key, uint32_t default_val) {
 	Property property = object_read_any(object, key);
 	return property.kind == PROPERTY_U32 ? property.u32 : default_val;
 }
@@ -155,66 +243,122 @@ Object *selected_object(void) {
 	return &hmgetp(objects, selected_object_id)->value;
 }
 
-// exclude can be NULL
-// if key is NULL, all elements are matched
-void react_update(Element *exclude, char *key) {
-	for (int i = 0; i < arrlen(react_elements); i++) {
-		ReactData *data = (ReactData*) react_elements[i]->context;
+// Add the element to the elements bound to its property. 
+// It's removed again by react_unregister when it's destroyed.
+void react_register(Element *element) {
+	ReactData *data = (ReactData*) element->context;
+	ReactKey key = { data->object_id, data->key, 0 };
+	ReactEntry *entry = hmgetp_null(react_map, key);
 
-		if (react_elements[i] == exclude) continue;
+	if (!entry) {
+		hmput(react_map, key, NULL);
+		entry = hmgetp(react_map, key);
+	}
+
+	arrput(entry->value, element);
+}
 
-		// If we are matching a specific key and this element's doesn't match it, skip it.
-		if (key && strcmp(data->key, key)) continue;
+void react_unregister(Element *element) {
+	ReactData *data = (ReactData*) element->context;
+	ReactKey key = { data->object_id, data->key, 0 };
+	ReactEntry *entry = hmgetp_null(react_map, key);
+	if (!entry) return;
+
+	for (int i = 0; i < arrlen(entry->value); i++) {
+		if (entry->value[i] == element) {
+			arrdelswap(entry->value, i);
+			break;
+		}
+	}
 
-		element_message(react_elements[i], MSG_PROPERTY_CHANGED, 0, 0);
+	if (!arrlen(entry->value)) {
+		arrfree(entry->value);
+		(void) hmdel(react_map, key);
 	}
 }
 
-void populate(void);
-
-void state_change_apply(StateChange step, Element *update_exclude, StateChangeMode mode) {
-	bool changed_selected_obj = false;
+void react_notify(BUF(Element **elements), Element *exclude) {
+	for (int i = 0; i < arrlen(elements); i++) {
+		// Elements waiting to be destroyed are still registered until they get MSG_DESTROY.
+		if (elements[i] == exclude || (elements[i]->flags & ELEMENT_DESTROY)) continue;
+		element_message(elements[i], MSG_PROPERTY_CHANGED, 0, 0);
+	}
+}
 
-	// Is the object specified in the step the same as the currently selected object?
-	if (selected_object_id != step.object_id) {
-		// No, so update the selected object.
-		selected_object_id = step.object_id;
-		changed_selected_obj = true;
+// exclude can be NULL
+// if key is 0, all elements are matched
+void react_update(Element *exclude, uint64_t object_id, KeyAtom key) {
+	if (key) {
+		// Only the elements bound to this property.
+		ReactKey react_key = { object_id, key, 0 };
+		ReactEntry *entry = hmgetp_null(react_map, react_key);
+		if (entry) react_notify(entry->value, exclude);
+	} else {
+		for (int i = 0; i < hmlen(react_map); i++) {
+			react_notify(react_map[i].value, exclude);
+		}
 	}
+}
 
-	Object *object = selected_object();
+void populate(void);
+
+// Make the change to the document, and return the step that reverses it.
+// The properties it modified are added to the changed set.
+StateChange state_change_do(StateChange step, ChangedProperty **changed) {
 	StateChange reverse = {0};
-	char *update_key = NULL;
 
 	if (step.kind == STATE_CHANGE_SET_PROPERTY) {
+		// The step's object becomes the selected object.
+		selected_object_id = step.object_id;
+		Object *object = selected_object();
+
 		// store the reverse state change for undo
 		reverse = step;
 		reverse.property = object_read_any(object, step.property.key);
+		reverse.property.key = step.property.key; // In case the object didn't have the property.
 		
 		// Store the property key that will need to be updated in the UI.
-		update_key = step.property.key;
-
-		bool found = false;
-
-		// Look for the property with this key in the object.
-		for (int i = 0; i < arrlen(object->properties); ++i) {
-			if (0 == strcmp(object->properties[i].key, step.property.key)) {
-				// Found it! Replace the property in the array.
-				object->properties[i] = step.property;
-				found = true;
-				break;
-			}
+		ReactKey key = { step.object_id, step.property.key, 0 };
+		hmput(*changed, key, true);
+
+		// Replace the property in the object, or add it if the object didn't have it.
+		hmput(object->properties, step.property.key, step.property);
+	} else if (step.kind == STATE_CHANGE_COMPOUND) {
+		// Do each step, and undo them in the opposite order.
+		reverse.kind = STATE_CHANGE_COMPOUND;
+		reverse.object_id = step.object_id;
+
+		for (int i = 0; i < arrlen(step.steps); ++i) {
+			arrput(reverse.steps, state_change_do(step.steps[i], changed));
 		}
 
-		if (!found) {
-			// The object did not already have the property in its array,
-			// so insert it at the end.
-			arrput(object->properties, step.property);
+		for (int i = 0; i < arrlen(reverse.steps) / 2; ++i) {
+			StateChange swap = reverse.steps[i];
+			reverse.steps[i] = reverse.steps[arrlen(reverse.steps) - i - 1];
+			reverse.steps[arrlen(reverse.steps) - i - 1] = swap;
 		}
+
+		// The steps themselves have been used up.
+		arrfree(step.steps);
 	} else {
 		// ... add more code when new step types are introduced
 	}
 
+	return reverse;
+}
+
+void state_change_apply(StateChange step, Element *update_exclude, StateChangeMode mode) {
+	if (mode == STATE_CHANGE_MODE_NORMAL && arrlen(transaction_starts)) {
+		// Make the change now, so later reads see it, but keep the undo step and the 
+		// updates until the transaction is committed.
+		arrput(transaction_steps, state_change_do(step, &transaction_changed));
+		return;
+	}
+
+	uint64_t previous_selected_object_id = selected_object_id;
+	ChangedProperty *changed = NULL;
+	StateChange reverse = state_change_do(step, &changed);
+
 	if (mode == STATE_CHANGE_MODE_NORMAL) {
 		// Clear the redo stack and put the reverse step on the undo stack.
 		for (int i = 0; i < arrlen(redo_stack); i++) 
@@ -229,14 +373,80 @@ void state_change_apply(StateChange step, Element *update_exclude, StateChangeMo
 		arrput(undo_stack, reverse);
 	}
 
-	if (changed_selected_obj) {
+	if (selected_object_id != previous_selected_object_id) {
 		populate();
 	} else {
 		// The selected object stayed the same, so we only need to do a minimal update.
-		// Only update the elements matching the property key that was modified.
-		react_update(update_exclude, update_key);
+		// Only update the elements matching the property keys that were modified, once each.
+		for (int i = 0; i < hmlen(changed); ++i) {
+			react_update(update_exclude, changed[i].key.object_id, changed[i].key.key);
+		}
 	}
 
+	hmfree(changed);
+}
+
+// Group the state changes made with state_change_apply until the matching state_transaction_commit
+// into one undo step. The changes are made straight away, so reads inside the transaction see them, 
+// but the elements are only updated once it's committed (or rolled back). Transactions can be nested; 
+// only the outermost one makes an undo step.
+void state_transaction_begin(void) {
+	if (!arrlen(transaction_starts)) transaction_selected_object_id = selected_object_id;
+	arrput(transaction_starts, arrlen(transaction_steps));
+}
+
+// Once the outermost transaction is over, update each modified property's elements once.
+void state_transaction_end(Element *update_exclude) {
+	if (arrlen(transaction_starts)) return;
+
+	if (selected_object_id != transaction_selected_object_id) {
+		populate();
+	} else {
+		for (int i = 0; i < hmlen(transaction_changed); ++i) {
+			react_update(update_exclude, transaction_changed[i].key.object_id, transaction_changed[i].key.key);
+		}
+	}
+
+	hmfree(transaction_changed);
+}
+
+// Put the steps done since state_transaction_begin on the undo stack together, as one step.
+void state_transaction_commit(Element *update_exclude) {
+	assert(arrlen(transaction_starts));
+	(void) arrpop(transaction_starts);
+
+	if (!arrlen(transaction_starts) && arrlen(transaction_steps)) {
+		// Undoing the transaction undoes its steps in the opposite order.
+		StateChange reverse = {0};
+		reverse.kind = STATE_CHANGE_COMPOUND;
+		reverse.object_id = transaction_selected_object_id;
+
+		for (ptrdiff_t i = arrlen(transaction_steps) - 1; i >= 0; --i) {
+			arrput(reverse.steps, transaction_steps[i]);
+		}
+
+		arrsetlen(transaction_steps, 0);
+
+		for (int i = 0; i < arrlen(redo_stack); i++) 
+			state_change_free(redo_stack[i]);
+		arrfree(redo_stack);
+		arrput(undo_stack, reverse);
+	}
+
+	state_transaction_end(update_exclude);
+}
+
+// Undo the steps done since state_transaction_begin, and end the transaction without an undo step.
+void state_transaction_rollback(Element *update_exclude) {
+	assert(arrlen(transaction_starts));
+	ptrdiff_t start = arrpop(transaction_starts);
+
+	while (arrlen(transaction_steps) > start) {
+		state_change_free(state_change_do(arrpop(transaction_steps), &transaction_changed));
+	}
+
+	if (!arrlen(transaction_starts)) selected_object_id = transaction_selected_object_id;
+	state_transaction_end(update_exclude);
 }
 
 
@@ -251,7 +461,7 @@ int react_u32_button_message(Element *element, Message message, int data_int, vo
 		step.kind = STATE_CHANGE_SET_PROPERTY;
 		step.object_id = selected_object_id;
 		step.property.kind = PROPERTY_U32;
-		strcpy(step.property.key, data->key);
+		step.property.key = data->key;
 		step.property.u32 = data->u32_button.click_delta + object_read_u32(selected_object(), data->key, 0);
 
 		// Double check that this new value of the property is actually in the valid range.
@@ -265,6 +475,7 @@ int react_u32_button_message(Element *element, Message message, int data_int, vo
 		if (count < data->u32_button.min || count > data->u32_button.max) 
 			*color = 0xCCCCCC;
 	} else if (message == MSG_DESTROY) {
+		react_unregister(element);
 		free(data);
 	}
 
@@ -276,17 +487,18 @@ Button *react_u32_button_create(Element *parent, uint32_t flags, char *key, char
 		                    uint32_t min, uint32_t max, int32_t click_delta) 
 {
 	ReactData *data = calloc(1, sizeof(ReactData));
-	data->key = key;
+	data->object_id = selected_object_id;
+	data->key = atom_intern(key);
 	data->u32_button.min = min;
 	data->u32_button.max = max;
 	data->u32_button.click_delta = click_delta;
 
 	Button *button = button_create(parent, flags, label, -1);
-	int64_t result = click_delta + object_read_u32(selected_object(), key, 0);
+	int64_t result = click_delta + object_read_u32(selected_object(), data->key, 0);
 	bool disabled = result < min || result > max;
 	button->element.message_user = react_u32_button_message;
 	button->element.context = data;
-	arrput(react_elements, &button->element);
+	react_register(&button->element);
 	return button;
 }
 
@@ -301,6 +513,7 @@ int react_u32_label_message(Element *element, Message message, int data_int, voi
 		label_set_text((Label*)element, buf, -1);
 		element_repaint(element, NULL);
 	} else if (message == MSG_DESTROY) {
+		react_unregister(element);
 		free(data);
 	}
 
@@ -309,13 +522,14 @@ int react_u32_label_message(Element *element, Message message, int data_int, voi
 
 Label *react_u32_label_create(Element *parent, uint32_t flags, char *key, char *prefix) {
 	ReactData *data = calloc(1, sizeof(ReactData));
-	data->key = key;
+	data->object_id = selected_object_id;
+	data->key = atom_intern(key);
 	data->u32_label.prefix = prefix;
 
 	Label *label = label_create(parent, flags, NULL, 0);
 	label->element.message_user = react_u32_label_message;
 	label->element.context = data;
-	arrput(react_elements, &label->element);
+	react_register(&label->element);
 	return label;
 }
 
@@ -326,6 +540,27 @@ BUTTON_HANDLE_CLICK_PROLOGUE(button_undo_message) {
 	}
 } BUTTON_HANDLE_CLICK_EPILOGUE()
 
+BUTTON_HANDLE_CLICK_PROLOGUE(button_reset_message) {
+	// Set every number in the document back to 0, as one undo step.
+	state_transaction_begin();
+
+	for (int i = 0; i < hmlen(objects); ++i) {
+		for (int j = 0; j < hmlen(objects[i].value.properties); ++j) {
+			Property *property = &objects[i].value.properties[j].value;
+			if (property->kind != PROPERTY_U32 || !property->u32) continue;
+
+			StateChange step = {0};
+			step.kind = STATE_CHANGE_SET_PROPERTY;
+			step.object_id = objects[i].key;
+			step.property = *property;
+			step.property.u32 = 0;
+			state_change_apply(step, NULL, STATE_CHANGE_MODE_NORMAL);
+		}
+	}
+
+	state_transaction_commit(NULL);
+} BUTTON_HANDLE_CLICK_EPILOGUE()
+
 BUTTON_HANDLE_CLICK_PROLOGUE(button_redo_message) {
 	if (arrlen(redo_stack)) {
 		// Remove the last step from the redo stack and apply it.
@@ -333,48 +568,85 @@ BUTTON_HANDLE_CLICK_PROLOGUE(button_redo_message) {
 	}
 } BUTTON_HANDLE_CLICK_EPILOGUE()
 
-BUTTON_HANDLE_CLICK_PROLOGUE(button_save_message) {
+// Runs on a worker thread. Writes the bytes prepared by button_save_message to the file, and frees them.
+// (If the button is destroyed first, it never gets MSG_TASK_COMPLETE, so it can't free them itself.)
+int save_task(void *argument) {
+	BUF(uint8_t *bytes) = (uint8_t*) argument;
 	FILE *f = fopen("example.dat", "wb");
+	bool written = f && fwrite(bytes, 1, arrlen(bytes), f) == (size_t) arrlen(bytes);
+	if (f && fclose(f)) written = false;
+	arrfree(bytes);
+	return written;
+}
 
-	// Save the object ID allocator.
-	fwrite(&object_id_allocator, 1, sizeof(uint64_t), f);
-
-	// Save the number of objects in the document.
-	uint32_t object_count = (uint32_t)hmlenu(objects);
-	fwrite(&object_count, 1, sizeof(uint32_t), f);
+void buffer_write(BUF(uint8_t **bytes), const void *data, size_t size) {
+	memcpy(arraddnptr(*bytes, size), data, size);
+}
 
-	for (int i = 0; i < hmlen(objects); ++i) {
-		// Save the object's key, kind and number of properties.
-		fwrite(&objects[i].key, 1, sizeof(uint64_t), f);
-		ObjectKind kind = objects[i].value.kind;
-		fwrite(&kind, 1, sizeof(ObjectKind), f);
-		uint32_t property_count = (uint32_t)arrlen(objects[i].value.properties);
-		fwrite(&property_count, 1, sizeof(uint32_t), f);
-
-		// For each property in the object...
-		for (uint32_t j = 0; j < property_count; ++j) {
-			// Save the property's kind annd key.
-			fwrite(&objects[i].value.properties[j].kind, 1, sizeof(PropertyKind), f);
-			fwrite(&objects[i].value.properties[j].key, 1, PROPERTY_KEY_MAX_SIZE + 1, f);
-			// Save the property's value. Dependent on the kind.
-			if (objects[i].value.properties[j].kind == PROPERTY_U32) {
-				fwrite(&objects[i].value.properties[j].u32, 1, sizeof(uint32_t), f);
-			} else {
-				// ...
+int button_save_message(Element *element, Message message, int di, void *dp) {
+	if (message == MSG_CLICKED && !document_io_pending) {
+		// Serialize the document here, since the worker can't look at it while the UI changes it.
+		BUF(uint8_t *bytes) = NULL;
+
+		// Save the object ID allocator.
+		buffer_write(&bytes, &object_id_allocator, sizeof(uint64_t));
+
+		// Save the number of objects in the document.
+		uint32_t object_count = (uint32_t)hmlenu(objects);
+		buffer_write(&bytes, &object_count, sizeof(uint32_t));
+
+		for (int i = 0; i < hmlen(objects); ++i) {
+			// Save the object's key, kind and number of properties.
+			buffer_write(&bytes, &objects[i].key, sizeof(uint64_t));
+			ObjectKind kind = objects[i].value.kind;
+			buffer_write(&bytes, &kind, sizeof(ObjectKind));
+			uint32_t property_count = (uint32_t)hmlen(objects[i].value.properties);
+			buffer_write(&bytes, &property_count, sizeof(uint32_t));
+
+			// For each property in the object...
+			for (uint32_t j = 0; j < property_count; ++j) {
+				Property *property = &objects[i].value.properties[j].value;
+
+				// Save the property's kind annd key. The file has the key's text, padded with zeros.
+				char key[PROPERTY_KEY_MAX_SIZE + 1] = {0};
+				strncpy(key, atom_name(property->key), PROPERTY_KEY_MAX_SIZE);
+				buffer_write(&bytes, &property->kind, sizeof(PropertyKind));
+				buffer_write(&bytes, key, PROPERTY_KEY_MAX_SIZE + 1);
+				// Save the property's value. Dependent on the kind.
+				if (property->kind == PROPERTY_U32) {
+					buffer_write(&bytes, &property->u32, sizeof(uint32_t));
+				} else {
+					// ...
+				}
 			}
 		}
+
+		// Write the file on a worker thread.
+		document_io_pending = true;
+		ui_task_submit(save_task, bytes, element);
+	} else if (message == MSG_TASK_COMPLETE) {
+		document_io_pending = false;
 	}
-	fclose(f);
-} BUTTON_HANDLE_CLICK_EPILOGUE()
 
-BUTTON_HANDLE_CLICK_PROLOGUE(button_load_message) {
+	return 0;
+}
+
+void loaded_document_free(LoadedDocument *document) {
+	for (int i = 0; i < hmlen(document->objects); ++i) {
+		object_free(document->objects[i].value);
+	}
+
+	hmfree(document->objects);
+	free(document);
+}
+
+// Reads the file into the LoadedDocument, without touching the current document.
+int load_document_read(LoadedDocument *document) {
 	FILE *f = fopen("example.dat", "rb");
 	if (!f) return 0;
 
-	document_free();
-
 	// Load the object ID allocator.
-	fread(&object_id_allocator, 1, sizeof(uint64_t), f);
+	fread(&document->object_id_allocator, 1, sizeof(uint64_t), f);
 
 	// Load the number of objects in the file.
 	uint32_t object_count = 0;
@@ -393,16 +665,18 @@ BUTTON_HANDLE_CLICK_PROLOGUE(button_load_message) {
 		object.kind = kind;
 
 		// Make sure that object ID allocator is actually set to a valid value.
-		if (object_id_allocator < id) {
-			object_id_allocator = id;
+		if (document->object_id_allocator < id) {
+			document->object_id_allocator = id;
 		}
 
 		for (uint32_t j = 0; j < property_count; j++) {
 			// Read the kind and key of the property.
 			Property property = {0};
+			char key[PROPERTY_KEY_MAX_SIZE + 1] = {0};
 			fread(&property.kind, 1, sizeof(property.kind), f);
-			fread(&property.key, 1, PROPERTY_KEY_MAX_SIZE + 1, f);
-			property.key[PROPERTY_KEY_MAX_SIZE] = 0;
+			fread(key, 1, PROPERTY_KEY_MAX_SIZE + 1, f);
+			key[PROPERTY_KEY_MAX_SIZE] = 0;
+			property.key = atom_intern(key);
 
 			// Read the property's value. Dependent on the kind.
 			if (property.kind == PROPERTY_U32) {
@@ -411,31 +685,75 @@ BUTTON_HANDLE_CLICK_PROLOGUE(button_load_message) {
 				// ...
 			}
 
-			// Add the property to the array.
-			arrput(object.properties, property);
+			// Add the property to the map.
+			hmput(object.properties, property.key, property);
 		}
 
 		// Add the object to the map.
-		hmput(objects, id, object);
+		hmput(document->objects, id, object);
 
 		// If this is a counter object, set it to be the selected object.
 		if (kind == OBJECT_COUNTER) {
-			selected_object_id = id;
+			document->selected_object_id = id;
 		}
 	}
 
 	fclose(f);
+	return 1;
+}
 
-	populate();
+// Runs on a worker thread.
+int load_task(void *argument) {
+	LoadedDocument *document = (LoadedDocument*) argument;
+	int result = load_document_read(document);
 
-} BUTTON_HANDLE_CLICK_EPILOGUE()
+	// If the load button was destroyed while this was running, nobody is going to take the document.
+	if (atomic_exchange(&document->released, 1)) {
+		loaded_document_free(document);
+	}
+
+	return result;
+}
+
+int button_load_message(Element *element, Message message, int di, void *dp) {
+	if (message == MSG_CLICKED && !document_io_pending) {
+		// Read the file on a worker thread.
+		document_io_pending = true;
+		pending_load = calloc(1, sizeof(LoadedDocument));
+		ui_task_submit(load_task, pending_load, element);
+	} else if (message == MSG_TASK_COMPLETE) {
+		LoadedDocument *document = (LoadedDocument*) dp;
+		document_io_pending = false;
+		pending_load = NULL;
+
+		if (di) {
+			// Swap in the loaded document.
+			document_free();
+			objects = document->objects;
+			object_id_allocator = document->object_id_allocator;
+			selected_object_id = document->selected_object_id;
+			populate();
+			free(document);
+		} else {
+			loaded_document_free(document);
+		}
+	} else if (message == MSG_DESTROY && pending_load) {
+		// MSG_TASK_COMPLETE won't arrive now. Free the document if the task is already done with it,
+		// otherwise leave it to the task.
+		if (atomic_exchange(&pending_load->released, 1)) {
+			loaded_document_free(pending_load);
+		}
+		pending_load = NULL;
+	}
+
+	return 0;
+}
 
 
 void populate(void) {
 	for (uintptr_t i = 0; i < container->child_count; ++i) {
 		element_destroy(container->children[i]);
 	}
-	arrfree(react_elements);
 
 	Object *object = selected_object();
 
@@ -447,9 +765,8 @@ void populate(void) {
 		Button *button_inc = react_u32_button_create(&row->element, 0, "count", "+", 0, 10, 1);
 	}
 
-	react_update(NULL, NULL);
-	element_message(container, MSG_LAYOUT, 0, 0);
-	element_repaint(container, NULL);
+	react_update(NULL, selected_object_id, 0);
+	element_invalidate_layout(container);
 }
 
 #ifdef PLATFORM_WIN32
@@ -457,6 +774,8 @@ int WinMain(HINSTANCE instance, HINSTANCE previousInstance, LPSTR commandLine, i
 #else
 int main() {
 #endif
+	mutex_init(&atom_mutex);
+
 	// Create the counter object.
 	Object object_counter = {0};
 	object_counter.kind = OBJECT_COUNTER;
@@ -464,9 +783,9 @@ int main() {
 	// Add a U32 property "count" with the value 10.
 	Property prop_count = {0};
 	prop_count.kind = PROPERTY_U32;
-	strcpy(prop_count.key, "count");
+	prop_count.key = atom_intern("count");
 	prop_count.u32 = 0; 
-	arrput(object_counter.properties, prop_count);
+	hmput(object_counter.properties, prop_count.key, prop_count);
 
 	// Put the counter object into the objects map, and select it.
 	object_id_allocator++;
@@ -491,6 +810,8 @@ int main() {
 	Button *button_load = button_create(&row->element, 0, "Load", -1);
 	button_save->element.message_user = button_save_message;
 	button_load->element.message_user = button_load_message;
+	Button *button_reset = button_create(&row->element, 0, "Reset", -1);
+	button_reset->element.message_user = button_reset_message;
 
 	container = &panel_create(&panel->element, ELEMENT_HORIZONTAL_FILL | ELEMENT_VERTICAL_FILL)->element;
 
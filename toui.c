@@ -4,6 +4,12 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
 
 #ifdef PLATFORM_WIN32
 #define Rectangle W32Rectangle
@@ -18,6 +24,17 @@
 #include <X11/Xatom.h>
 #include <X11/cursorfont.h>
 #undef Window
+#include <poll.h>
+#include <sys/eventfd.h>
+#endif
+
+#ifndef PLATFORM_WIN32
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 
 //////////////////////////////////////////////////////////////////////////////
@@ -25,19 +42,87 @@
 //////////////////////////////////////////////////////////////////////////////
 #define GLYPH_WIDTH  (9)
 #define GLYPH_HEIGHT (16)
+#define SCROLLBAR_WIDTH (12)
 
 // element flags
 #define ELEMENT_VERTICAL_FILL      (1 << 16)
 #define ELEMENT_HORIZONTAL_FILL    (1 << 17)
+#define ELEMENT_WIDTH_CACHED       (1 << 18)
+#define ELEMENT_HEIGHT_CACHED      (1 << 19)
+#define ELEMENT_WIDTH_STALE        (1 << 20)
+#define ELEMENT_HEIGHT_STALE       (1 << 21)
+#define ELEMENT_LAYOUT_DIRTY       (1 << 22)
+#define ELEMENT_LAYOUT_DESCENDENT  (1 << 23)
 #define ELEMENT_DESTROY            (1 << 30)
 #define ELEMENT_DESTROY_DESCENDENT (1 << 31)
 
 #define MIN(a, b) ((a) <= (b) ? (a) : (b))
 #define MAX(a, b) ((a) >= (b) ? (a) : (b))
 
+// Threads and atomics. See the Threads section for the functions.
+#ifdef PLATFORM_WIN32
+typedef HANDLE Thread;
+typedef SRWLOCK Mutex;
+typedef CONDITION_VARIABLE ConditionVariable;
+#define THREAD_LOCAL __declspec(thread)
+#define atomic_add(pointer, value) (InterlockedExchangeAdd((volatile LONG *) (pointer), (value)) + (value))
+#define atomic_load(pointer) InterlockedOr((volatile LONG *) (pointer), 0)
+#define atomic_exchange(pointer, value) InterlockedExchange((volatile LONG *) (pointer), (value))
+#define atomic_exchange_pointer(pointer, value) InterlockedExchangePointer((PVOID volatile *) (pointer), (value))
+#define atomic_load_pointer(pointer) InterlockedCompareExchangePointer((PVOID volatile *) (pointer), NULL, NULL)
+#define atomic_store_pointer(pointer, value) ((void) InterlockedExchangePointer((PVOID volatile *) (pointer), (value)))
+#else
+typedef pthread_t Thread;
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t ConditionVariable;
+#define THREAD_LOCAL __thread
+#define atomic_add(pointer, value) __atomic_add_fetch((pointer), (value), __ATOMIC_SEQ_CST)
+#define atomic_load(pointer) __atomic_load_n((pointer), __ATOMIC_SEQ_CST)
+#define atomic_exchange(pointer, value) __atomic_exchange_n((pointer), (value), __ATOMIC_SEQ_CST)
+#define atomic_exchange_pointer(pointer, value) __atomic_exchange_n((pointer), (value), __ATOMIC_ACQ_REL)
+#define atomic_load_pointer(pointer) __atomic_load_n((pointer), __ATOMIC_ACQUIRE)
+#define atomic_store_pointer(pointer, value) __atomic_store_n((pointer), (value), __ATOMIC_RELEASE)
+#endif
+
+typedef void (*ThreadFunction)(void *argument);
+
+// Run on a worker thread by ui_task_submit. The result is passed as data_int of MSG_TASK_COMPLETE.
+typedef int (*TaskFunction)(void *argument);
+
+// Does a slice of idle work for ui_schedule_idle. Returns true if there's more to do.
+typedef bool (*IdleCallback)(void *context);
+
+// A read-only view of a whole file. See the Files section for the functions.
+typedef struct {
+	char *data; // NULL if the file is empty.
+	size_t size;
+#ifdef PLATFORM_WIN32
+	HANDLE file, mapping;
+#else
+	int fd;
+#endif
+} MappedFile;
+
+// A file that is read a piece at a time, without mapping it. See the Files section for the functions.
+typedef struct {
+	size_t size; // As of the last platform_file_open or platform_file_refresh.
+#ifdef PLATFORM_WIN32
+	HANDLE file;
+#else
+	int fd;
+#endif
+} FileReader;
+
 typedef struct Window Window;
 typedef struct Element Element;
 
+// Refers to an element without keeping it alive, so it can be passed to other threads. 
+// Once the element is destroyed, its handle no longer refers to anything. 0 is never a valid handle.
+typedef uint64_t ElementHandle;
+
+// Refers to a timer from element_timer_start. 0 is never a valid timer.
+typedef uint64_t TimerId;
+
 typedef struct {
 	int l, r, t, b;
 } Rect;
@@ -61,6 +146,19 @@ typedef enum {
 	MSG_MOUSE_RIGHT_UP,    // Right mouse button released. (Sent to the element MSG_RIGHT_DOWN was sent to.)
 	MSG_MOUSE_DRAG,        // Mouse moved while holding buttons. (Sent to the element MSG_*_DOWN was sent to.)
 	MSG_CLICKED,           // Left mouse button released while hovering over the element that MSG_LEFT_UP was sent to.
+	MSG_MOUSE_WHEEL,       // Mouse wheel scrolled; data_int is the number of notches, positive is down. (Sent to the element 
+	                       // the mouse cursor is over, then its ancestors, until one returns non-zero.)
+	MSG_LIST_GET_ROW_COUNT,  // Return the number of rows in the virtual list.
+	MSG_LIST_GET_ROW_HEIGHT, // Return the height of row data_int. (Only for VIRTUAL_LIST_VARIABLE_HEIGHT.)
+	MSG_LIST_CREATE_ROW,     // data_ptr is an Element**. Create a row element as a child of the list and store it there.
+	MSG_LIST_BIND_ROW,       // Update the row element in data_ptr to show row data_int. (The list sizes the row, so
+	                         // use a setter that doesn't invalidate the layout, like label_bind_text.)
+	MSG_KEY_TYPED,           // A key was pressed; data_ptr is a KeyTyped*. (Sent to the focused element.)
+	MSG_VALUE_CHANGED,       // The user changed the element's value, e.g. edited the text in a text box.
+	MSG_LOG_VIEW_PROGRESS,   // Posted by a log view's indexing thread when it has indexed more of the file.
+	MSG_TIMER,               // A timer started with element_timer_start expired; data_ptr is its TimerId*.
+	MSG_TASK_COMPLETE,       // A task from ui_task_submit finished; data_int is its result and data_ptr its argument.
+	MSG_ANIMATE,             // An animation moved the value at data_ptr on a frame; data_int is 1 on its last frame.
 	MSG_DESTROY,
 	MSG_USER,
 } Message;
@@ -69,10 +167,46 @@ typedef enum {
 	UPDATE_NONE,
 	UPDATE_HOVERED,
 	UPDATE_PRESSED,
+	UPDATE_FOCUSED,
 } UpdateKind;
 
+typedef enum {
+	KEY_NONE,
+	KEY_BACKSPACE,
+	KEY_DELETE,
+	KEY_LEFT,
+	KEY_RIGHT,
+	KEY_UP,
+	KEY_DOWN,
+	KEY_HOME,
+	KEY_END,
+	KEY_ENTER,
+} KeyKind;
+
+typedef struct {
+	KeyKind code; // KEY_NONE if the key produced text.
+	char *text;   // The UTF-8 text produced by the key, if any.
+	int bytes;
+} KeyTyped;
+
 typedef int (*MessageHandler)(struct Element *element, Message message, int data_int, void *data_ptr);
 
+// How a child of a flex panel is sized along the panel's main axis. See element_set_flex.
+typedef struct {
+	int grow, shrink; // Weights for distributing leftover space, or taking away space that is missing.
+	int min, max;     // Limits on the size along the main axis. A max of 0 means no limit.
+} FlexItem;
+
+// The results of the last few MSG_GET_WIDTH or MSG_GET_HEIGHT messages with different data_int,
+// since layouts often measure a child with more than one constraint (see panel_layout).
+#define MEASURE_CACHE_SIZE (2)
+
+typedef struct {
+	int value[MEASURE_CACHE_SIZE], constraint[MEASURE_CACHE_SIZE];
+	int count;
+	bool overflow; // More constraints were used than fit, so some results were forgotten.
+} MeasureCache;
+
 struct Element {
 	uint32_t flags; // First 16 bits are specific to the type of element.
 					// The higher order 16 bits are common to all elements.
@@ -83,26 +217,206 @@ struct Element {
 	Window *window;
 	MessageHandler message_class, message_user;
 	void *context; // Context pointer (for user).
+
+	// The results of the last MSG_GET_WIDTH and MSG_GET_HEIGHT messages, and the
+	// data_int they were measured with. Only valid while ELEMENT_WIDTH_CACHED or
+	// ELEMENT_HEIGHT_CACHED is set; see element_measure_invalidate. After invalidation
+	// the old values are kept (and ELEMENT_*_STALE is set) so the layout pass in
+	// ui_update can tell whether the size actually changed.
+	MeasureCache cached_width, cached_height;
+
+	FlexItem flex;
+	uint32_t descendant_count;
+	uint32_t handle_index; // The element's slot in the handle table, or 0 if it has never had a handle.
 };
 
+// Text decoded from UTF-8 into font glyph indices, done once when the text is
+// set so that measuring and painting don't have to decode it again.
+typedef struct {
+	uint8_t *glyphs;
+	int glyph_count;
+	int width; // In pixels.
+} GlyphRun;
+
 typedef struct {
 	Element element;
 	char *text;
 	int text_bytes;
+	GlyphRun run;
 } Button; 
 
 typedef struct {
 	Element element;
 	char *text;
 	int text_bytes;
+	GlyphRun run;
 } Label; 
 
+#define PARAGRAPH_BREAK_CACHE_SIZE (4)
+
+// Where the lines of a paragraph start when wrapped to a certain number of columns.
+// Lines are worked out lazily, and after the text changes only the lines from the
+// first one affected by the change need to be worked out again.
+typedef struct {
+	int columns;      // 0 if this cache entry is unused.
+	int *line_starts; // line_starts[i] is the glyph index where line i starts, for i <= line_count.
+	int line_count;   // The number of lines worked out so far.
+	int capacity;
+	bool complete;    // Set when line_starts[line_count] is the end of the text.
+	uint32_t last_used;
+} LineBreaks;
+
+typedef struct {
+	Element element;
+	char *text;
+	int text_bytes;
+	GlyphRun run;
+	int longest_line; // The most glyphs between hard line breaks.
+	LineBreaks breaks[PARAGRAPH_BREAK_CACHE_SIZE];
+	uint32_t use_counter;
+} Paragraph;
+
 typedef struct {
 	Element element;
 	Rect padding;
 	int gap; // space between each child element
 } Panel; 
 
+typedef struct {
+	Element element;
+	Rect padding;
+	int gap;      // space between each child element on the main axis
+	int line_gap; // space between each line when wrapping
+	struct FlexSize *sizes; // Scratch space for flex_panel_layout, 1 entry per child.
+	uint32_t sizes_count;
+} FlexPanel;
+
+// Text with a gap at the last edit position, so that typing only has to move
+// the text between the previous and the current edit position.
+typedef struct {
+	char *buffer;
+	size_t gap_start, gap_end; // buffer[gap_start..gap_end) is unused.
+	size_t capacity;
+} GapBuffer;
+
+typedef struct {
+	Element element;
+	GapBuffer text;
+	size_t cursor;             // Byte offset of the cursor.
+	size_t cursor_line_start;  // Byte offset of the start of the cursor's line.
+	int cursor_line, cursor_column;
+	int line_count;
+	int scroll_line, scroll_column;
+	size_t scroll_offset;      // Byte offset of the start of the first visible line.
+} TextBox;
+
+// A read-only view of a (possibly huge, possibly growing) text file. Only the parts
+// being indexed or shown are read, and the index only records where every
+// LOG_VIEW_CHECKPOINT_LINES-th line starts, so memory use doesn't grow with the file.
+typedef struct {
+	Element element;
+
+	// Shared with the indexing thread, protected by the mutex.
+	// The file's size is only ever changed by the indexing thread.
+	Mutex mutex;
+	FileReader file;
+	size_t *checkpoints;       // checkpoints[i] is the offset of line i * LOG_VIEW_CHECKPOINT_LINES.
+	size_t checkpoint_count, checkpoint_capacity;
+	size_t indexed_bytes;      // The index covers the file up to here.
+	int64_t newline_count;     // Newlines in the indexed part of the file.
+	size_t last_line_start;    // Offset just after the last of those newlines.
+	volatile int stop;         // Set to make the indexing thread exit.
+	Thread thread;
+
+	// Only used on the UI thread.
+	ElementHandle handle;      // Progress is posted here.
+	int32_t progress_posted;   // Set while a MSG_LOG_VIEW_PROGRESS is waiting to be handled.
+	int64_t line_count;        // The line count at the last refresh.
+	int64_t scroll_line;
+	size_t scroll_offset;      // Offset of scroll_line, so painting doesn't have to go through the index.
+	int thumb_drag;
+} LogView;
+
+typedef struct {
+	Element element;
+	int row_count;
+	int row_height;   // The height of every row, or for VIRTUAL_LIST_VARIABLE_HEIGHT the scroll step.
+	int *row_offsets; // VIRTUAL_LIST_VARIABLE_HEIGHT only: the top of each row, row_count + 1 entries.
+	int scroll;       // Pixels scrolled from the top of the first row.
+	int *slot_rows;   // The row each child element is showing, or -1 if it is unused.
+	int *covered;     // Scratch space for virtual_list_layout.
+	int thumb_drag;   // Offset of the mouse from the top of the scrollbar thumb while dragging it, or -1.
+	bool refresh;     // Row count and heights need to be queried before the next layout.
+} VirtualList;
+
+// Writes the text for the value into buffer (without a NULL terminator), and returns its length.
+typedef int (*TableFormatter)(const void *value, char *buffer, int buffer_size);
+
+// A column's values are read in place: the value for row i is at data + i * stride.
+typedef struct {
+	GlyphRun title;
+	const char *data;
+	size_t stride;
+	TableFormatter format;
+	int width;
+} TableColumn;
+
+typedef struct {
+	Element element;
+	TableColumn *columns;
+	int column_count;
+	int *column_offsets;  // column_offsets[i] is the left edge of column i, from the left of the first column.
+	int row_count;
+	int scroll_x, scroll_y;
+	int resizing;         // The column being resized, or -1.
+	int drag_offset;      // Where the mouse grabbed the column edge or scrollbar thumb.
+	int dragging;         // The scrollbar being dragged: 0 for none, 1 for vertical, 2 for horizontal.
+} Table;
+
+#define PLOT_MAX_LEVELS (48)
+
+// The minimum and maximum of each aligned bucket of 2^k samples.
+typedef struct {
+	float *min, *max;
+	size_t count, capacity; // Only whole buckets are stored.
+} PlotLevel;
+
+typedef struct {
+	Element element;
+	float *samples;
+	size_t sample_count, sample_capacity;
+	PlotLevel levels[PLOT_MAX_LEVELS]; // levels[0] isn't used; the samples are level 0.
+	size_t view_first, view_count;     // The samples shown across the plot. A view_count of 0 shows them all.
+	float y_min, y_max;                // The values shown at the bottom and top. Worked out from the data if y_min >= y_max.
+	bool auto_range;
+	uint32_t color;
+} Plot;
+
+typedef enum {
+	IMAGE_FORMAT_BGRA, // 4 bytes per pixel, in the same order as the window's bits.
+	IMAGE_FORMAT_RGB,
+	IMAGE_FORMAT_RGBA,
+	IMAGE_FORMAT_GRAY,
+} ImageFormat;
+
+// Pixels in any of the formats. Level 0 of an image points into the mapped file;
+// the smaller levels are BGRA and owned by the image.
+typedef struct {
+	const uint8_t *pixels;
+	int width, height;
+	size_t stride;
+	ImageFormat format;
+} ImageLevel;
+
+#define IMAGE_MAX_LEVELS (32)
+
+typedef struct {
+	Element element;
+	MappedFile file;
+	ImageLevel levels[IMAGE_MAX_LEVELS]; // Each half the size of the one before, worked out when first needed.
+	int level_count;
+} Image;
+
 typedef struct {
 	Rect clip;         // The rectangle the element should draw into.
 	uint32_t *bits;    // The bitmap itself. bits[y * painter->width + x] gives the RGB value of pixel (x, y).
@@ -116,16 +430,101 @@ typedef enum {
 	MOUSE_BUTTON_RIGHT,
 } MouseButton;
 
+typedef enum {
+	EASE_LINEAR,
+	EASE_IN_OUT,
+	EASE_OUT,
+} Easing;
+
+typedef enum {
+	ANIMATION_INT,
+	ANIMATION_FLOAT,
+	ANIMATION_COLOR,
+} AnimationKind;
+
+// A value being moved from one value to another by element_animate_*.
+typedef struct {
+	void *target;
+	ElementHandle element;
+	AnimationKind kind;
+	Easing easing;
+	uint64_t start;     // In platform_time_ms() milliseconds.
+	uint32_t duration;
+	union {
+		struct { int from, to; } i;
+		struct { float from, to; } f;
+		struct { uint32_t from, to; } c;
+	};
+} Animation;
+
+// Input-to-present latencies of one kind of input message, see ui_latency_histogram.
+// Bucket i counts the latencies from 2^i up to 2^(i+1) microseconds; the last bucket also counts anything longer.
+#define LATENCY_BUCKETS (24)
+
+typedef struct {
+	uint32_t count;
+	uint32_t buckets[LATENCY_BUCKETS];
+	uint64_t total, max;  // In microseconds.
+} LatencyHistogram;
+
+typedef enum {
+	WINDOW_EVENT_INPUT,   // From ui_window_input_event or ui_window_mouse_event.
+	WINDOW_EVENT_RESIZE,  // From ui_window_resize.
+	WINDOW_EVENT_MESSAGE, // From ui_deliver_message.
+	WINDOW_EVENT_EXPOSE,  // The platform lost the window's contents.
+} WindowEventKind;
+
+// Something for a window with its own thread to handle, see window_thread_start.
+typedef struct {
+	WindowEventKind kind;
+	Message message;
+	int data_int;
+	void *data_ptr;
+	int x, y;             // The mouse position for input, or the size for a resize.
+	bool has_position;    // Whether the input has a mouse position.
+	uint64_t arrival;     // When the input arrived, in platform_time_us() microseconds.
+	ElementHandle element;
+	TimerId timer;        // The copy MSG_TIMER's data_ptr points to.
+	KeyTyped key;         // The copy MSG_KEY_TYPED's data_ptr points to.
+	char text[4];
+} WindowEvent;
+
 struct Window {
 	Element element;
 	uint32_t *bits; // The bitmap image of the window's content.
 	int width, height; // The size of the area of the window we can draw onto.
 	Rect update_region; // area that needs to be repainted at the next 'update point'
+	bool update_queued; // Whether the window is in the update queue, see window_queue_update.
 	int mouse_x, mouse_y;
 	Element *hovered;
 	Element *pressed;
+	Element *focused; // The element keyboard input is sent to.
 	MouseButton pressed_mouse_button;
 
+	// Animations of the window's elements, see element_animate_int.
+	Animation *animations;
+	uint32_t animation_count, animation_capacity;
+	uint64_t animation_frame;  // When the next frame is due.
+
+	// Progressive painting, see window_progressive_paint_enable. Each tile is 1 if it still has to be painted.
+	int paint_budget;  // In milliseconds, or 0 to paint everything at once.
+	uint8_t *paint_tiles;
+	int paint_tiles_x, paint_tiles_y, paint_tile_count;
+
+	// For each kind of input message, when the earliest input that hasn't been presented yet arrived, or 0.
+	uint64_t input_arrival[MSG_USER];
+
+	// The measurement statistics of the last layout pass of the window. See element_message.
+	int32_t last_measure_count, last_measure_cache_hits;
+
+	// Set by window_thread_start. The events are handed over under event_mutex.
+	bool threaded;
+	Thread thread;
+	Mutex event_mutex;
+	ConditionVariable event_wake;
+	WindowEvent *events;
+	size_t event_count, event_capacity;
+
 #ifdef PLATFORM_WIN32
 	HWND hwnd;
 	bool tracking_leave; // used for mouse input
@@ -137,15 +536,156 @@ struct Window {
 #endif
 };
 
+// A subtree waiting to be laid out by the parallel layout pool.
+typedef struct {
+	Element *element;
+	Rect bounds;
+} LayoutTask;
+
+// The rest of a walk up the hierarchy by element_mark_ancestors, past the root of
+// a task during a parallel layout pass.
+typedef struct {
+	Element *element;
+	bool measure;
+	uint32_t flags;
+} LayoutMark;
+
+// Each thread taking part in a parallel layout pass owns a deque of tasks. It pushes
+// and pops at the back, and other threads steal from the front when they run out.
+// Repaints, invalidations above the task being run and measurement statistics during 
+// the pass are collected per thread, and merged once it's finished.
+typedef struct {
+	Mutex mutex;
+	LayoutTask *tasks;
+	int head, tail, capacity;
+	Element *task; // The root of the task being run, or NULL.
+	Rect repaint;
+	LayoutMark *marks;
+	int mark_count, mark_capacity;
+	int32_t measure_count, measure_cache_hits;
+} LayoutWorker;
+
+// A slot in the table mapping handles to elements. The generation changes 
+// every time the slot is reused, so that old handles don't match.
+typedef struct {
+	Element *element;
+	Window *window;
+	uint32_t generation;
+	uint32_t next_free;
+} HandleSlot;
+
+// A message from ui_post_message. Messages are linked into a queue that any thread can push onto.
+typedef struct PostedMessage {
+	struct PostedMessage *next;
+	ElementHandle handle;
+	Message message;
+	int data_int;
+	void *data_ptr;
+} PostedMessage;
+
+// Timers are kept in a hierarchical timing wheel with 1 millisecond ticks. Level L has 
+// a slot for each of the next 64 periods of 64^L ticks; a timer goes in the lowest 
+// level that can tell when it expires, and moves down a level when its slot comes up.
+#define TIMER_WHEEL_BITS   (6)
+#define TIMER_WHEEL_SLOTS  (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS (4)
+
+typedef struct {
+	uint64_t expires;       // In platform_time_ms() milliseconds.
+	uint32_t interval;      // 0 for timers that only fire once.
+	uint32_t generation;
+	uint32_t next, prev;    // Links in the slot's list, or the free list; 0 for none.
+	uint16_t slot;          // level * TIMER_WHEEL_SLOTS + slot index.
+	ElementHandle element;
+} Timer;
+
+// Work waiting for the message loop to be idle, from ui_schedule_idle.
+typedef struct {
+	IdleCallback callback;
+	void *context;
+	int budget;  // In milliseconds.
+} IdleTask;
+
+// A function waiting for a worker, from ui_task_submit.
+typedef struct Task {
+	struct Task *next;
+	TaskFunction function;
+	void *argument;
+	ElementHandle element; // 0 if nothing wants to know when the task completes.
+} Task;
+
 typedef struct {
 	Window **windows;
 	size_t window_count;
 
+	// The windows without their own thread that ui_update has to visit. The spare array 
+	// collects the windows queued while ui_update is going through the queue.
+	Window **update_queue, **update_spare;
+	size_t update_queue_count, update_queue_capacity, update_spare_capacity;
+
+	// Timers. The wheel is only advanced on the UI thread, but window threads 
+	// can start and stop timers, under timer_mutex; timers[0] is never used.
+	Mutex timer_mutex;
+	Timer *timers;
+	uint32_t timer_count, timer_free, timer_active;
+	uint32_t timer_wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; // The first timer in each slot.
+	uint64_t timer_now;  // The last tick the wheel has processed.
+
+	// Element handles, shared with window threads under handle_mutex; slot 0 is never used.
+	Mutex handle_mutex;
+	HandleSlot *handles;
+	uint32_t handle_count, handle_free;
+
+	// Posted messages, a multiple producer single consumer queue (see ui_post_message).
+	// Producers push at the head, and the UI thread pops from the tail.
+	PostedMessage *post_head, *post_tail, post_stub;
+	int32_t post_count;  // Messages pushed and not yet popped.
+	int32_t post_wake;   // Set once the UI thread has been woken, until it pops the messages.
+
+	// Idle work, see ui_schedule_idle. Only used on the UI thread.
+	IdleTask *idle_tasks;
+	uint32_t idle_task_count, idle_task_capacity;
+	uint64_t idle_deadline;  // When the running slice has to stop.
+	uint64_t frame_time;     // How long the last ui_process_frame took, in milliseconds.
+
+	// Input recording, see ui_record_start.
+	FILE *record_file;
+	uint64_t record_time;               // platform_time_ms() of the last record.
+	int record_mouse_x, record_mouse_y; // The mouse position in the last record.
+
+	// Input latency, see ui_latency_histogram. Window threads add to the histograms under latency_mutex.
+	Mutex latency_mutex;
+	LatencyHistogram latency[MSG_USER];
+	uint64_t input_arrival;  // When the event the platform layer is handling arrived, or 0 for now.
+
+	// Tasks, see ui_task_submit. The queue is shared with the worker threads.
+	Task *task_head, *task_tail;
+	int task_worker_count;
+	Mutex task_mutex;
+	ConditionVariable task_wake;
+
 #ifdef PLATFORM_LINUX
 	Display *display;
 	Visual *visual;
 	Atom window_closed_id;
+	int64_t x_time_offset; // platform_time_us() minus the X server's time, see x_event_arrival.
+	bool x_time_known;
+	int wake_fd; // An eventfd the message loop polls alongside the X connection.
+#endif
+
+#ifdef PLATFORM_WIN32
+	DWORD ui_thread_id;
 #endif
+
+	// Parallel layout, see ui_parallel_layout_enable. Worker 0 is the UI thread.
+	LayoutWorker *layout_workers;
+	int layout_worker_count;
+	bool parallel_layout;
+	uint32_t parallel_layout_threshold; // Minimum number of descendants for a subtree to be laid out in parallel.
+	int32_t layout_tasks_queued;        // Tasks in the deques.
+	int32_t layout_tasks_pending;       // Tasks in the deques or running.
+	Mutex layout_mutex;
+	ConditionVariable layout_wake;
 } GlobalState;
 
 // Returns true if the rectangle has a positive width and height.
@@ -168,9 +708,15 @@ bool rect_contains(Rect a, int x, int y);
 Element *element_create(int bytes, Element *parent, uint32_t flags, MessageHandler message_class);
 int element_message(Element *element, Message message, int data_int, void *data_ptr);
 void element_move(Element *element, Rect bounds, bool always_layout);
+void element_arrange(Element *element, Rect bounds);
 void element_repaint(Element *element, Rect *region);
 Element *element_find_by_point(Element *element, int x, int y);
 void element_destroy(Element *element);
+void element_focus(Element *element);
+void element_measure_invalidate(Element *element);
+void element_mark_ancestors(Element *element, bool measure, uint32_t flags);
+void element_invalidate_layout(Element *element);
+void window_queue_update(Window *window);
 
 // buttons
 Button *button_create(Element *parent, uint32_t flags, char *text, int text_bytes);
@@ -178,20 +724,156 @@ Button *button_create(Element *parent, uint32_t flags, char *text, int text_byte
 // labels
 Label *label_create(Element *parent, uint32_t flags, char *text, int text_bytes);
 void label_set_text(Label *label, char *text, int text_bytes);
+void label_bind_text(Label *label, char *text, int text_bytes);
+
+// paragraphs (labels with word wrapping)
+Paragraph *paragraph_create(Element *parent, uint32_t flags, char *text, int text_bytes);
+void paragraph_set_text(Paragraph *paragraph, char *text, int text_bytes);
 
 // layout panels (horizontal and vertical)
 Panel *panel_create(Element *parent, uint32_t flags);
 
+// text boxes
+TextBox *textbox_create(Element *parent, uint32_t flags);
+void textbox_set_text(TextBox *textbox, char *text, int text_bytes);
+size_t textbox_get_text(TextBox *textbox, char *buffer, size_t buffer_size);
+
+// log views
+LogView *log_view_create(Element *parent, uint32_t flags, const char *path);
+void log_view_refresh(LogView *view);
+float log_view_progress(LogView *view, int64_t *line_count);
+
+// tables
+Table *table_create(Element *parent, uint32_t flags);
+void table_add_column(Table *table, char *title, int width, const void *data, size_t stride, TableFormatter format);
+void table_set_row_count(Table *table, int row_count);
+void table_set_column_width(Table *table, int column, int width);
+int table_format_int(const void *value, char *buffer, int buffer_size);
+int table_format_double(const void *value, char *buffer, int buffer_size);
+int table_format_string(const void *value, char *buffer, int buffer_size);
+
+// plots
+Plot *plot_create(Element *parent, uint32_t flags, uint32_t color);
+void plot_append(Plot *plot, const float *samples, size_t count);
+void plot_set_view(Plot *plot, size_t first, size_t count);
+void plot_set_range(Plot *plot, float y_min, float y_max);
+
+// images
+Image *image_create(Element *parent, uint32_t flags, const char *path);
+Image *image_create_raw(Element *parent, uint32_t flags, const char *path, int width, int height);
+void draw_image(Painter *painter, Rect destination, ImageLevel *source, bool bilinear);
+
+// flex panels
+FlexPanel *flex_panel_create(Element *parent, uint32_t flags);
+void element_set_flex(Element *element, int grow, int shrink, int min, int max);
+
+// virtual lists
+VirtualList *virtual_list_create(Element *parent, uint32_t flags, int row_height);
+void virtual_list_refresh(VirtualList *list);
+void virtual_list_set_scroll(VirtualList *list, int scroll);
+
 void draw_block(Painter *painter, Rect rect, uint32_t color);
 void draw_rect(Painter *painter, Rect r, uint32_t fill_color, uint32_t border_color);
+void draw_line(Painter *painter, int x0, int y0, int x1, int y1, uint32_t color);
 void draw_string(Painter *painter, Rect bounds, char *string, int bytes, uint32_t color, bool align_center);
+void draw_glyph(Painter *painter, int x, int y, uint8_t glyph, uint32_t color);
+void draw_glyphs(Painter *painter, Rect bounds, uint8_t *glyphs, int glyph_count, uint32_t color, bool align_center);
+
+int utf8_decode(const char *string, int bytes, uint32_t *codepoint);
+int utf8_encode(uint32_t codepoint, char *buffer);
+void glyph_run_set(GlyphRun *run, const char *text, int bytes);
 
 void platform_init(void);
 Window *platform_create_window(const char *title, int width, int height);
 int platform_message_loop(void);
 void platform_window_end_paint(Window *window, Painter *painter);
 
-GlobalState global_state;
+bool platform_thread_start(Thread *thread, ThreadFunction function, void *argument);
+void platform_thread_join(Thread thread);
+void platform_thread_yield(void);
+void platform_thread_sleep(int milliseconds);
+int platform_processor_count(void);
+void mutex_init(Mutex *mutex);
+void mutex_lock(Mutex *mutex);
+void mutex_unlock(Mutex *mutex);
+void condition_init(ConditionVariable *condition);
+void condition_wait(ConditionVariable *condition, Mutex *mutex);
+void condition_signal(ConditionVariable *condition);
+void condition_wait_timeout(ConditionVariable *condition, Mutex *mutex, int milliseconds);
+
+bool platform_file_map(MappedFile *file, const char *path);
+bool platform_file_remap(MappedFile *file);
+void platform_file_unmap(MappedFile *file);
+bool platform_file_open(FileReader *file, const char *path);
+bool platform_file_refresh(FileReader *file);
+void platform_file_close(FileReader *file);
+size_t platform_file_read(FileReader *file, size_t offset, void *buffer, size_t bytes);
+
+void ui_parallel_layout_enable(int thread_count, uint32_t threshold);
+
+ElementHandle element_handle(Element *element);
+Element *element_from_handle(ElementHandle handle);
+void ui_post_message(ElementHandle handle, Message message, int data_int, void *data_ptr);
+void ui_deliver_message(ElementHandle handle, Message message, int data_int, void *data_ptr);
+void ui_process_posted_messages(void);
+void platform_wake_ui_thread(void);
+
+TimerId element_timer_start(Element *element, uint32_t milliseconds, bool repeat);
+void ui_timer_stop(TimerId timer);
+void ui_process_timers(void);
+int ui_timer_timeout(void);
+uint64_t platform_time_ms(void);
+uint64_t platform_time_us(void);
+
+void element_animate_int(Element *element, int *target, int to, uint32_t milliseconds, Easing easing);
+void element_animate_float(Element *element, float *target, float to, uint32_t milliseconds, Easing easing);
+void element_animate_color(Element *element, uint32_t *target, uint32_t to, uint32_t milliseconds, Easing easing);
+void element_animation_stop(Element *element, void *target);
+void ui_process_animations(void);
+int ui_wait_timeout(void);
+uint32_t color_blend(uint32_t from, uint32_t to, float t);
+
+void ui_task_submit(TaskFunction function, void *argument, Element *element);
+
+void ui_schedule_idle(IdleCallback callback, void *context, int budget);
+bool ui_idle_should_yield(void);
+void ui_process_idle(void);
+void ui_process_frame(void);
+bool platform_input_pending(void);
+
+bool window_thread_start(Window *window);
+
+void window_progressive_paint_enable(Window *window, int budget);
+
+bool ui_record_start(const char *path);
+void ui_record_stop(void);
+int ui_replay(const char *path, bool real_time);
+void ui_recording_init(void);
+
+LatencyHistogram ui_latency_histogram(Message message);
+void ui_latency_reset(void);
+void ui_latency_print(FILE *file);
+void ui_latency_init(void);
+
+GlobalState global_state = {
+	.post_head = &global_state.post_stub,
+	.post_tail = &global_state.post_stub,
+};
+
+// The nesting depth of MSG_LAYOUT on this thread. The outermost MSG_LAYOUT is a layout pass.
+THREAD_LOCAL int layout_depth;
+
+// Set while this thread is taking part in a parallel layout pass.
+THREAD_LOCAL LayoutWorker *layout_worker;
+
+// Measurement statistics for this thread's current layout pass. measure_count counts the
+// MSG_GET_WIDTH/MSG_GET_HEIGHT messages that had to be handled by the element,
+// measure_cache_hits the ones answered from the cache. When the outermost
+// MSG_LAYOUT returns, the totals are copied into the window's last_* fields.
+THREAD_LOCAL int32_t measure_count, measure_cache_hits;
+
+// The window this thread was started for by window_thread_start, or NULL on the UI thread.
+THREAD_LOCAL Window *thread_window;
 
 //////////////////////////////////////////////////////////////////////////////
 // Helper functions
@@ -203,6 +885,75 @@ void string_copy(char **dest, int *dest_bytes, const char *source, int source_by
 	memcpy(*dest, source, source_bytes);
 }
 
+// Decodes the UTF-8 sequence at the start of string, and returns its length in bytes.
+// Invalid or truncated sequences decode to U+FFFD one byte at a time.
+int utf8_decode(const char *string, int bytes, uint32_t *codepoint) {
+	const uint8_t *s = (const uint8_t *) string;
+	int length = s[0] < 0x80 ? 1 : (s[0] & 0xE0) == 0xC0 ? 2 : (s[0] & 0xF0) == 0xE0 ? 3 : (s[0] & 0xF8) == 0xF0 ? 4 : 0;
+	uint32_t result = length == 1 ? s[0] : length == 2 ? s[0] & 0x1F : length == 3 ? s[0] & 0x0F : s[0] & 0x07;
+
+	if (length == 0 || length > bytes) {
+		*codepoint = 0xFFFD;
+		return 1;
+	}
+
+	for (int i = 1; i < length; ++i) {
+		if ((s[i] & 0xC0) != 0x80) {
+			*codepoint = 0xFFFD;
+			return 1;
+		}
+		result = (result << 6) | (s[i] & 0x3F);
+	}
+
+	*codepoint = result;
+	return length;
+}
+
+// Writes the UTF-8 encoding of codepoint to buffer, which must have space for 4 bytes,
+// and returns the number of bytes written.
+int utf8_encode(uint32_t codepoint, char *buffer) {
+	if (codepoint < 0x80) {
+		buffer[0] = (char) codepoint;
+		return 1;
+	} else if (codepoint < 0x800) {
+		buffer[0] = (char) (0xC0 | (codepoint >> 6));
+		buffer[1] = (char) (0x80 | (codepoint & 0x3F));
+		return 2;
+	} else if (codepoint < 0x10000) {
+		buffer[0] = (char) (0xE0 | (codepoint >> 12));
+		buffer[1] = (char) (0x80 | ((codepoint >> 6) & 0x3F));
+		buffer[2] = (char) (0x80 | (codepoint & 0x3F));
+		return 3;
+	} else {
+		buffer[0] = (char) (0xF0 | (codepoint >> 18));
+		buffer[1] = (char) (0x80 | ((codepoint >> 12) & 0x3F));
+		buffer[2] = (char) (0x80 | ((codepoint >> 6) & 0x3F));
+		buffer[3] = (char) (0x80 | (codepoint & 0x3F));
+		return 4;
+	}
+}
+
+// The font only has the ASCII glyphs; everything else is drawn as '?'.
+uint8_t glyph_index(uint32_t codepoint) {
+	return codepoint < 128 ? (uint8_t) codepoint : '?';
+}
+
+void glyph_run_set(GlyphRun *run, const char *text, int bytes) {
+	if (bytes == -1) bytes = (int) strlen(text);
+
+	// There are never more glyphs than bytes.
+	run->glyphs = realloc(run->glyphs, bytes ? bytes : 1);
+	run->glyph_count = 0;
+
+	for (int i = 0; i < bytes;) {
+		uint32_t codepoint;
+		i += utf8_decode(text + i, bytes - i, &codepoint);
+		run->glyphs[run->glyph_count++] = glyph_index(codepoint);
+	}
+
+	run->width = run->glyph_count * GLYPH_WIDTH;
+}
+
 void print_rect(const char *prefix, Rect x) {
 	fprintf(stderr, "%s: %d->%d; %d->%d\n", prefix, x.l, x.r, x.t, x.b);
 }
@@ -265,22 +1016,104 @@ Element *element_create(int bytes, Element *parent, uint32_t flags, MessageHandl
 		parent->children[parent->child_count - 1] = element;
 		element->parent = parent;
 		element->window = parent->window;
+
+		// The parent has a new child, so its size may have changed.
+		element_measure_invalidate(parent);
+
+		for (Element *ancestor = parent; ancestor; ancestor = ancestor->parent) {
+			atomic_add(&ancestor->descendant_count, 1);
+		}
 	}
 	return element;
 }
 
+void ui_parallel_layout_begin(void);
+void ui_parallel_layout_end(Window *window);
+bool ui_parallel_layout_push(Element *element, Rect bounds);
+
+bool measure_cache_find(MeasureCache *cache, int constraint, int *value) {
+	for (int i = 0; i < cache->count; i++) {
+		if (cache->constraint[i] == constraint) {
+			*value = cache->value[i];
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Add a result to the cache. If the cache wasn't valid, its old results are discarded first.
+void measure_cache_store(MeasureCache *cache, bool valid, int constraint, int value) {
+	if (!valid) {
+		cache->count = 0;
+		cache->overflow = false;
+	}
+
+	if (cache->count == MEASURE_CACHE_SIZE) {
+		// Forget the oldest result.
+		cache->overflow = true;
+		cache->count--;
+		memmove(&cache->value[0], &cache->value[1], sizeof(int) * cache->count);
+		memmove(&cache->constraint[0], &cache->constraint[1], sizeof(int) * cache->count);
+	}
+
+	cache->value[cache->count] = value;
+	cache->constraint[cache->count] = constraint;
+	cache->count++;
+}
+
 int element_message(Element *element, Message message, int data_int, void *data_ptr) {
 	if (message != MSG_DESTROY && (element->flags & ELEMENT_DESTROY))
 		return 0;
 
+	// Answer size queries from the cache if the element was already measured with this constraint.
+	int cached;
+	if ((message == MSG_GET_WIDTH && (element->flags & ELEMENT_WIDTH_CACHED) 
+			&& measure_cache_find(&element->cached_width, data_int, &cached))
+		|| (message == MSG_GET_HEIGHT && (element->flags & ELEMENT_HEIGHT_CACHED) 
+			&& measure_cache_find(&element->cached_height, data_int, &cached)))
+	{
+		++*(layout_worker ? &layout_worker->measure_cache_hits : &measure_cache_hits);
+		return cached;
+	}
+
+	// The outermost MSG_LAYOUT starts a new layout pass, so reset the statistics.
+	if (message == MSG_LAYOUT) {
+		if (layout_depth == 0) {
+			measure_count = 0;
+			measure_cache_hits = 0;
+			// The parallel layout pool only works for one pass at a time, so it's only used by the UI thread.
+			if (global_state.parallel_layout && !thread_window) ui_parallel_layout_begin();
+		}
+		++layout_depth;
+	}
+
 	int result = 0;
 	if (element->message_user) {
 		result = element->message_user(element, message, data_int, data_ptr);
-		if (result) return result;
 	}
-	if (element->message_class) {
+	if (!result && element->message_class) {
 		result = element->message_class(element, message, data_int, data_ptr);
 	}
+
+	if (message == MSG_GET_WIDTH) {
+		++*(layout_worker ? &layout_worker->measure_count : &measure_count);
+		measure_cache_store(&element->cached_width, element->flags & ELEMENT_WIDTH_CACHED, data_int, result);
+		element->flags = (element->flags | ELEMENT_WIDTH_CACHED) & ~ELEMENT_WIDTH_STALE;
+	} else if (message == MSG_GET_HEIGHT) {
+		++*(layout_worker ? &layout_worker->measure_count : &measure_count);
+		measure_cache_store(&element->cached_height, element->flags & ELEMENT_HEIGHT_CACHED, data_int, result);
+		element->flags = (element->flags | ELEMENT_HEIGHT_CACHED) & ~ELEMENT_HEIGHT_STALE;
+	} else if (message == MSG_LAYOUT) {
+		if (layout_depth == 1) {
+			// Wait for any subtrees handed to the parallel layout pool before ending the pass.
+			if (layout_worker) ui_parallel_layout_end(element->window);
+			element->window->last_measure_count = measure_count;
+			element->window->last_measure_cache_hits = measure_cache_hits;
+		}
+		--layout_depth;
+	}
+
 	return result;
 }
 
@@ -301,16 +1134,33 @@ void element_move(Element *element, Rect bounds, bool always_layout) {
 	// element_repaint(element, NULL);
 }
 
+// Like element_move(element, bounds, false), but during a parallel layout pass
+// a large enough subtree is handed over to the thread pool instead.
+void element_arrange(Element *element, Rect bounds) {
+	if (layout_worker && element->descendant_count >= global_state.parallel_layout_threshold
+		&& ui_parallel_layout_push(element, bounds)) 
+	{
+		return;
+	}
+
+	element_move(element, bounds, false);
+}
+
 void element_repaint(Element *element, Rect *region) {
 	if (!region) region = &element->bounds;
 
+	// During a parallel layout pass, each thread collects its repaints separately.
+	Rect *update_region = layout_worker ? &layout_worker->repaint : &element->window->update_region;
+
 	Rect r = rect_intersection(element->clip, *region);
 	if (rect_valid(r)) {
-		if (rect_valid(element->window->update_region)) {
-			element->window->update_region = rect_bounding(element->window->update_region, r);
+		if (rect_valid(*update_region)) {
+			*update_region = rect_bounding(*update_region, r);
 		} else {
-			element->window->update_region = r;
+			*update_region = r;
 		}
+
+		if (!layout_worker) window_queue_update(element->window);
 	}
 }
 
@@ -333,13 +1183,14 @@ void element_destroy(Element *element) {
 	// Set the flag indicating the element needs to be destroyed in the next ui_update(),
 	// that is, once the input event is finished processing.
 	element->flags |= ELEMENT_DESTROY;
+	if (!layout_worker) window_queue_update(element->window);
 
 	// Mark the ancestors of this element with a flag so the we can find 
 	// this element in ui_update() when traversing the hierarchy.
-	Element *ancestor = element->parent;
-	while (ancestor) {
-		ancestor->flags |= ELEMENT_DESTROY_DESCENDENT;
-		ancestor = ancestor->parent;
+	// Layouts skip elements marked for destruction, so the parent's size may have changed.
+	// (If the parent is also being destroyed, there's no point.)
+	if (element->parent) {
+		element_mark_ancestors(element, !(element->parent->flags & ELEMENT_DESTROY), ELEMENT_DESTROY_DESCENDENT);
 	}
 
 	// Recurse to destroy all the descendents.
@@ -348,6 +1199,87 @@ void element_destroy(Element *element) {
 	}
 }
 
+// Discard the cached sizes of the element and all its ancestors. Must be called
+// whenever something that affects the result of MSG_GET_WIDTH or MSG_GET_HEIGHT
+// changes, e.g. the text of a label or the children of a panel.
+void element_measure_invalidate(Element *element) {
+	element_mark_ancestors(element, true, 0);
+}
+
+// Discard the cached sizes of the element and its ancestors if measure is set, and set flags on its ancestors.
+// During a parallel layout pass, the ancestors above the task a thread is running are shared with
+// other threads, so the walk stops at the task's root, and ui_parallel_layout_end finishes it.
+void element_mark_ancestors(Element *element, bool measure, uint32_t flags) {
+	for (Element *ancestor = element; ancestor; ancestor = ancestor->parent) {
+		// Keep the old values around, marked as stale, for element_measure_changed.
+		if (measure && (ancestor->flags & ELEMENT_WIDTH_CACHED)) {
+			ancestor->flags = (ancestor->flags & ~ELEMENT_WIDTH_CACHED) | ELEMENT_WIDTH_STALE;
+		}
+		if (measure && (ancestor->flags & ELEMENT_HEIGHT_CACHED)) {
+			ancestor->flags = (ancestor->flags & ~ELEMENT_HEIGHT_CACHED) | ELEMENT_HEIGHT_STALE;
+		}
+		if (ancestor != element) {
+			ancestor->flags |= flags;
+		}
+
+		if (layout_worker && ancestor == layout_worker->task) {
+			LayoutWorker *worker = layout_worker;
+			if (worker->mark_count == worker->mark_capacity) {
+				worker->mark_capacity = worker->mark_capacity ? worker->mark_capacity * 2 : 16;
+				worker->marks = realloc(worker->marks, sizeof(LayoutMark) * worker->mark_capacity);
+			}
+			worker->marks[worker->mark_count++] = (LayoutMark){ .element = ancestor, .measure = measure, .flags = flags };
+			return;
+		}
+	}
+}
+
+// Re-measure an element whose cached size is stale, using each of the constraints
+// it was measured with before, and return true if any result is different. If some of
+// the constraints were forgotten, the parent might have used them, so assume a change.
+// Axes that were never measured can't have affected the parent's layout, so they
+// are ignored.
+bool element_measure_changed(Element *element) {
+	bool changed = false;
+	if (element->flags & ELEMENT_WIDTH_STALE) {
+		MeasureCache old = element->cached_width;
+		changed |= old.overflow;
+		for (int i = 0; i < old.count; i++) {
+			changed |= old.value[i] != element_message(element, MSG_GET_WIDTH, old.constraint[i], 0);
+		}
+	}
+	if (element->flags & ELEMENT_HEIGHT_STALE) {
+		MeasureCache old = element->cached_height;
+		changed |= old.overflow;
+		for (int i = 0; i < old.count; i++) {
+			changed |= old.value[i] != element_message(element, MSG_GET_HEIGHT, old.constraint[i], 0);
+		}
+	}
+	return changed;
+}
+
+// Mark the element as needing layout at the next ui_update(). Only the dirty
+// parts of the hierarchy are visited, and the relayout only spreads to an
+// ancestor when the element's size changed.
+void element_invalidate_layout(Element *element) {
+	element->flags |= ELEMENT_LAYOUT_DIRTY;
+	if (!layout_worker) window_queue_update(element->window);
+
+	// Discard the cached sizes, and mark the ancestors so that ui_update() can find this element.
+	element_mark_ancestors(element, true, ELEMENT_LAYOUT_DESCENDENT);
+}
+
+// Send keyboard input to the element. It gets MSG_UPDATE with UPDATE_FOCUSED, 
+// as does the element that had focus before.
+void element_focus(Element *element) {
+	Window *window = element->window;
+	Element *previous = window->focused;
+	if (previous == element) return;
+	window->focused = element;
+	if (previous) element_message(previous, MSG_UPDATE, UPDATE_FOCUSED, 0);
+	element_message(element, MSG_UPDATE, UPDATE_FOCUSED, 0);
+}
+
 //////////////////////////////////////////////////////////////////////////////
 // Buttons
 //////////////////////////////////////////////////////////////////////////////
@@ -369,19 +1301,20 @@ int button_message(Element *element, Message message, int data_int, void *data_p
 			}
 		}
 		draw_rect(painter, element->bounds, bg_color, text_color);
-		draw_string(painter, element->bounds, button->text, button->text_bytes, text_color, true); 
+		draw_glyphs(painter, element->bounds, button->run.glyphs, button->run.glyph_count, text_color, true); 
 
 	} else if (message == MSG_UPDATE) {
 		element_repaint(element, NULL);
 
 	} else if (message == MSG_GET_WIDTH) {
-		return 30 + GLYPH_WIDTH * button->text_bytes;
+		return 30 + button->run.width;
 
 	} else if (message == MSG_GET_HEIGHT) {
 		return 25;
 		
 	} else if (message == MSG_DESTROY) {
 		free(button->text);
+		free(button->run.glyphs);
 	}
 
 	return 0;
@@ -391,6 +1324,7 @@ int button_message(Element *element, Message message, int data_int, void *data_p
 Button *button_create(Element *parent, uint32_t flags, char *text, int text_bytes) {
 	Button *button = (Button*)element_create(sizeof(Button), parent, flags, button_message);
 	string_copy(&button->text, &button->text_bytes, text, text_bytes);
+	glyph_run_set(&button->run, button->text, button->text_bytes);
 	return button;
 }
 
@@ -402,17 +1336,18 @@ int label_message(Element *element, Message message, int data_int, void *data_pt
 	Label *label = (Label*)element;
 	if (message == MSG_PAINT) {
 		Painter *painter = (Painter*)data_ptr;
-		draw_string(painter, element->bounds, label->text, label->text_bytes, 0x000000, 
+		draw_glyphs(painter, element->bounds, label->run.glyphs, label->run.glyph_count, 0x000000, 
 			element->flags & LABEL_CENTER); 
 
 	} else if (message == MSG_GET_WIDTH) {
-		return GLYPH_WIDTH * label->text_bytes;
+		return label->run.width;
 
 	} else if (message == MSG_GET_HEIGHT) {
 		return GLYPH_HEIGHT;
 
 	} else if (message == MSG_DESTROY) {
 		free(label->text);
+		free(label->run.glyphs);
 	}
 
 	return 0;
@@ -422,11 +1357,201 @@ int label_message(Element *element, Message message, int data_int, void *data_pt
 Label *label_create(Element *parent, uint32_t flags, char *text, int text_bytes) {
 	Label *label = (Label*)element_create(sizeof(Label), parent, flags, label_message);
 	string_copy(&label->text, &label->text_bytes, text, text_bytes);
+	glyph_run_set(&label->run, label->text, label->text_bytes);
 	return label;
 }
 
 void label_set_text(Label *label, char *text, int text_bytes) {
 	string_copy(&label->text, &label->text_bytes, text, text_bytes);
+	glyph_run_set(&label->run, label->text, label->text_bytes);
+	element_invalidate_layout(&label->element);
+}
+
+// Like label_set_text, for labels whose size is decided by their parent rather than their text,
+// such as the rows of a virtual list. The label is only repainted, and its ancestors aren't laid out again.
+void label_bind_text(Label *label, char *text, int text_bytes) {
+	string_copy(&label->text, &label->text_bytes, text, text_bytes);
+	glyph_run_set(&label->run, label->text, label->text_bytes);
+
+	// Its own cached size is for the old text, so it must be measured again if anyone asks.
+	label->element.flags &= ~(ELEMENT_WIDTH_CACHED | ELEMENT_HEIGHT_CACHED);
+	element_repaint(&label->element, NULL);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Paragraphs
+//////////////////////////////////////////////////////////////////////////////
+// Lines are broken at the last space that fits, or mid-word if there isn't one,
+// and always at '\n'. Working out line i only looks at the glyphs from its start
+// up to columns glyphs further, which is what makes incremental updates possible.
+
+// Returns the start of the line after the one starting at start.
+int paragraph_next_line(Paragraph *paragraph, int start, int columns, int *end) {
+	uint8_t *glyphs = paragraph->run.glyphs;
+	int count = paragraph->run.glyph_count;
+	int limit = MIN(count, start + columns);
+
+	for (int i = start; i < limit; ++i) {
+		if (glyphs[i] == '\n') {
+			*end = i;
+			return i + 1;
+		}
+	}
+
+	if (limit == count) {
+		*end = count;
+		return count;
+	}
+
+	// The glyph just past the end of the line can be a space to break at too.
+	for (int i = limit; i > start; --i) {
+		if (glyphs[i] == ' ') {
+			*end = i;
+			return i + 1;
+		}
+	}
+
+	*end = limit;
+	return limit;
+}
+
+// Returns the line breaks for the given width, working out any lines not yet known.
+LineBreaks *paragraph_line_breaks(Paragraph *paragraph, int width) {
+	int columns = width > 0 ? MAX(1, width / GLYPH_WIDTH) : MAX(1, paragraph->longest_line);
+
+	// Look for a cache entry with this width, otherwise reuse the least recently used one.
+	LineBreaks *breaks = &paragraph->breaks[0];
+	for (int i = 0; i < PARAGRAPH_BREAK_CACHE_SIZE; ++i) {
+		if (paragraph->breaks[i].columns == columns) {
+			breaks = &paragraph->breaks[i];
+			break;
+		} else if (paragraph->breaks[i].last_used < breaks->last_used) {
+			breaks = &paragraph->breaks[i];
+		}
+	}
+
+	if (breaks->columns != columns) {
+		breaks->columns = columns;
+		breaks->line_count = 0;
+		breaks->complete = false;
+		if (!breaks->capacity) {
+			breaks->capacity = 16;
+			breaks->line_starts = realloc(breaks->line_starts, sizeof(int) * breaks->capacity);
+		}
+		breaks->line_starts[0] = 0;
+	}
+
+	breaks->last_used = ++paragraph->use_counter;
+
+	// Work out the lines from the first unknown one to the end of the text.
+	while (!breaks->complete) {
+		int start = breaks->line_starts[breaks->line_count], end;
+
+		if (start == paragraph->run.glyph_count && breaks->line_count) {
+			breaks->complete = true;
+			break;
+		}
+
+		int next = paragraph_next_line(paragraph, start, columns, &end);
+
+		if (breaks->line_count + 2 > breaks->capacity) {
+			breaks->capacity *= 2;
+			breaks->line_starts = realloc(breaks->line_starts, sizeof(int) * breaks->capacity);
+		}
+
+		breaks->line_starts[++breaks->line_count] = next;
+		if (next == paragraph->run.glyph_count) breaks->complete = true;
+	}
+
+	return breaks;
+}
+
+int paragraph_message(Element *element, Message message, int data_int, void *data_ptr) {
+	Paragraph *paragraph = (Paragraph*)element;
+
+	if (message == MSG_PAINT) {
+		Painter *painter = (Painter*)data_ptr;
+		LineBreaks *breaks = paragraph_line_breaks(paragraph, element->bounds.r - element->bounds.l);
+
+		// Only draw the lines inside the clip.
+		int first = MAX(0, (painter->clip.t - element->bounds.t) / GLYPH_HEIGHT);
+		int last = MIN(breaks->line_count, (painter->clip.b - element->bounds.t + GLYPH_HEIGHT - 1) / GLYPH_HEIGHT);
+
+		for (int i = first; i < last; ++i) {
+			int start = breaks->line_starts[i], end;
+			paragraph_next_line(paragraph, start, breaks->columns, &end);
+			int y = element->bounds.t + i * GLYPH_HEIGHT;
+			draw_glyphs(painter, rect_make(element->bounds.l, element->bounds.r, y, y + GLYPH_HEIGHT), 
+				paragraph->run.glyphs + start, end - start, 0x000000, false);
+		}
+
+	} else if (message == MSG_GET_WIDTH) {
+		return paragraph->longest_line * GLYPH_WIDTH;
+
+	} else if (message == MSG_GET_HEIGHT) {
+		return MAX(1, paragraph_line_breaks(paragraph, data_int)->line_count) * GLYPH_HEIGHT;
+
+	} else if (message == MSG_DESTROY) {
+		free(paragraph->text);
+		free(paragraph->run.glyphs);
+		for (int i = 0; i < PARAGRAPH_BREAK_CACHE_SIZE; ++i) {
+			free(paragraph->breaks[i].line_starts);
+		}
+	}
+
+	return 0;
+}
+
+void paragraph_set_text(Paragraph *paragraph, char *text, int text_bytes) {
+	// Keep the old glyphs to find where the text starts to differ.
+	GlyphRun old_run = paragraph->run;
+	paragraph->run = (GlyphRun){0};
+	string_copy(&paragraph->text, &paragraph->text_bytes, text, text_bytes);
+	glyph_run_set(&paragraph->run, paragraph->text, paragraph->text_bytes);
+
+	int changed = 0;
+	while (changed < old_run.glyph_count && changed < paragraph->run.glyph_count 
+		&& old_run.glyphs[changed] == paragraph->run.glyphs[changed]) 
+	{
+		++changed;
+	}
+
+	free(old_run.glyphs);
+
+	// A line only depends on the glyphs up to columns past its start, so the lines 
+	// before that reach the first change are still correct.
+	for (int i = 0; i < PARAGRAPH_BREAK_CACHE_SIZE; ++i) {
+		LineBreaks *breaks = &paragraph->breaks[i];
+		if (!breaks->columns) continue;
+		int line = 0;
+		while (line < breaks->line_count && breaks->line_starts[line] + breaks->columns < changed) ++line;
+		breaks->line_count = line;
+		breaks->complete = false;
+	}
+
+	paragraph->longest_line = 0;
+	for (int i = 0, line_start = 0; i <= paragraph->run.glyph_count; ++i) {
+		if (i == paragraph->run.glyph_count || paragraph->run.glyphs[i] == '\n') {
+			paragraph->longest_line = MAX(paragraph->longest_line, i - line_start);
+			line_start = i + 1;
+		}
+	}
+
+	// An unwrapped paragraph is cached with as many columns as the longest line, which may have changed.
+	for (int i = 0; i < PARAGRAPH_BREAK_CACHE_SIZE; ++i) {
+		if (paragraph->breaks[i].columns == MAX(1, paragraph->longest_line)) {
+			paragraph->breaks[i].line_count = 0;
+		}
+	}
+
+	element_invalidate_layout(&paragraph->element);
+}
+
+// text_bytes of -1 indicates a NULL terminated string
+Paragraph *paragraph_create(Element *parent, uint32_t flags, char *text, int text_bytes) {
+	Paragraph *paragraph = (Paragraph*)element_create(sizeof(Paragraph), parent, flags, paragraph_message);
+	paragraph_set_text(paragraph, text, text_bytes);
+	return paragraph;
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -508,7 +1633,7 @@ int panel_layout(Panel *panel, Rect bounds, bool measure) {
 				.t = bounds.t + padding_other_axis + (panel_height - child_height)/2,
 				.b = bounds.t + padding_other_axis + (panel_height + child_height)/2,
 			};
-			if (!measure) element_move(child, new_pos, false);
+			if (!measure) element_arrange(child, new_pos);
 			position += child_width + panel->gap;
 
 		} else { 
@@ -528,7 +1653,7 @@ int panel_layout(Panel *panel, Rect bounds, bool measure) {
 				.t = bounds.t + position,
 				.b = bounds.t + position + child_height,
 			};
-			if (!measure) element_move(child, new_pos, false);
+			if (!measure) element_arrange(child, new_pos);
 			position += child_height + panel->gap;
 		}
 	}
@@ -600,10 +1725,1989 @@ Panel *panel_create(Element *parent, uint32_t flags) {
 
 
 //////////////////////////////////////////////////////////////////////////////
-// Drawing helpers
+// Gap Buffers
 //////////////////////////////////////////////////////////////////////////////
+size_t gap_buffer_length(GapBuffer *gap) {
+	return gap->capacity - (gap->gap_end - gap->gap_start);
+}
 
-// Taken from https://commons.wikimedia.org/wiki/File:Codepage-437.png
+char gap_buffer_at(GapBuffer *gap, size_t position) {
+	return gap->buffer[position < gap->gap_start ? position : position + gap->gap_end - gap->gap_start];
+}
+
+void gap_buffer_move_gap(GapBuffer *gap, size_t position) {
+	if (position < gap->gap_start) {
+		size_t bytes = gap->gap_start - position;
+		memmove(gap->buffer + gap->gap_end - bytes, gap->buffer + position, bytes);
+		gap->gap_start -= bytes;
+		gap->gap_end -= bytes;
+	} else if (position > gap->gap_start) {
+		size_t bytes = position - gap->gap_start;
+		memmove(gap->buffer + gap->gap_start, gap->buffer + gap->gap_end, bytes);
+		gap->gap_start += bytes;
+		gap->gap_end += bytes;
+	}
+}
+
+void gap_buffer_insert(GapBuffer *gap, size_t position, const char *text, size_t bytes) {
+	if (gap->gap_end - gap->gap_start < bytes) {
+		// Grow the buffer, and move the text after the gap to the end of it.
+		size_t after = gap->capacity - gap->gap_end;
+		size_t capacity = MAX(gap->capacity * 2, gap->capacity + bytes + 64);
+		gap->buffer = realloc(gap->buffer, capacity);
+		memmove(gap->buffer + capacity - after, gap->buffer + gap->gap_end, after);
+		gap->gap_end = capacity - after;
+		gap->capacity = capacity;
+	}
+
+	gap_buffer_move_gap(gap, position);
+	memcpy(gap->buffer + gap->gap_start, text, bytes);
+	gap->gap_start += bytes;
+}
+
+void gap_buffer_delete(GapBuffer *gap, size_t position, size_t bytes) {
+	gap_buffer_move_gap(gap, position);
+	gap->gap_end += bytes;
+}
+
+// Returns the position of the first '\n' at or after position, or the length if there isn't one.
+size_t gap_buffer_find_newline(GapBuffer *gap, size_t position) {
+	size_t gap_bytes = gap->gap_end - gap->gap_start;
+	if (!gap->buffer) return 0;
+
+	if (position < gap->gap_start) {
+		char *newline = memchr(gap->buffer + position, '\n', gap->gap_start - position);
+		if (newline) return newline - gap->buffer;
+		position = gap->gap_start;
+	}
+
+	char *newline = memchr(gap->buffer + position + gap_bytes, '\n', gap->capacity - position - gap_bytes);
+	return newline ? (size_t) (newline - gap->buffer) - gap_bytes : gap_buffer_length(gap);
+}
+
+// Returns the start of the line containing position.
+size_t gap_buffer_line_start(GapBuffer *gap, size_t position) {
+	while (position && gap_buffer_at(gap, position - 1) != '\n') --position;
+	return position;
+}
+
+int gap_buffer_decode(GapBuffer *gap, size_t position, uint32_t *codepoint) {
+	char bytes[4];
+	int count = 0;
+	size_t length = gap_buffer_length(gap);
+	while (count < 4 && position + count < length) {
+		bytes[count] = gap_buffer_at(gap, position + count);
+		++count;
+	}
+	return utf8_decode(bytes, count, codepoint);
+}
+
+// Returns the number of codepoints in [from, to).
+int gap_buffer_count_codepoints(GapBuffer *gap, size_t from, size_t to) {
+	int count = 0;
+	for (size_t i = from; i < to; ++i) {
+		if ((gap_buffer_at(gap, i) & 0xC0) != 0x80) ++count;
+	}
+	return count;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Text Boxes
+//////////////////////////////////////////////////////////////////////////////
+// After an edit, only the cells that changed are repainted: the rest of the row 
+// for edits within a line, and the rows below too when lines are added or removed.
+#define TEXTBOX_MULTILINE (1 << 0)
+#define TEXTBOX_PADDING   (4)
+
+Rect textbox_text_area(TextBox *textbox) {
+	Rect bounds = textbox->element.bounds;
+	return rect_make(bounds.l + TEXTBOX_PADDING, bounds.r - TEXTBOX_PADDING, bounds.t + TEXTBOX_PADDING, bounds.b - TEXTBOX_PADDING);
+}
+
+int textbox_visible_rows(TextBox *textbox) {
+	Rect area = textbox_text_area(textbox);
+	return MAX(1, (area.b - area.t) / GLYPH_HEIGHT);
+}
+
+int textbox_visible_columns(TextBox *textbox) {
+	Rect area = textbox_text_area(textbox);
+	return MAX(1, (area.r - area.l) / GLYPH_WIDTH);
+}
+
+// The rectangle covering the cells from (line, column) to the right edge of the text box,
+// and also all the rows below it if to_bottom is set. The cursor is drawn 1 pixel
+// to the left of its cell, so that is included too.
+Rect textbox_cells(TextBox *textbox, int line, int column, bool to_bottom) {
+	Rect area = textbox_text_area(textbox);
+	int x = area.l + (column - textbox->scroll_column) * GLYPH_WIDTH - 1;
+	int y = area.t + (line - textbox->scroll_line) * GLYPH_HEIGHT;
+	return rect_make(MAX(x, area.l - 1), area.r, y, to_bottom ? area.b : y + GLYPH_HEIGHT);
+}
+
+void textbox_repaint_cursor(TextBox *textbox) {
+	Rect cell = textbox_cells(textbox, textbox->cursor_line, textbox->cursor_column, false);
+	cell.r = MIN(cell.r, cell.l + GLYPH_WIDTH + 2);
+	element_repaint(&textbox->element, &cell);
+}
+
+// Scroll so the cursor is visible. Returns true if the text box had to scroll.
+bool textbox_scroll_to_cursor(TextBox *textbox) {
+	int rows = textbox_visible_rows(textbox), columns = textbox_visible_columns(textbox);
+	int scroll_line = textbox->scroll_line, scroll_column = textbox->scroll_column;
+
+	if (textbox->cursor_line < scroll_line) scroll_line = textbox->cursor_line;
+	if (textbox->cursor_line >= scroll_line + rows) scroll_line = textbox->cursor_line - rows + 1;
+	if (textbox->cursor_column < scroll_column) scroll_column = textbox->cursor_column;
+	if (textbox->cursor_column >= scroll_column + columns) scroll_column = textbox->cursor_column - columns + 1;
+
+	if (scroll_line == textbox->scroll_line && scroll_column == textbox->scroll_column) {
+		return false;
+	}
+
+	if (scroll_line != textbox->scroll_line) {
+		// Find the start of the first visible line by going back from the cursor's line.
+		size_t offset = textbox->cursor_line_start;
+		for (int i = textbox->cursor_line; i > scroll_line; --i) {
+			offset = gap_buffer_line_start(&textbox->text, offset - 1);
+		}
+		textbox->scroll_offset = offset;
+	}
+
+	textbox->scroll_line = scroll_line;
+	textbox->scroll_column = scroll_column;
+	element_repaint(&textbox->element, NULL);
+	return true;
+}
+
+// Returns the position columns codepoints into the line starting at start, or the end of the line.
+size_t textbox_walk_columns(TextBox *textbox, size_t start, int columns, int *reached) {
+	size_t length = gap_buffer_length(&textbox->text);
+	*reached = 0;
+	while (*reached < columns && start < length && gap_buffer_at(&textbox->text, start) != '\n') {
+		uint32_t codepoint;
+		start += gap_buffer_decode(&textbox->text, start, &codepoint);
+		++*reached;
+	}
+	return start;
+}
+
+void textbox_move(TextBox *textbox, KeyKind key) {
+	GapBuffer *text = &textbox->text;
+	size_t length = gap_buffer_length(text);
+
+	if (key == KEY_LEFT && textbox->cursor) {
+		if (gap_buffer_at(text, textbox->cursor - 1) == '\n') {
+			textbox->cursor--;
+			textbox->cursor_line--;
+			textbox->cursor_line_start = gap_buffer_line_start(text, textbox->cursor);
+			textbox->cursor_column = gap_buffer_count_codepoints(text, textbox->cursor_line_start, textbox->cursor);
+		} else {
+			do textbox->cursor--; while (textbox->cursor && (gap_buffer_at(text, textbox->cursor) & 0xC0) == 0x80);
+			textbox->cursor_column--;
+		}
+	} else if (key == KEY_RIGHT && textbox->cursor < length) {
+		uint32_t codepoint;
+		textbox->cursor += gap_buffer_decode(text, textbox->cursor, &codepoint);
+		if (codepoint == '\n') {
+			textbox->cursor_line++;
+			textbox->cursor_line_start = textbox->cursor;
+			textbox->cursor_column = 0;
+		} else {
+			textbox->cursor_column++;
+		}
+	} else if (key == KEY_HOME) {
+		textbox->cursor = textbox->cursor_line_start;
+		textbox->cursor_column = 0;
+	} else if (key == KEY_END) {
+		size_t end = gap_buffer_find_newline(text, textbox->cursor);
+		textbox->cursor_column += gap_buffer_count_codepoints(text, textbox->cursor, end);
+		textbox->cursor = end;
+	} else if (key == KEY_UP && textbox->cursor_line) {
+		textbox->cursor_line--;
+		textbox->cursor_line_start = gap_buffer_line_start(text, textbox->cursor_line_start - 1);
+		textbox->cursor = textbox_walk_columns(textbox, textbox->cursor_line_start, textbox->cursor_column, &textbox->cursor_column);
+	} else if (key == KEY_DOWN && textbox->cursor_line < textbox->line_count - 1) {
+		textbox->cursor_line++;
+		textbox->cursor_line_start = gap_buffer_find_newline(text, textbox->cursor) + 1;
+		textbox->cursor = textbox_walk_columns(textbox, textbox->cursor_line_start, textbox->cursor_column, &textbox->cursor_column);
+	}
+}
+
+void textbox_insert(TextBox *textbox, const char *text, int bytes) {
+	int newlines = 0, columns = 0;
+	size_t last_line_start = 0;
+
+	for (int i = 0; i < bytes; ++i) {
+		if (text[i] == '\n') {
+			++newlines;
+			last_line_start = i + 1;
+			columns = 0;
+		} else if ((text[i] & 0xC0) != 0x80) {
+			++columns;
+		}
+	}
+
+	Rect changed = textbox_cells(textbox, textbox->cursor_line, textbox->cursor_column, newlines);
+	gap_buffer_insert(&textbox->text, textbox->cursor, text, bytes);
+
+	if (newlines) {
+		textbox->line_count += newlines;
+		textbox->cursor_line += newlines;
+		textbox->cursor_line_start = textbox->cursor + last_line_start;
+		textbox->cursor_column = columns;
+	} else {
+		textbox->cursor_column += columns;
+	}
+
+	textbox->cursor += bytes;
+	element_repaint(&textbox->element, &changed);
+}
+
+// Deletes the codepoint after the cursor.
+void textbox_delete(TextBox *textbox) {
+	if (textbox->cursor == gap_buffer_length(&textbox->text)) return;
+	uint32_t codepoint;
+	int bytes = gap_buffer_decode(&textbox->text, textbox->cursor, &codepoint);
+	Rect changed = textbox_cells(textbox, textbox->cursor_line, textbox->cursor_column, codepoint == '\n');
+	gap_buffer_delete(&textbox->text, textbox->cursor, bytes);
+	if (codepoint == '\n') textbox->line_count--;
+	element_repaint(&textbox->element, &changed);
+}
+
+int textbox_message(Element *element, Message message, int data_int, void *data_ptr) {
+	TextBox *textbox = (TextBox*)element;
+	GapBuffer *text = &textbox->text;
+	bool multiline = element->flags & TEXTBOX_MULTILINE;
+
+	if (message == MSG_PAINT) {
+		Painter *painter = (Painter*)data_ptr;
+		draw_rect(painter, element->bounds, 0xFFFFFF, 0x000000);
+
+		Rect area = textbox_text_area(textbox);
+		Rect old_clip = painter->clip;
+		painter->clip = rect_intersection(old_clip, rect_make(area.l - 1, area.r, area.t, area.b));
+
+		size_t length = gap_buffer_length(text);
+		size_t offset = textbox->scroll_offset;
+		int rows = textbox_visible_rows(textbox), columns = textbox_visible_columns(textbox);
+
+		for (int row = 0; row < rows && textbox->scroll_line + row < textbox->line_count; ++row) {
+			int y = area.t + row * GLYPH_HEIGHT;
+
+			// Only decode the rows inside the clip.
+			if (y < painter->clip.b && y + GLYPH_HEIGHT > painter->clip.t) {
+				size_t position = offset;
+				for (int column = 0; position < length && column < textbox->scroll_column + columns; ++column) {
+					uint32_t codepoint;
+					position += gap_buffer_decode(text, position, &codepoint);
+					if (codepoint == '\n') break;
+					if (column < textbox->scroll_column) continue;
+					draw_glyph(painter, area.l + (column - textbox->scroll_column) * GLYPH_WIDTH, y, glyph_index(codepoint), 0x000000);
+				}
+			}
+
+			offset = gap_buffer_find_newline(text, offset);
+			if (offset == length) break;
+			++offset;
+		}
+
+		if (element->window->focused == element) {
+			int x = area.l + (textbox->cursor_column - textbox->scroll_column) * GLYPH_WIDTH;
+			int y = area.t + (textbox->cursor_line - textbox->scroll_line) * GLYPH_HEIGHT;
+			draw_block(painter, rect_make(x - 1, x + 1, y, y + GLYPH_HEIGHT), 0x000000);
+		}
+
+		painter->clip = old_clip;
+
+	} else if (message == MSG_KEY_TYPED) {
+		KeyTyped *key = (KeyTyped*)data_ptr;
+		size_t old_cursor = textbox->cursor;
+		int old_line = textbox->cursor_line, old_column = textbox->cursor_column;
+		bool edited = false;
+
+		if (key->code == KEY_BACKSPACE) {
+			if (textbox->cursor) {
+				textbox_move(textbox, KEY_LEFT);
+				textbox_delete(textbox);
+				edited = true;
+			}
+		} else if (key->code == KEY_DELETE) {
+			edited = textbox->cursor < gap_buffer_length(text);
+			textbox_delete(textbox);
+		} else if (key->code == KEY_ENTER) {
+			if (multiline) {
+				textbox_insert(textbox, "\n", 1);
+				edited = true;
+			}
+		} else if (key->code == KEY_NONE) {
+			// Single line text boxes drop any newlines in the text.
+			for (int i = 0; i < key->bytes;) {
+				int end = i;
+				while (end < key->bytes && (multiline || (key->text[end] != '\n' && key->text[end] != '\r'))) ++end;
+				if (end > i) textbox_insert(textbox, key->text + i, end - i);
+				i = end + 1;
+			}
+			edited = key->bytes > 0;
+		} else {
+			textbox_move(textbox, key->code);
+		}
+
+		if (textbox->cursor != old_cursor || textbox->cursor_line != old_line || textbox->cursor_column != old_column) {
+			// Repaint where the cursor was, and where it is now.
+			Rect cell = textbox_cells(textbox, old_line, old_column, false);
+			cell.r = MIN(cell.r, cell.l + GLYPH_WIDTH + 2);
+			element_repaint(element, &cell);
+			textbox_repaint_cursor(textbox);
+		}
+
+		textbox_scroll_to_cursor(textbox);
+		if (edited) element_message(element, MSG_VALUE_CHANGED, 0, 0);
+		return 1;
+
+	} else if (message == MSG_MOUSE_LEFT_DOWN) {
+		Rect area = textbox_text_area(textbox);
+		int row = MAX(0, (element->window->mouse_y - area.t) / GLYPH_HEIGHT);
+		int column = textbox->scroll_column + MAX(0, (element->window->mouse_x - area.l + GLYPH_WIDTH / 2) / GLYPH_WIDTH);
+		row = MIN(row, textbox->line_count - 1 - textbox->scroll_line);
+
+		textbox_repaint_cursor(textbox);
+		size_t offset = textbox->scroll_offset;
+		for (int i = 0; i < row; ++i) offset = gap_buffer_find_newline(text, offset) + 1;
+		textbox->cursor_line = textbox->scroll_line + row;
+		textbox->cursor_line_start = offset;
+		textbox->cursor = textbox_walk_columns(textbox, offset, column, &textbox->cursor_column);
+		textbox_repaint_cursor(textbox);
+		textbox_scroll_to_cursor(textbox);
+		element_focus(element);
+
+	} else if (message == MSG_MOUSE_WHEEL && multiline) {
+		// Scrolling by whole lines, so the offset of the first visible line can be moved along.
+		int target = MIN(MAX(textbox->scroll_line + data_int * 3, 0), MAX(0, textbox->line_count - 1));
+		for (; textbox->scroll_line < target; ++textbox->scroll_line) {
+			textbox->scroll_offset = gap_buffer_find_newline(text, textbox->scroll_offset) + 1;
+		}
+		for (; textbox->scroll_line > target; --textbox->scroll_line) {
+			textbox->scroll_offset = gap_buffer_line_start(text, textbox->scroll_offset - 1);
+		}
+		element_repaint(element, NULL);
+		return 1;
+
+	} else if (message == MSG_UPDATE && data_int == UPDATE_FOCUSED) {
+		textbox_repaint_cursor(textbox);
+
+	} else if (message == MSG_LAYOUT) {
+		textbox_scroll_to_cursor(textbox);
+
+	} else if (message == MSG_GET_WIDTH) {
+		return 200;
+
+	} else if (message == MSG_GET_HEIGHT) {
+		return (multiline ? 5 : 1) * GLYPH_HEIGHT + 2 * TEXTBOX_PADDING;
+
+	} else if (message == MSG_DESTROY) {
+		free(text->buffer);
+	}
+
+	return 0;
+}
+
+// text_bytes of -1 indicates a NULL terminated string
+void textbox_set_text(TextBox *textbox, char *text, int text_bytes) {
+	if (text_bytes == -1) text_bytes = (int)strlen(text);
+	GapBuffer *gap = &textbox->text;
+	gap_buffer_delete(gap, 0, gap_buffer_length(gap));
+	gap_buffer_insert(gap, 0, text, text_bytes);
+
+	textbox->line_count = 1;
+	for (int i = 0; i < text_bytes; ++i) {
+		if (text[i] == '\n') textbox->line_count++;
+	}
+
+	textbox->cursor = textbox->cursor_line_start = textbox->scroll_offset = 0;
+	textbox->cursor_line = textbox->cursor_column = 0;
+	textbox->scroll_line = textbox->scroll_column = 0;
+	element_repaint(&textbox->element, NULL);
+}
+
+// Copies up to buffer_size bytes of the text into buffer. Returns the length of the text.
+size_t textbox_get_text(TextBox *textbox, char *buffer, size_t buffer_size) {
+	GapBuffer *gap = &textbox->text;
+	size_t length = gap_buffer_length(gap);
+	size_t before = MIN(buffer_size, gap->gap_start);
+	if (before) memcpy(buffer, gap->buffer, before);
+	if (buffer_size > before && length > before) {
+		memcpy(buffer + before, gap->buffer + gap->gap_end, MIN(buffer_size, length) - before);
+	}
+	return length;
+}
+
+TextBox *textbox_create(Element *parent, uint32_t flags) {
+	TextBox *textbox = (TextBox*)element_create(sizeof(TextBox), parent, flags, textbox_message);
+	textbox->line_count = 1;
+	return textbox;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Log Views
+//////////////////////////////////////////////////////////////////////////////
+// A background thread goes through the file in chunks, counting lines and 
+// recording checkpoints. To find line n, the view starts at the checkpoint 
+// before it and looks for at most LOG_VIEW_CHECKPOINT_LINES newlines.
+// With LOG_VIEW_FOLLOW, the thread keeps polling the file's size once it's done,
+// and extends the index when the file grows. The thread posts MSG_LOG_VIEW_PROGRESS
+// to the view as it goes (at most one at a time), and the view then shows the new lines.
+// Log files get truncated by rotation at any time, so the file isn't mapped (which would fault
+// past the new end, and on Windows stop the writer from truncating it at all). It's only
+// accessed with platform_file_read, which just comes up short.
+#define LOG_VIEW_FOLLOW           (1 << 0)
+#define LOG_VIEW_CHECKPOINT_LINES (1024)
+#define LOG_VIEW_CHUNK_BYTES      (1 << 20)
+#define LOG_VIEW_POLL_MS          (100)
+
+// The number of lines in the indexed part of the file, counting an unterminated last line. 
+// Must be called with the mutex held.
+int64_t log_view_indexed_lines(LogView *view) {
+	return view->newline_count + (view->indexed_bytes > view->last_line_start ? 1 : 0);
+}
+
+void log_view_add_checkpoint(LogView *view, size_t offset) {
+	if (view->checkpoint_count == view->checkpoint_capacity) {
+		view->checkpoint_capacity = view->checkpoint_capacity ? view->checkpoint_capacity * 2 : 64;
+		view->checkpoints = realloc(view->checkpoints, sizeof(size_t) * view->checkpoint_capacity);
+	}
+	view->checkpoints[view->checkpoint_count++] = offset;
+}
+
+void log_view_index_thread(void *argument) {
+	LogView *view = (LogView*) argument;
+	bool follow = view->element.flags & LOG_VIEW_FOLLOW;
+	char *buffer = (char*) malloc(LOG_VIEW_CHUNK_BYTES);
+
+	while (!atomic_load(&view->stop)) {
+		// This is the only thread that changes the file's size, so it can read it without the mutex.
+		size_t start = view->indexed_bytes, size = view->file.size;
+		size_t bytes = start < size ? platform_file_read(&view->file, start, buffer, MIN(size - start, LOG_VIEW_CHUNK_BYTES)) : 0;
+
+		if (bytes) {
+			size_t end = start + bytes;
+			int64_t newline_count = view->newline_count;
+			size_t last_line_start = view->last_line_start;
+			size_t checkpoints[LOG_VIEW_CHUNK_BYTES / LOG_VIEW_CHECKPOINT_LINES + 1];
+			int checkpoint_count = 0;
+
+			for (char *newline = buffer; (newline = memchr(newline, '\n', buffer + bytes - newline)); ++newline) {
+				last_line_start = start + (newline - buffer) + 1;
+				if (++newline_count % LOG_VIEW_CHECKPOINT_LINES == 0) {
+					checkpoints[checkpoint_count++] = last_line_start;
+				}
+			}
+
+			mutex_lock(&view->mutex);
+			for (int i = 0; i < checkpoint_count; ++i) log_view_add_checkpoint(view, checkpoints[i]);
+			view->newline_count = newline_count;
+			view->last_line_start = last_line_start;
+			view->indexed_bytes = end;
+			mutex_unlock(&view->mutex);
+
+			if (!atomic_exchange(&view->progress_posted, 1)) {
+				ui_post_message(view->handle, MSG_LOG_VIEW_PROGRESS, 0, 0);
+			}
+
+		} else if (follow || start < size) {
+			// Either everything has been indexed, or the read came up short because the file was truncated.
+			platform_thread_sleep(LOG_VIEW_POLL_MS);
+
+			mutex_lock(&view->mutex);
+			bool changed = platform_file_refresh(&view->file);
+			if (view->file.size < view->indexed_bytes) {
+				// The file was truncated, e.g. by log rotation. Start again.
+				view->checkpoint_count = 0;
+				log_view_add_checkpoint(view, 0);
+				view->indexed_bytes = view->last_line_start = 0;
+				view->newline_count = 0;
+			}
+			mutex_unlock(&view->mutex);
+
+			if (view->file.size == view->indexed_bytes && !atomic_exchange(&view->progress_posted, 1)) {
+				ui_post_message(view->handle, MSG_LOG_VIEW_PROGRESS, 0, 0);
+			}
+
+			// Without LOG_VIEW_FOLLOW, give up on the rest of a file that can't be read.
+			if (!follow && !changed) break;
+
+		} else {
+			break;
+		}
+	}
+
+	free(buffer);
+}
+
+// Returns the offset just after the given number of newlines from offset, or end if there aren't that many.
+size_t log_view_skip_lines(LogView *view, size_t offset, size_t end, int64_t lines) {
+	char buffer[4096];
+
+	while (lines && offset < end) {
+		size_t bytes = platform_file_read(&view->file, offset, buffer, MIN(end - offset, sizeof(buffer)));
+		if (!bytes) return end;
+		char *position = buffer;
+
+		while (lines && (position = memchr(position, '\n', buffer + bytes - position))) {
+			++position;
+			--lines;
+		}
+
+		offset += lines ? bytes : (size_t) (position - buffer);
+	}
+
+	return MIN(offset, end);
+}
+
+// Returns the offset of the start of the line, or of the last indexed line if there 
+// aren't that many. Must be called with the mutex held.
+size_t log_view_line_offset(LogView *view, int64_t *line) {
+	*line = MIN(*line, MAX(0, log_view_indexed_lines(view) - 1));
+	size_t checkpoint = (size_t) (*line / LOG_VIEW_CHECKPOINT_LINES);
+	return log_view_skip_lines(view, view->checkpoints[checkpoint], view->indexed_bytes, 
+			*line - (int64_t) checkpoint * LOG_VIEW_CHECKPOINT_LINES);
+}
+
+int log_view_visible_rows(LogView *view) {
+	return MAX(1, (view->element.bounds.b - view->element.bounds.t) / GLYPH_HEIGHT);
+}
+
+int64_t log_view_max_scroll(LogView *view) {
+	return MAX(0, view->line_count - log_view_visible_rows(view));
+}
+
+Rect log_view_thumb(LogView *view) {
+	Rect bounds = view->element.bounds;
+	int view_height = bounds.b - bounds.t;
+	int64_t max_scroll = log_view_max_scroll(view);
+	Rect thumb = rect_make(bounds.r - SCROLLBAR_WIDTH, bounds.r, bounds.t, bounds.b);
+
+	if (max_scroll > 0) {
+		int thumb_height = MAX(SCROLLBAR_WIDTH, (int) ((int64_t) view_height * log_view_visible_rows(view) / view->line_count));
+		thumb.t = bounds.t + (int) ((view_height - thumb_height) * view->scroll_line / max_scroll);
+		thumb.b = thumb.t + thumb_height;
+	}
+
+	return thumb;
+}
+
+void log_view_set_scroll(LogView *view, int64_t line) {
+	line = MIN(MAX(line, 0), log_view_max_scroll(view));
+	mutex_lock(&view->mutex);
+	view->scroll_offset = log_view_line_offset(view, &line);
+	mutex_unlock(&view->mutex);
+
+	if (line != view->scroll_line) {
+		view->scroll_line = line;
+		element_repaint(&view->element, NULL);
+	}
+}
+
+// Pick up the lines indexed since the last refresh. With LOG_VIEW_FOLLOW, a view
+// scrolled to the end stays at the end.
+void log_view_refresh(LogView *view) {
+	bool at_end = view->scroll_line >= log_view_max_scroll(view);
+
+	mutex_lock(&view->mutex);
+	int64_t line_count = log_view_indexed_lines(view);
+	mutex_unlock(&view->mutex);
+
+	if (line_count == view->line_count) return;
+
+	// Only the rows from the old last line down, and the scrollbar, can have changed.
+	Rect changed = view->element.bounds;
+	changed.t += (int) MIN(MAX(0, view->line_count - 1 - view->scroll_line) * GLYPH_HEIGHT, changed.b - changed.t);
+	element_repaint(&view->element, &changed);
+	element_repaint(&view->element, &(Rect) { view->element.bounds.r - SCROLLBAR_WIDTH, view->element.bounds.r, view->element.bounds.t, view->element.bounds.b });
+
+	view->line_count = line_count;
+	bool follow = (view->element.flags & LOG_VIEW_FOLLOW) && at_end;
+	log_view_set_scroll(view, follow ? log_view_max_scroll(view) : view->scroll_line);
+}
+
+// Returns how much of the file has been indexed, from 0 to 1, and the number of lines found so far.
+float log_view_progress(LogView *view, int64_t *line_count) {
+	mutex_lock(&view->mutex);
+	float progress = view->file.size ? (float) view->indexed_bytes / view->file.size : 1;
+	if (line_count) *line_count = log_view_indexed_lines(view);
+	mutex_unlock(&view->mutex);
+	return progress;
+}
+
+int log_view_message(Element *element, Message message, int data_int, void *data_ptr) {
+	LogView *view = (LogView*) element;
+
+	if (message == MSG_PAINT) {
+		Painter *painter = (Painter*) data_ptr;
+		Rect bounds = element->bounds;
+		draw_block(painter, bounds, 0xFFFFFF);
+		draw_block(painter, rect_make(bounds.r - SCROLLBAR_WIDTH, bounds.r, bounds.t, bounds.b), 0xDDDDDD);
+		if (log_view_max_scroll(view) > 0) draw_block(painter, log_view_thumb(view), 0x888888);
+
+		// Lines longer than the view are cut off, so there's no need to read or decode more than this.
+		size_t max_bytes = (size_t) ((bounds.r - bounds.l) / GLYPH_WIDTH + 1) * 4;
+		char *line = (char*) malloc(max_bytes);
+
+		mutex_lock(&view->mutex);
+		size_t offset = view->scroll_offset;
+		size_t end = view->indexed_bytes;
+
+		for (int row = 0; row < log_view_visible_rows(view) && offset < end; ++row) {
+			size_t wanted = MIN(end - offset, max_bytes);
+			size_t bytes = platform_file_read(&view->file, offset, line, wanted);
+			char *newline = memchr(line, '\n', bytes);
+			size_t length = newline ? (size_t) (newline - line) : bytes;
+			int y = bounds.t + row * GLYPH_HEIGHT;
+
+			if (y < painter->clip.b && y + GLYPH_HEIGHT > painter->clip.t) {
+				if (newline && length && line[length - 1] == '\r') --length;
+				draw_string(painter, rect_make(bounds.l + 2, bounds.r - SCROLLBAR_WIDTH, y, y + GLYPH_HEIGHT), 
+						line, (int) length, 0x000000, false);
+			}
+
+			// Stop if the file was truncated; the index will be rebuilt.
+			if (bytes < wanted) break;
+			offset = newline ? offset + (newline - line) + 1 : log_view_skip_lines(view, offset + bytes, end, 1);
+		}
+		mutex_unlock(&view->mutex);
+		free(line);
+
+	} else if (message == MSG_LAYOUT) {
+		log_view_refresh(view);
+		log_view_set_scroll(view, view->scroll_line);
+		element_repaint(element, NULL);
+
+	} else if (message == MSG_LOG_VIEW_PROGRESS) {
+		atomic_exchange(&view->progress_posted, 0);
+		log_view_refresh(view);
+
+	} else if (message == MSG_MOUSE_WHEEL) {
+		log_view_refresh(view);
+		log_view_set_scroll(view, view->scroll_line + data_int * 3);
+		return 1;
+
+	} else if (message == MSG_MOUSE_LEFT_DOWN) {
+		Rect thumb = log_view_thumb(view);
+		int mouse_x = element->window->mouse_x, mouse_y = element->window->mouse_y;
+		if (mouse_x < thumb.l) return 0;
+		log_view_refresh(view);
+		view->thumb_drag = rect_contains(thumb, thumb.l, mouse_y) ? mouse_y - thumb.t : (thumb.b - thumb.t) / 2;
+		element_message(element, MSG_MOUSE_DRAG, 0, 0);
+
+	} else if (message == MSG_MOUSE_DRAG && element->window->pressed_mouse_button == MOUSE_BUTTON_LEFT) {
+		Rect thumb = log_view_thumb(view);
+		int track = (element->bounds.b - element->bounds.t) - (thumb.b - thumb.t);
+		if (track > 0) {
+			int thumb_top = element->window->mouse_y - view->thumb_drag - element->bounds.t;
+			log_view_set_scroll(view, thumb_top * log_view_max_scroll(view) / track);
+		}
+
+	} else if (message == MSG_GET_WIDTH) {
+		return 80 * GLYPH_WIDTH + SCROLLBAR_WIDTH;
+
+	} else if (message == MSG_GET_HEIGHT) {
+		return 20 * GLYPH_HEIGHT;
+
+	} else if (message == MSG_DESTROY) {
+		atomic_add(&view->stop, 1);
+		platform_thread_join(view->thread);
+		platform_file_close(&view->file);
+		free(view->checkpoints);
+	}
+
+	return 0;
+}
+
+// Returns NULL if the file can't be opened. The file is indexed in the background; 
+// the view's message_user gets MSG_LOG_VIEW_PROGRESS as it goes, see log_view_progress.
+LogView *log_view_create(Element *parent, uint32_t flags, const char *path) {
+	FileReader file;
+	if (!platform_file_open(&file, path)) return NULL;
+
+	LogView *view = (LogView*) element_create(sizeof(LogView), parent, flags, log_view_message);
+	view->file = file;
+	view->handle = element_handle(&view->element);
+	mutex_init(&view->mutex);
+	log_view_add_checkpoint(view, 0);
+
+	bool started = platform_thread_start(&view->thread, log_view_index_thread, view);
+	assert(started);
+	(void) started;
+
+	return view;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Flex Panels
+//////////////////////////////////////////////////////////////////////////////
+// Children are placed along the main axis at their preferred size. Then the 
+// leftover space in each line is shared between them according to their grow 
+// weights, or the missing space is taken away according to their shrink weights
+// (scaled by their preferred size), within each child's min and max.
+// A child that fills along the main axis counts as having a grow weight of 1.
+#define FLEX_HORIZONTAL            (1 << 0)
+#define FLEX_WRAP                  (1 << 1)  // Start a new line when the children don't fit.
+#define FLEX_ALIGN_CENTER          (1 << 2)  // Cross axis alignment of the children in each line. 
+#define FLEX_ALIGN_END             (1 << 3)  // The default is the start of the line.
+#define FLEX_ALIGN_STRETCH         (1 << 4)
+#define FLEX_JUSTIFY_CENTER        (1 << 5)  // Main axis placement of the children when there is
+#define FLEX_JUSTIFY_END           (1 << 6)  // space left over. The default is the start of the line.
+#define FLEX_JUSTIFY_SPACE_BETWEEN (1 << 7)
+#define FLEX_WHITE                 (1 << 8)
+#define FLEX_GREY                  (1 << 9)
+
+void element_set_flex(Element *element, int grow, int shrink, int min, int max) {
+	element->flex = (FlexItem){ .grow = grow, .shrink = shrink, .min = min, .max = max };
+	if (element->parent) element_invalidate_layout(element->parent);
+}
+
+int flex_item_clamp(FlexItem *item, int size) {
+	if (item->max > 0 && size > item->max) size = item->max;
+	if (size < item->min) size = item->min;
+	return size;
+}
+
+// How flex_panel_layout is sizing a child.
+typedef struct FlexSize {
+	int base;    // The preferred main axis size, within the child's limits.
+	int main;    // The main axis size it gets.
+	int cross;   // The cross axis size it wants, or the unclamped main axis size while resolving a line.
+	bool frozen; // The main axis size is final.
+} FlexSize;
+
+int flex_item_grow(Element *child, uint32_t main_fill) {
+	return child->flex.grow ? child->flex.grow : (child->flags & main_fill) ? 1 : 0;
+}
+
+// Share out the space on the line between its children, in proportion to their weights.
+// A child that would go past its min or max is frozen there, and the space it couldn't take or
+// give up is shared out again between the others, until nothing is left over or nobody can take it.
+void flex_panel_resolve_line(FlexPanel *panel, uint32_t first, uint32_t end, int available, uint32_t main_fill) {
+	Element *element = &panel->element;
+	FlexSize *sizes = panel->sizes;
+
+	for (uint32_t i = first; i < end; ++i) {
+		sizes[i].main = sizes[i].base;
+		sizes[i].frozen = false;
+	}
+
+	while (true) {
+		// The free space, with the frozen children at their final size and the rest at their preferred size.
+		int free_space = available;
+		int64_t total_grow = 0, total_shrink = 0;
+
+		for (uint32_t i = first; i < end; ++i) {
+			Element *child = element->children[i];
+			if (child->flags & ELEMENT_DESTROY) continue;
+
+			if (sizes[i].frozen) {
+				free_space -= sizes[i].main;
+			} else {
+				free_space -= sizes[i].base;
+				total_grow += flex_item_grow(child, main_fill);
+				total_shrink += (int64_t)child->flex.shrink * sizes[i].base;
+			}
+		}
+
+		int64_t total = free_space > 0 ? total_grow : free_space < 0 ? total_shrink : 0;
+		if (!total) break;
+
+		// Distribute it. Using running totals means rounding never loses a pixel.
+		int64_t weight_before = 0;
+		int violation = 0;
+
+		for (uint32_t i = first; i < end; ++i) {
+			Element *child = element->children[i];
+			if ((child->flags & ELEMENT_DESTROY) || sizes[i].frozen) continue;
+			int64_t weight = free_space > 0 ? flex_item_grow(child, main_fill) : (int64_t)child->flex.shrink * sizes[i].base;
+			int delta = (int)(free_space * (weight_before + weight) / total - free_space * weight_before / total);
+			weight_before += weight;
+			sizes[i].cross = sizes[i].base + delta;
+			sizes[i].main = flex_item_clamp(&child->flex, sizes[i].cross);
+			violation += sizes[i].main - sizes[i].cross;
+		}
+
+		if (!violation) break;
+
+		// Freeze the children that were clamped the same way as the total, and try again with the rest.
+		for (uint32_t i = first; i < end; ++i) {
+			Element *child = element->children[i];
+			if ((child->flags & ELEMENT_DESTROY) || sizes[i].frozen) continue;
+
+			if (violation > 0 ? sizes[i].main > sizes[i].cross : sizes[i].main < sizes[i].cross) {
+				sizes[i].frozen = true;
+			} else {
+				sizes[i].main = sizes[i].base;
+			}
+		}
+	}
+}
+
+// Lays out the children in bounds, or only measures them if measure is set.
+// A main axis size of 0 in bounds means unconstrained: everything goes on one line at 
+// its preferred size. Returns the space used on the cross axis, including padding.
+int flex_panel_layout(FlexPanel *panel, Rect bounds, bool measure) {
+	Element *element = &panel->element;
+	uint32_t flags = element->flags;
+	bool horizontal = flags & FLEX_HORIZONTAL;
+	Message main_message  = horizontal ? MSG_GET_WIDTH : MSG_GET_HEIGHT;
+	Message cross_message = horizontal ? MSG_GET_HEIGHT : MSG_GET_WIDTH;
+	uint32_t cross_fill = horizontal ? ELEMENT_VERTICAL_FILL : ELEMENT_HORIZONTAL_FILL;
+	uint32_t main_fill  = horizontal ? ELEMENT_HORIZONTAL_FILL : ELEMENT_VERTICAL_FILL;
+
+	int main_start = horizontal ? bounds.l + panel->padding.l : bounds.t + panel->padding.t;
+	int cross_start = horizontal ? bounds.t + panel->padding.t : bounds.l + panel->padding.l;
+	int main_size = horizontal 
+		? bounds.r - bounds.l - panel->padding.l - panel->padding.r
+		: bounds.b - bounds.t - panel->padding.t - panel->padding.b;
+	bool unconstrained = measure && main_size <= 0;
+
+	if (panel->sizes_count < element->child_count) {
+		panel->sizes_count = element->child_count;
+		panel->sizes = realloc(panel->sizes, sizeof(FlexSize) * panel->sizes_count);
+	}
+	FlexSize *sizes = panel->sizes;
+
+	// Measure pass: the preferred main axis size of every child.
+	for (uint32_t i = 0; i < element->child_count; ++i) {
+		Element *child = element->children[i];
+		if (child->flags & ELEMENT_DESTROY) continue;
+		sizes[i].base = flex_item_clamp(&child->flex, element_message(child, main_message, 0, 0));
+	}
+
+	int cross_position = cross_start;
+	int line_count = 0;
+	uint32_t line_first = 0;
+
+	while (true) {
+		// Skip over destroyed children to the start of the next line.
+		while (line_first < element->child_count && (element->children[line_first]->flags & ELEMENT_DESTROY)) ++line_first;
+		if (line_first == element->child_count) break;
+
+		if (line_count) cross_position += panel->line_gap;
+
+		// Collect the children that fit on this line.
+		uint32_t line_end = line_first;
+		int used = 0, count = 0;
+
+		for (; line_end < element->child_count; ++line_end) {
+			Element *child = element->children[line_end];
+			if (child->flags & ELEMENT_DESTROY) continue;
+			int needed = sizes[line_end].base + (count ? panel->gap : 0);
+			if ((flags & FLEX_WRAP) && !unconstrained && count && used + needed > main_size) break;
+			used += needed;
+			++count;
+		}
+
+		// Grow or shrink them to fill the line.
+		int available = (unconstrained ? used : main_size) - (count ? count - 1 : 0) * panel->gap;
+		flex_panel_resolve_line(panel, line_first, line_end, available, main_fill);
+		int line_cross = 0;
+		used = 0;
+
+		for (uint32_t i = line_first; i < line_end; ++i) {
+			Element *child = element->children[i];
+			if (child->flags & ELEMENT_DESTROY) continue;
+			used += sizes[i].main;
+			sizes[i].cross = element_message(child, cross_message, sizes[i].main, 0);
+			if (sizes[i].cross > line_cross) line_cross = sizes[i].cross;
+		}
+
+		// Arrange pass: place the children on the line, using whatever space is still left to justify them.
+		int remaining = unconstrained ? 0 : MAX(0, main_size - used - (count - 1) * panel->gap);
+		int position = main_start;
+		int spacing = panel->gap;
+
+		if (flags & FLEX_JUSTIFY_CENTER) {
+			position += remaining / 2;
+		} else if (flags & FLEX_JUSTIFY_END) {
+			position += remaining;
+		}
+
+		int index = 0;
+
+		for (uint32_t i = line_first; !measure && i < line_end; ++i) {
+			Element *child = element->children[i];
+			if (child->flags & ELEMENT_DESTROY) continue;
+
+			int cross_size = sizes[i].cross, cross_offset = 0;
+			if ((flags & FLEX_ALIGN_STRETCH) || (child->flags & cross_fill)) {
+				cross_size = line_cross;
+			} else if (flags & FLEX_ALIGN_CENTER) {
+				cross_offset = (line_cross - cross_size) / 2;
+			} else if (flags & FLEX_ALIGN_END) {
+				cross_offset = line_cross - cross_size;
+			}
+
+			if ((flags & FLEX_JUSTIFY_SPACE_BETWEEN) && count > 1) {
+				// Share out the remaining space between the gaps, again with running totals.
+				spacing = panel->gap + remaining * (index + 1) / (count - 1) - remaining * index / (count - 1);
+			}
+
+			Rect new_pos = horizontal
+				? rect_make(position, position + sizes[i].main, cross_position + cross_offset, cross_position + cross_offset + cross_size)
+				: rect_make(cross_position + cross_offset, cross_position + cross_offset + cross_size, position, position + sizes[i].main);
+			element_arrange(child, new_pos);
+			position += sizes[i].main + spacing;
+			++index;
+		}
+
+		cross_position += line_cross;
+		++line_count;
+		line_first = line_end;
+	}
+
+	int padding = horizontal ? panel->padding.t + panel->padding.b : panel->padding.l + panel->padding.r;
+	return cross_position - cross_start + padding;
+}
+
+// Returns the preferred size along the main axis: all the children on one line at their preferred size.
+int flex_panel_measure(FlexPanel *panel) {
+	bool horizontal = panel->element.flags & FLEX_HORIZONTAL;
+	Message main_message = horizontal ? MSG_GET_WIDTH : MSG_GET_HEIGHT;
+	int size = 0, count = 0;
+
+	for (uint32_t i = 0; i < panel->element.child_count; ++i) {
+		Element *child = panel->element.children[i];
+		if (child->flags & ELEMENT_DESTROY) continue;
+		size += flex_item_clamp(&child->flex, element_message(child, main_message, 0, 0));
+		++count;
+	}
+
+	if (count) size += (count - 1) * panel->gap;
+	return size + (horizontal ? panel->padding.l + panel->padding.r : panel->padding.t + panel->padding.b);
+}
+
+int flex_panel_message(Element *element, Message message, int data_int, void *data_ptr) {
+	FlexPanel *panel = (FlexPanel*) element;
+	bool horizontal = element->flags & FLEX_HORIZONTAL;
+
+	if (message == MSG_PAINT) {
+		Painter *painter = (Painter*) data_ptr;
+		if (element->flags & FLEX_WHITE) {
+			draw_block(painter, element->bounds, 0xFFFFFF);
+		} else if (element->flags & FLEX_GREY) {
+			draw_block(painter, element->bounds, 0xCCCCCC);
+		}
+
+	} else if (message == MSG_LAYOUT) {
+		flex_panel_layout(panel, element->bounds, false);
+		element_repaint(element, NULL);
+
+	} else if (message == MSG_GET_WIDTH) {
+		return horizontal 
+			? flex_panel_measure(panel)
+			: flex_panel_layout(panel, rect_make(0, 0, 0, data_int), true);
+
+	} else if (message == MSG_GET_HEIGHT) {
+		return horizontal
+			? flex_panel_layout(panel, rect_make(0, data_int, 0, 0), true)
+			: flex_panel_measure(panel);
+
+	} else if (message == MSG_DESTROY) {
+		free(panel->sizes);
+	}
+
+	return 0;
+}
+
+FlexPanel *flex_panel_create(Element *parent, uint32_t flags) {
+	return (FlexPanel*) element_create(sizeof(FlexPanel), parent, flags, flex_panel_message);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Virtual Lists
+//////////////////////////////////////////////////////////////////////////////
+// Only the rows that are visible have an element. The application supplies the
+// rows through the list's message_user: MSG_LIST_GET_ROW_COUNT, MSG_LIST_GET_ROW_HEIGHT, 
+// MSG_LIST_CREATE_ROW (optional, a label is created otherwise) and MSG_LIST_BIND_ROW.
+#define VIRTUAL_LIST_VARIABLE_HEIGHT (1 << 0)
+
+int virtual_list_row_top(VirtualList *list, int row) {
+	return (list->element.flags & VIRTUAL_LIST_VARIABLE_HEIGHT) ? list->row_offsets[row] : row * list->row_height;
+}
+
+int virtual_list_content_height(VirtualList *list) {
+	return virtual_list_row_top(list, list->row_count);
+}
+
+// Returns the row containing y, measured from the top of the first row.
+int virtual_list_row_at(VirtualList *list, int y) {
+	if (list->row_count == 0) return 0;
+
+	if (!(list->element.flags & VIRTUAL_LIST_VARIABLE_HEIGHT)) {
+		int row = list->row_height > 0 ? y / list->row_height : 0;
+		return MIN(MAX(row, 0), list->row_count - 1);
+	}
+
+	// Binary search for the last row starting at or above y.
+	int lo = 0, hi = list->row_count - 1;
+	while (lo < hi) {
+		int mid = lo + (hi - lo + 1) / 2;
+		if (list->row_offsets[mid] <= y) lo = mid;
+		else hi = mid - 1;
+	}
+	return lo;
+}
+
+int virtual_list_max_scroll(VirtualList *list) {
+	int view_height = list->element.bounds.b - list->element.bounds.t;
+	return MAX(0, virtual_list_content_height(list) - view_height);
+}
+
+Rect virtual_list_thumb(VirtualList *list) {
+	Rect bounds = list->element.bounds;
+	int view_height = bounds.b - bounds.t;
+	int content_height = virtual_list_content_height(list);
+	Rect thumb = rect_make(bounds.r - SCROLLBAR_WIDTH, bounds.r, bounds.t, bounds.b);
+
+	if (content_height > view_height) {
+		int thumb_height = MAX(SCROLLBAR_WIDTH, (int)((int64_t)view_height * view_height / content_height));
+		thumb.t = bounds.t + (int)((int64_t)(view_height - thumb_height) * list->scroll / virtual_list_max_scroll(list));
+		thumb.b = thumb.t + thumb_height;
+	}
+
+	return thumb;
+}
+
+void virtual_list_layout(VirtualList *list) {
+	Element *element = &list->element;
+	list->scroll = MIN(MAX(list->scroll, 0), virtual_list_max_scroll(list));
+
+	int first = virtual_list_row_at(list, list->scroll);
+	int last = virtual_list_row_at(list, list->scroll + element->bounds.b - element->bounds.t - 1);
+	int visible = list->row_count ? last - first + 1 : 0;
+
+	// Release the slots whose row has scrolled out of view, and note which rows still have one.
+	list->covered = realloc(list->covered, sizeof(int) * MAX(visible, 1));
+	memset(list->covered, 0, sizeof(int) * MAX(visible, 1));
+	for (uint32_t i = 0; i < element->child_count; ++i) {
+		int row = list->slot_rows[i];
+		if (row < first || row > last || row >= list->row_count) {
+			list->slot_rows[i] = -1;
+		} else {
+			list->covered[row - first] = 1;
+		}
+	}
+
+	// Give every uncovered row a free slot, creating new row elements only when there are none left.
+	uint32_t free_slot = 0;
+	for (int row = first; row < first + visible; ++row) {
+		if (list->covered[row - first]) continue;
+
+		while (free_slot < element->child_count && list->slot_rows[free_slot] != -1) ++free_slot;
+
+		if (free_slot == element->child_count) {
+			Element *slot = NULL;
+			element_message(element, MSG_LIST_CREATE_ROW, 0, &slot);
+			if (!slot) slot = &label_create(element, 0, NULL, 0)->element;
+			assert(slot->parent == element && element->children[element->child_count - 1] == slot);
+			list->slot_rows = realloc(list->slot_rows, sizeof(int) * element->child_count);
+		}
+
+		list->slot_rows[free_slot] = row;
+		element_message(element, MSG_LIST_BIND_ROW, row, element->children[free_slot]);
+	}
+
+	// Position the slots. Unused slots get an empty rectangle, so they are neither painted nor hit-tested.
+	for (uint32_t i = 0; i < element->child_count; ++i) {
+		int row = list->slot_rows[i];
+		Rect bounds = rect_make(0, 0, 0, 0);
+
+		if (row != -1) {
+			int top = element->bounds.t + virtual_list_row_top(list, row) - list->scroll;
+			int bottom = element->bounds.t + virtual_list_row_top(list, row + 1) - list->scroll;
+			bounds = rect_make(element->bounds.l, element->bounds.r - SCROLLBAR_WIDTH, top, bottom);
+		}
+
+		element_move(element->children[i], bounds, false);
+	}
+}
+
+// Query the row count and row heights again, and rebind all the visible rows.
+void virtual_list_refresh(VirtualList *list) {
+	list->refresh = false;
+	list->row_count = MAX(0, element_message(&list->element, MSG_LIST_GET_ROW_COUNT, 0, 0));
+
+	if (list->element.flags & VIRTUAL_LIST_VARIABLE_HEIGHT) {
+		list->row_offsets = realloc(list->row_offsets, sizeof(int) * (list->row_count + 1));
+		list->row_offsets[0] = 0;
+		for (int i = 0; i < list->row_count; ++i) {
+			list->row_offsets[i + 1] = list->row_offsets[i] + element_message(&list->element, MSG_LIST_GET_ROW_HEIGHT, i, 0);
+		}
+	}
+
+	for (uint32_t i = 0; i < list->element.child_count; ++i) {
+		list->slot_rows[i] = -1;
+	}
+
+	virtual_list_layout(list);
+	element_repaint(&list->element, NULL);
+}
+
+void virtual_list_set_scroll(VirtualList *list, int scroll) {
+	if (list->refresh) virtual_list_refresh(list);
+	int old_scroll = list->scroll;
+	list->scroll = scroll;
+	virtual_list_layout(list);
+	if (list->scroll != old_scroll) element_repaint(&list->element, NULL);
+}
+
+int virtual_list_message(Element *element, Message message, int data_int, void *data_ptr) {
+	VirtualList *list = (VirtualList*) element;
+
+	if (message == MSG_PAINT) {
+		Painter *painter = (Painter*) data_ptr;
+		draw_block(painter, element->bounds, 0xFFFFFF);
+		draw_block(painter, rect_make(element->bounds.r - SCROLLBAR_WIDTH, element->bounds.r, element->bounds.t, element->bounds.b), 0xDDDDDD);
+		if (virtual_list_max_scroll(list) > 0) {
+			draw_block(painter, virtual_list_thumb(list), 0x888888);
+		}
+
+	} else if (message == MSG_LAYOUT) {
+		if (list->refresh) {
+			virtual_list_refresh(list);
+		} else {
+			virtual_list_layout(list);
+			element_repaint(element, NULL);
+		}
+
+	} else if (message == MSG_MOUSE_WHEEL) {
+		virtual_list_set_scroll(list, list->scroll + data_int * 3 * list->row_height);
+		return 1;
+
+	} else if (message == MSG_MOUSE_LEFT_DOWN) {
+		// The click can be on the scrollbar, or on the list below the last row.
+		Rect thumb = virtual_list_thumb(list);
+		int mouse_x = element->window->mouse_x, mouse_y = element->window->mouse_y;
+		list->thumb_drag = -1;
+		if (mouse_x < thumb.l) return 0;
+		list->thumb_drag = rect_contains(thumb, thumb.l, mouse_y) ? mouse_y - thumb.t : (thumb.b - thumb.t) / 2;
+		element_message(element, MSG_MOUSE_DRAG, 0, 0);
+
+	} else if (message == MSG_MOUSE_DRAG && element->window->pressed_mouse_button == MOUSE_BUTTON_LEFT && list->thumb_drag != -1) {
+		Rect thumb = virtual_list_thumb(list);
+		int track = (element->bounds.b - element->bounds.t) - (thumb.b - thumb.t);
+		if (track > 0) {
+			int thumb_top = element->window->mouse_y - list->thumb_drag - element->bounds.t;
+			virtual_list_set_scroll(list, (int)((int64_t)thumb_top * virtual_list_max_scroll(list) / track));
+		}
+
+	} else if (message == MSG_GET_WIDTH) {
+		return SCROLLBAR_WIDTH;
+
+	} else if (message == MSG_GET_HEIGHT) {
+		return list->row_height * 10;
+
+	} else if (message == MSG_DESTROY) {
+		free(list->row_offsets);
+		free(list->slot_rows);
+		free(list->covered);
+	}
+
+	return 0;
+}
+
+// row_height is the height of each row, or the scroll step if VIRTUAL_LIST_VARIABLE_HEIGHT is set.
+// The row count is first queried at the list's first layout; call virtual_list_refresh when it changes.
+VirtualList *virtual_list_create(Element *parent, uint32_t flags, int row_height) {
+	VirtualList *list = (VirtualList*) element_create(sizeof(VirtualList), parent, flags, virtual_list_message);
+	list->row_height = row_height;
+	list->refresh = true;
+	list->thumb_drag = -1;
+	return list;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Tables
+//////////////////////////////////////////////////////////////////////////////
+// Cells have no element or string of their own: painting formats each visible
+// cell into a buffer on the stack and draws it straight away. The header row stays
+// at the top, and a column is resized by dragging the right edge of its header.
+#define TABLE_ROW_HEIGHT   (GLYPH_HEIGHT + 4)
+#define TABLE_CELL_PADDING (4)
+#define TABLE_MIN_COLUMN_WIDTH (2 * TABLE_CELL_PADDING + GLYPH_WIDTH)
+
+int table_format_int(const void *value, char *buffer, int buffer_size) {
+	return MIN(buffer_size - 1, snprintf(buffer, buffer_size, "%d", *(const int *) value));
+}
+
+int table_format_double(const void *value, char *buffer, int buffer_size) {
+	return MIN(buffer_size - 1, snprintf(buffer, buffer_size, "%.3f", *(const double *) value));
+}
+
+// For columns of char pointers to NULL terminated strings.
+int table_format_string(const void *value, char *buffer, int buffer_size) {
+	const char *string = *(const char **) value;
+	int bytes = 0;
+	while (string && string[bytes] && bytes < buffer_size) {
+		buffer[bytes] = string[bytes];
+		++bytes;
+	}
+	return bytes;
+}
+
+int table_content_width(Table *table) {
+	return table->column_offsets[table->column_count];
+}
+
+// The area the cells scroll in: everything but the header and the scrollbars.
+Rect table_body(Table *table) {
+	Rect bounds = table->element.bounds;
+	return rect_make(bounds.l, bounds.r - SCROLLBAR_WIDTH, bounds.t + TABLE_ROW_HEIGHT, bounds.b - SCROLLBAR_WIDTH);
+}
+
+int table_max_scroll_x(Table *table) {
+	Rect body = table_body(table);
+	return MAX(0, table_content_width(table) - (body.r - body.l));
+}
+
+int table_max_scroll_y(Table *table) {
+	Rect body = table_body(table);
+	return MAX(0, (int) MIN((int64_t) table->row_count * TABLE_ROW_HEIGHT - (body.b - body.t), INT32_MAX));
+}
+
+// Returns the column containing x, measured from the left of the first column.
+int table_column_at(Table *table, int x) {
+	int lo = 0, hi = table->column_count - 1;
+	while (lo < hi) {
+		int mid = lo + (hi - lo + 1) / 2;
+		if (table->column_offsets[mid] <= x) lo = mid;
+		else hi = mid - 1;
+	}
+	return lo;
+}
+
+Rect table_thumb(Table *table, bool vertical) {
+	Rect body = table_body(table);
+	Rect track = vertical ? rect_make(body.r, body.r + SCROLLBAR_WIDTH, body.t, body.b) 
+		: rect_make(body.l, body.r, body.b, body.b + SCROLLBAR_WIDTH);
+	int track_size = vertical ? track.b - track.t : track.r - track.l;
+	int64_t content = vertical ? (int64_t) table->row_count * TABLE_ROW_HEIGHT : table_content_width(table);
+	int max_scroll = vertical ? table_max_scroll_y(table) : table_max_scroll_x(table);
+	int scroll = vertical ? table->scroll_y : table->scroll_x;
+
+	if (max_scroll > 0) {
+		int thumb_size = MAX(SCROLLBAR_WIDTH, (int) ((int64_t) track_size * track_size / content));
+		int start = (int) ((int64_t) (track_size - thumb_size) * scroll / max_scroll);
+		if (vertical) track.t += start, track.b = track.t + thumb_size;
+		else track.l += start, track.r = track.l + thumb_size;
+	}
+
+	return track;
+}
+
+void table_set_scroll(Table *table, int scroll_x, int scroll_y) {
+	scroll_x = MIN(MAX(scroll_x, 0), table_max_scroll_x(table));
+	scroll_y = MIN(MAX(scroll_y, 0), table_max_scroll_y(table));
+	if (scroll_x == table->scroll_x && scroll_y == table->scroll_y) return;
+	table->scroll_x = scroll_x;
+	table->scroll_y = scroll_y;
+	element_repaint(&table->element, NULL);
+}
+
+void table_paint_cell(Painter *painter, Rect cell, char *text, int bytes, uint32_t color) {
+	Rect old_clip = painter->clip;
+	painter->clip = rect_intersection(old_clip, cell);
+	draw_block(painter, rect_make(cell.r - 1, cell.r, cell.t, cell.b), 0xCCCCCC);
+	draw_block(painter, rect_make(cell.l, cell.r, cell.b - 1, cell.b), 0xCCCCCC);
+	draw_string(painter, rect_make(cell.l + TABLE_CELL_PADDING, cell.r - TABLE_CELL_PADDING, cell.t, cell.b), text, bytes, color, false);
+	painter->clip = old_clip;
+}
+
+void table_paint(Table *table, Painter *painter) {
+	Rect bounds = table->element.bounds, body = table_body(table);
+	draw_block(painter, bounds, 0xFFFFFF);
+
+	if (table->column_count) {
+		Rect visible = rect_intersection(painter->clip, rect_make(body.l, body.r, bounds.t, body.b));
+		int x = body.l - table->scroll_x;
+		int first_column = table_column_at(table, visible.l - x);
+		int first_row = (visible.t - body.t + table->scroll_y) / TABLE_ROW_HEIGHT;
+
+		for (int column = first_column; column < table->column_count; ++column) {
+			TableColumn *c = &table->columns[column];
+			int l = x + table->column_offsets[column], r = l + c->width;
+			if (l >= visible.r) break;
+
+			// The header.
+			if (visible.t < body.t) {
+				Rect old_clip = painter->clip;
+				painter->clip = rect_intersection(old_clip, rect_make(body.l, body.r, bounds.t, body.t));
+				draw_block(painter, rect_make(l, r, bounds.t, body.t), 0xEEEEEE);
+				draw_block(painter, rect_make(r - 1, r, bounds.t, body.t), 0x888888);
+				draw_block(painter, rect_make(l, r, body.t - 1, body.t), 0x888888);
+				draw_glyphs(painter, rect_make(l + TABLE_CELL_PADDING, r - TABLE_CELL_PADDING, bounds.t, body.t), c->title.glyphs, c->title.glyph_count, 0x000000, false);
+				painter->clip = old_clip;
+			}
+
+			// The cells, formatted one at a time into the same buffer.
+			Rect old_clip = painter->clip;
+			painter->clip = rect_intersection(old_clip, body);
+			for (int row = MAX(first_row, 0); row < table->row_count; ++row) {
+				int t = body.t + row * TABLE_ROW_HEIGHT - table->scroll_y;
+				if (t >= visible.b) break;
+				char buffer[128];
+				int bytes = c->format(c->data + row * c->stride, buffer, sizeof(buffer));
+				table_paint_cell(painter, rect_make(l, r, t, t + TABLE_ROW_HEIGHT), buffer, bytes, 0x000000);
+			}
+			painter->clip = old_clip;
+		}
+	}
+
+	// The scrollbars, and the corner between them.
+	draw_block(painter, rect_make(body.r, bounds.r, bounds.t, bounds.b), 0xDDDDDD);
+	draw_block(painter, rect_make(bounds.l, body.r, body.b, bounds.b), 0xDDDDDD);
+	if (table_max_scroll_y(table) > 0) draw_block(painter, table_thumb(table, true), 0x888888);
+	if (table_max_scroll_x(table) > 0) draw_block(painter, table_thumb(table, false), 0x888888);
+}
+
+// Only the offsets of the columns after the resized one change, and only the part
+// of the table from the resized column to the right edge is repainted.
+void table_set_column_width(Table *table, int column, int width) {
+	width = MAX(width, TABLE_MIN_COLUMN_WIDTH);
+	int delta = width - table->columns[column].width;
+	if (!delta) return;
+
+	Rect old_thumb = table_thumb(table, false);
+	table->columns[column].width = width;
+	for (int i = column + 1; i <= table->column_count; ++i) {
+		table->column_offsets[i] += delta;
+	}
+
+	Rect changed = table->element.bounds;
+	changed.l = MAX(changed.l, table_body(table).l + table->column_offsets[column] - table->scroll_x);
+	element_repaint(&table->element, &changed);
+
+	// The horizontal scrollbar's thumb changed size too, and the table might have to scroll back.
+	Rect new_thumb = table_thumb(table, false);
+	element_repaint(&table->element, &old_thumb);
+	element_repaint(&table->element, &new_thumb);
+	table_set_scroll(table, table->scroll_x, table->scroll_y);
+}
+
+int table_message(Element *element, Message message, int data_int, void *data_ptr) {
+	Table *table = (Table*) element;
+
+	if (message == MSG_PAINT) {
+		table_paint(table, (Painter*) data_ptr);
+
+	} else if (message == MSG_LAYOUT) {
+		table_set_scroll(table, table->scroll_x, table->scroll_y);
+		element_repaint(element, NULL);
+
+	} else if (message == MSG_MOUSE_WHEEL) {
+		table_set_scroll(table, table->scroll_x, table->scroll_y + data_int * 3 * TABLE_ROW_HEIGHT);
+		return 1;
+
+	} else if (message == MSG_MOUSE_LEFT_DOWN) {
+		Rect body = table_body(table);
+		int mouse_x = element->window->mouse_x, mouse_y = element->window->mouse_y;
+		table->resizing = -1;
+		table->dragging = 0;
+
+		if (mouse_y < body.t && mouse_x < body.r && table->column_count) {
+			// Grab the nearest column edge, if it's close enough.
+			int x = mouse_x - body.l + table->scroll_x;
+			int column = table_column_at(table, x + 4);
+			int edge = table->column_offsets[column];
+			if (column > 0 && x >= edge - 4 && x <= edge + 4) {
+				table->resizing = column - 1;
+				table->drag_offset = x - edge;
+			}
+		} else if (mouse_x >= body.r || mouse_y >= body.b) {
+			bool vertical = mouse_x >= body.r;
+			Rect thumb = table_thumb(table, vertical);
+			table->dragging = vertical ? 1 : 2;
+			if (vertical) table->drag_offset = rect_contains(thumb, thumb.l, mouse_y) ? mouse_y - thumb.t : (thumb.b - thumb.t) / 2;
+			else table->drag_offset = rect_contains(thumb, mouse_x, thumb.t) ? mouse_x - thumb.l : (thumb.r - thumb.l) / 2;
+			element_message(element, MSG_MOUSE_DRAG, 0, 0);
+		}
+
+	} else if (message == MSG_MOUSE_DRAG && element->window->pressed_mouse_button == MOUSE_BUTTON_LEFT) {
+		Rect body = table_body(table);
+		int mouse_x = element->window->mouse_x, mouse_y = element->window->mouse_y;
+
+		if (table->resizing != -1) {
+			int x = mouse_x - body.l + table->scroll_x - table->drag_offset;
+			table_set_column_width(table, table->resizing, x - table->column_offsets[table->resizing]);
+		} else if (table->dragging == 1) {
+			Rect thumb = table_thumb(table, true);
+			int track = (body.b - body.t) - (thumb.b - thumb.t);
+			if (track > 0) {
+				int64_t start = mouse_y - table->drag_offset - body.t;
+				table_set_scroll(table, table->scroll_x, (int) (start * table_max_scroll_y(table) / track));
+			}
+		} else if (table->dragging == 2) {
+			Rect thumb = table_thumb(table, false);
+			int track = (body.r - body.l) - (thumb.r - thumb.l);
+			if (track > 0) {
+				int64_t start = mouse_x - table->drag_offset - body.l;
+				table_set_scroll(table, (int) (start * table_max_scroll_x(table) / track), table->scroll_y);
+			}
+		}
+
+	} else if (message == MSG_GET_WIDTH) {
+		return MIN(table_content_width(table), 600) + SCROLLBAR_WIDTH;
+
+	} else if (message == MSG_GET_HEIGHT) {
+		return 11 * TABLE_ROW_HEIGHT + SCROLLBAR_WIDTH;
+
+	} else if (message == MSG_DESTROY) {
+		for (int i = 0; i < table->column_count; ++i) {
+			free(table->columns[i].title.glyphs);
+		}
+		free(table->columns);
+		free(table->column_offsets);
+	}
+
+	return 0;
+}
+
+// The data isn't copied, so it must stay valid while the table shows it. 
+// stride is the distance between the values of consecutive rows, in bytes.
+void table_add_column(Table *table, char *title, int width, const void *data, size_t stride, TableFormatter format) {
+	int column = table->column_count++;
+	table->columns = realloc(table->columns, sizeof(TableColumn) * table->column_count);
+	table->column_offsets = realloc(table->column_offsets, sizeof(int) * (table->column_count + 1));
+
+	TableColumn *c = &table->columns[column];
+	*c = (TableColumn) { .data = (const char *) data, .stride = stride, .format = format, .width = MAX(width, TABLE_MIN_COLUMN_WIDTH) };
+	glyph_run_set(&c->title, title, -1);
+	table->column_offsets[column + 1] = table->column_offsets[column] + c->width;
+
+	element_measure_invalidate(&table->element);
+	element_repaint(&table->element, NULL);
+}
+
+// Call again when the data changes, to repaint the table.
+void table_set_row_count(Table *table, int row_count) {
+	table->row_count = row_count;
+	table_set_scroll(table, table->scroll_x, table->scroll_y);
+	element_repaint(&table->element, NULL);
+}
+
+Table *table_create(Element *parent, uint32_t flags) {
+	Table *table = (Table*) element_create(sizeof(Table), parent, flags, table_message);
+	table->column_offsets = calloc(1, sizeof(int));
+	table->resizing = -1;
+	return table;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Plots
+//////////////////////////////////////////////////////////////////////////////
+// Each pixel column covers a range of samples, and is drawn as a vertical line
+// from their minimum to their maximum. The range is split into aligned power-of-two
+// buckets, largest first, whose minimum and maximum were worked out in advance, 
+// so a column costs O(log samples) however many samples it covers.
+#define PLOT_SCATTER (1 << 0) // Draw the samples as points instead of joining them up.
+
+// Returns the minimum and maximum of the samples in [from, to), which must not be empty.
+void plot_min_max(Plot *plot, size_t from, size_t to, float *min, float *max) {
+	*min = *max = plot->samples[from];
+
+	while (from < to) {
+		int k = 0;
+		while (k + 1 < PLOT_MAX_LEVELS && (from & (((size_t) 2 << k) - 1)) == 0 
+				&& from + ((size_t) 2 << k) <= to && plot->levels[k + 1].count > (from >> (k + 1))) {
+			++k;
+		}
+
+		float bucket_min = k ? plot->levels[k].min[from >> k] : plot->samples[from];
+		float bucket_max = k ? plot->levels[k].max[from >> k] : plot->samples[from];
+		*min = MIN(*min, bucket_min);
+		*max = MAX(*max, bucket_max);
+		from += (size_t) 1 << k;
+	}
+}
+
+// Brings the levels up to date with the samples, only working out the buckets that weren't complete before.
+void plot_update_levels(Plot *plot, size_t old_sample_count) {
+	for (int k = 1; k < PLOT_MAX_LEVELS && (plot->sample_count >> k); ++k) {
+		PlotLevel *level = &plot->levels[k], *below = &plot->levels[k - 1];
+		size_t count = plot->sample_count >> k;
+
+		if ((old_sample_count >> k) == count) break; // No new buckets here, so none further up either.
+
+		if (count > level->capacity) {
+			level->capacity = plot->sample_capacity >> k;
+			level->min = realloc(level->min, sizeof(float) * level->capacity);
+			level->max = realloc(level->max, sizeof(float) * level->capacity);
+		}
+
+		for (size_t i = level->count; i < count; ++i) {
+			if (k == 1) {
+				level->min[i] = MIN(plot->samples[2 * i], plot->samples[2 * i + 1]);
+				level->max[i] = MAX(plot->samples[2 * i], plot->samples[2 * i + 1]);
+			} else {
+				level->min[i] = MIN(below->min[2 * i], below->min[2 * i + 1]);
+				level->max[i] = MAX(below->max[2 * i], below->max[2 * i + 1]);
+			}
+		}
+
+		level->count = count;
+	}
+}
+
+Rect plot_area(Plot *plot) {
+	Rect bounds = plot->element.bounds;
+	return rect_make(bounds.l + 1, bounds.r - 1, bounds.t + 1, bounds.b - 1);
+}
+
+size_t plot_view_count(Plot *plot) {
+	return plot->view_count ? plot->view_count : plot->sample_count;
+}
+
+// The first sample in the column x pixels from the left of the plot area.
+size_t plot_column_start(Plot *plot, int x, int width) {
+	return plot->view_first + (size_t) ((uint64_t) plot_view_count(plot) * x / width);
+}
+
+int plot_value_y(Plot *plot, Rect area, float value) {
+	float range = plot->y_max - plot->y_min;
+	int y = area.b - 1 - (int) ((value - plot->y_min) / (range > 0 ? range : 1) * (area.b - area.t - 1));
+	return MIN(MAX(y, area.t), area.b - 1);
+}
+
+void plot_paint(Plot *plot, Painter *painter) {
+	Rect area = plot_area(plot);
+	draw_rect(painter, plot->element.bounds, 0xFFFFFF, 0x888888);
+
+	int width = area.r - area.l;
+	size_t view_count = plot_view_count(plot);
+	if (width <= 0 || !view_count || plot->view_first >= plot->sample_count) return;
+
+	Rect old_clip = painter->clip;
+	painter->clip = rect_intersection(old_clip, area);
+	bool scatter = plot->element.flags & PLOT_SCATTER;
+
+	if (view_count <= (size_t) width) {
+		// Zoomed in far enough that every sample has its own position.
+		int previous_x = 0, previous_y = 0;
+		size_t end = MIN(plot->sample_count, plot->view_first + view_count + 1);
+		for (size_t i = plot->view_first; i < end; ++i) {
+			int x = area.l + (int) ((uint64_t) (i - plot->view_first) * width / view_count);
+			int y = plot_value_y(plot, area, plot->samples[i]);
+			if (scatter) draw_block(painter, rect_make(x - 1, x + 2, y - 1, y + 2), plot->color);
+			else if (i > plot->view_first) draw_line(painter, previous_x, previous_y, x, y, plot->color);
+			previous_x = x, previous_y = y;
+		}
+	} else {
+		// Only the columns inside the clip are worked out.
+		for (int x = painter->clip.l - area.l; x < painter->clip.r - area.l; ++x) {
+			size_t from = plot_column_start(plot, x, width);
+			size_t to = MIN(plot_column_start(plot, x + 1, width), plot->sample_count);
+			if (from >= to) break;
+
+			// Include the last sample of the previous column, so the line is continuous.
+			if (!scatter && from) --from;
+
+			float min, max;
+			plot_min_max(plot, from, to, &min, &max);
+			int top = plot_value_y(plot, area, max), bottom = plot_value_y(plot, area, min);
+			draw_block(painter, rect_make(area.l + x, area.l + x + 1, top, bottom + 1), plot->color);
+		}
+	}
+
+	painter->clip = old_clip;
+}
+
+// Works out the range from the data, if it's not been set. Returns true if it changed.
+bool plot_update_range(Plot *plot) {
+	if (!plot->auto_range || !plot->sample_count) return false;
+	float min, max;
+	plot_min_max(plot, 0, plot->sample_count, &min, &max);
+	if (min == plot->y_min && max == plot->y_max) return false;
+	plot->y_min = min, plot->y_max = max;
+	return true;
+}
+
+// Adds samples to the end. When the view doesn't depend on the number of samples, 
+// only the columns the new samples fall in are repainted.
+void plot_append(Plot *plot, const float *samples, size_t count) {
+	size_t old_count = plot->sample_count;
+
+	if (old_count + count > plot->sample_capacity) {
+		plot->sample_capacity = MAX(plot->sample_capacity * 2, old_count + count);
+		plot->samples = realloc(plot->samples, sizeof(float) * plot->sample_capacity);
+	}
+
+	memcpy(plot->samples + old_count, samples, sizeof(float) * count);
+	plot->sample_count += count;
+	plot_update_levels(plot, old_count);
+
+	if (plot_update_range(plot) || !plot->view_count || plot_view_count(plot) <= (size_t) (plot_area(plot).r - plot_area(plot).l)) {
+		element_repaint(&plot->element, NULL);
+		return;
+	}
+
+	// The first column containing a new sample, up to the column of the last one.
+	// The column before is included, as its line joins up with the first new sample.
+	Rect area = plot_area(plot);
+	int width = area.r - area.l;
+	size_t first = MAX(old_count, plot->view_first), last = plot->sample_count;
+	if (first >= plot->view_first + plot->view_count || last <= first) return;
+
+	int l = (int) ((uint64_t) (first - plot->view_first) * width / plot->view_count) - 1;
+	int r = (int) ((uint64_t) (MIN(last, plot->view_first + plot->view_count) - plot->view_first) * width / plot->view_count) + 1;
+	element_repaint(&plot->element, &(Rect) { area.l + MAX(l, 0), area.l + MIN(r, width), area.t, area.b });
+}
+
+// Show count samples from first across the plot. A count of 0 shows all the samples.
+void plot_set_view(Plot *plot, size_t first, size_t count) {
+	plot->view_first = first;
+	plot->view_count = count;
+	element_repaint(&plot->element, NULL);
+}
+
+// Set the values shown at the bottom and top of the plot. If y_min >= y_max, they're worked out from the data.
+void plot_set_range(Plot *plot, float y_min, float y_max) {
+	plot->auto_range = y_min >= y_max;
+	plot->y_min = y_min, plot->y_max = y_max;
+	plot_update_range(plot);
+	element_repaint(&plot->element, NULL);
+}
+
+int plot_message(Element *element, Message message, int data_int, void *data_ptr) {
+	Plot *plot = (Plot*) element;
+	(void) data_int;
+
+	if (message == MSG_PAINT) {
+		plot_paint(plot, (Painter*) data_ptr);
+
+	} else if (message == MSG_GET_WIDTH) {
+		return 300;
+
+	} else if (message == MSG_GET_HEIGHT) {
+		return 150;
+
+	} else if (message == MSG_DESTROY) {
+		free(plot->samples);
+		for (int k = 0; k < PLOT_MAX_LEVELS; ++k) {
+			free(plot->levels[k].min);
+			free(plot->levels[k].max);
+		}
+	}
+
+	return 0;
+}
+
+Plot *plot_create(Element *parent, uint32_t flags, uint32_t color) {
+	Plot *plot = (Plot*) element_create(sizeof(Plot), parent, flags, plot_message);
+	plot->color = color;
+	plot->auto_range = true;
+	return plot;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Images
+//////////////////////////////////////////////////////////////////////////////
+// The pixels are read straight from the mapped file. When an image is drawn at 
+// less than half its size, a smaller level is worked out (each averaging 2x2 pixels
+// of the one before) and kept, so a grid of thumbnails doesn't read the whole file
+// every time it's painted. Any alpha channel is ignored.
+#define IMAGE_BILINEAR (1 << 0) // Filter when scaling, instead of picking the nearest pixel.
+#define IMAGE_STRETCH  (1 << 1) // Fill the bounds, instead of keeping the aspect ratio.
+
+uint32_t image_level_pixel(ImageLevel *level, int x, int y) {
+	const uint8_t *p = level->pixels + y * level->stride;
+
+	if (level->format == IMAGE_FORMAT_BGRA) {
+		uint32_t pixel;
+		memcpy(&pixel, p + x * 4, 4);
+		return pixel;
+	} else if (level->format == IMAGE_FORMAT_RGB) {
+		p += x * 3;
+		return 0xFF000000 | (p[0] << 16) | (p[1] << 8) | p[2];
+	} else if (level->format == IMAGE_FORMAT_RGBA) {
+		p += x * 4;
+		return ((uint32_t) p[3] << 24) | (p[0] << 16) | (p[1] << 8) | p[2];
+	} else {
+		return 0xFF000000 | (p[x] * 0x010101);
+	}
+}
+
+uint32_t image_lerp(uint32_t a, uint32_t b, int weight) {
+	// weight is from 0 (all a) to 256 (all b). Red and blue are done together, then alpha and green.
+	uint32_t rb = (((a & 0xFF00FF) * (256 - weight) + (b & 0xFF00FF) * weight) >> 8) & 0xFF00FF;
+	uint32_t ag = ((((a >> 8) & 0xFF00FF) * (256 - weight) + ((b >> 8) & 0xFF00FF) * weight) >> 8) & 0xFF00FF;
+	return rb | (ag << 8);
+}
+
+// The average of each channel, rounding up (like _mm_avg_epu8).
+uint32_t image_average(uint32_t a, uint32_t b) {
+	return (a | b) - (((a ^ b) & 0xFEFEFEFE) >> 1);
+}
+
+// Works out the next level from the last one.
+void image_add_level(Image *image) {
+	ImageLevel *source = &image->levels[image->level_count - 1];
+	ImageLevel *level = &image->levels[image->level_count++];
+	level->width = MAX(1, source->width / 2);
+	level->height = MAX(1, source->height / 2);
+	level->stride = level->width * 4;
+	level->format = IMAGE_FORMAT_BGRA;
+	uint32_t *bits = (uint32_t*) malloc(level->stride * level->height);
+	level->pixels = (const uint8_t*) bits;
+
+	for (int y = 0; y < level->height; ++y) {
+		int y0 = MIN(2 * y, source->height - 1), y1 = MIN(2 * y + 1, source->height - 1);
+		uint32_t *out = bits + y * level->width;
+		int x = 0;
+
+#ifdef USE_SSE2
+		if (source->format == IMAGE_FORMAT_BGRA && source->width >= 2) {
+			const uint8_t *row0 = source->pixels + y0 * source->stride, *row1 = source->pixels + y1 * source->stride;
+
+			// 4 output pixels from 8 input pixels on each row: average the rows, then the even and odd pixels.
+			for (; x + 4 <= source->width / 2; x += 4) {
+				__m128i a = _mm_avg_epu8(_mm_loadu_si128((const __m128i*) (row0 + x * 8)), _mm_loadu_si128((const __m128i*) (row1 + x * 8)));
+				__m128i b = _mm_avg_epu8(_mm_loadu_si128((const __m128i*) (row0 + x * 8 + 16)), _mm_loadu_si128((const __m128i*) (row1 + x * 8 + 16)));
+				a = _mm_shuffle_epi32(a, _MM_SHUFFLE(3, 1, 2, 0));
+				b = _mm_shuffle_epi32(b, _MM_SHUFFLE(3, 1, 2, 0));
+				_mm_storeu_si128((__m128i*) (out + x), _mm_avg_epu8(_mm_unpacklo_epi64(a, b), _mm_unpackhi_epi64(a, b)));
+			}
+		}
+#endif
+
+		for (; x < level->width; ++x) {
+			int x0 = MIN(2 * x, source->width - 1), x1 = MIN(2 * x + 1, source->width - 1);
+			uint32_t left = image_average(image_level_pixel(source, x0, y0), image_level_pixel(source, x0, y1));
+			uint32_t right = image_average(image_level_pixel(source, x1, y0), image_level_pixel(source, x1, y1));
+			out[x] = image_average(left, right);
+		}
+	}
+}
+
+// Returns the smallest level that is still at least the given size, working it out if needed.
+ImageLevel *image_level_for_size(Image *image, int width, int height) {
+	int level = 0;
+
+	while (level + 1 < IMAGE_MAX_LEVELS) {
+		ImageLevel *current = &image->levels[level];
+		if (current->width / 2 < MAX(width, 1) || current->height / 2 < MAX(height, 1)) break;
+		if (level + 1 == image->level_count) image_add_level(image);
+		++level;
+	}
+
+	return &image->levels[level];
+}
+
+// Draws the source scaled to fill destination, clipped to painter->clip. 
+// Only the pixels inside the clip are worked out.
+void draw_image(Painter *painter, Rect destination, ImageLevel *source, bool bilinear) {
+	Rect rect = rect_intersection(painter->clip, destination);
+	if (!rect_valid(rect) || source->width <= 0 || source->height <= 0) return;
+
+	// Source positions in 16.16 fixed point, at the centre of each destination pixel.
+	int dw = destination.r - destination.l, dh = destination.b - destination.t;
+	int64_t step_x = ((int64_t) source->width << 16) / dw, step_y = ((int64_t) source->height << 16) / dh;
+	bilinear = bilinear && source->width >= 2 && source->height >= 2;
+
+	for (int y = rect.t; y < rect.b; ++y) {
+		uint32_t *out = painter->bits + y * painter->width;
+		int64_t v = (y - destination.t) * step_y + step_y / 2;
+
+		if (!bilinear) {
+			int sy = MIN((int) (v >> 16), source->height - 1);
+			int x = rect.l;
+
+#ifdef USE_SSE2
+			if (source->format == IMAGE_FORMAT_BGRA) {
+				// No gathers in SSE2, but the 4 pixels can at least be stored together.
+				const uint32_t *row = (const uint32_t*) (source->pixels + sy * source->stride);
+				for (; x + 4 <= rect.r; x += 4) {
+					int64_t u = (x - destination.l) * step_x + step_x / 2;
+					int s0 = (int) (u >> 16), s1 = (int) ((u + step_x) >> 16);
+					int s2 = (int) ((u + 2 * step_x) >> 16), s3 = MIN((int) ((u + 3 * step_x) >> 16), source->width - 1);
+					_mm_storeu_si128((__m128i*) (out + x), _mm_set_epi32((int) row[s3], (int) row[s2], (int) row[s1], (int) row[s0]));
+				}
+			}
+#endif
+
+			for (; x < rect.r; ++x) {
+				int sx = MIN((int) (((x - destination.l) * step_x + step_x / 2) >> 16), source->width - 1);
+				out[x] = image_level_pixel(source, sx, sy);
+			}
+
+			continue;
+		}
+
+		// Bilinear: the pixel's neighbours at (sx, sy) to (sx + 1, sy + 1), weighted by the fractions fx and fy (out of 256).
+		v = MAX(v - 0x8000, 0);
+		int sy = (int) (v >> 16), fy = (int) ((v >> 8) & 0xFF);
+		if (sy >= source->height - 1) sy = source->height - 2, fy = 256;
+
+		for (int x = rect.l; x < rect.r; ++x) {
+			int64_t u = MAX((x - destination.l) * step_x + step_x / 2 - 0x8000, 0);
+			int sx = (int) (u >> 16), fx = (int) ((u >> 8) & 0xFF);
+			if (sx >= source->width - 1) sx = source->width - 2, fx = 256;
+
+#ifdef USE_SSE2
+			if (source->format == IMAGE_FORMAT_BGRA) {
+				// Both pixels of each row are in one register, as 16-bit channels.
+				__m128i zero = _mm_setzero_si128();
+				const uint8_t *p = source->pixels + sy * source->stride + sx * 4;
+				__m128i top = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) p), zero);
+				__m128i bottom = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) (p + source->stride)), zero);
+				__m128i column = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(top, _mm_set1_epi16((short) (256 - fy))), 
+							_mm_mullo_epi16(bottom, _mm_set1_epi16((short) fy))), 8);
+				__m128i weighted = _mm_mullo_epi16(column, _mm_set_epi16((short) fx, (short) fx, (short) fx, (short) fx, 
+							(short) (256 - fx), (short) (256 - fx), (short) (256 - fx), (short) (256 - fx)));
+				__m128i sum = _mm_srli_epi16(_mm_add_epi16(weighted, _mm_srli_si128(weighted, 8)), 8);
+				out[x] = (uint32_t) _mm_cvtsi128_si32(_mm_packus_epi16(sum, zero));
+				continue;
+			}
+#endif
+
+			uint32_t left = image_lerp(image_level_pixel(source, sx, sy), image_level_pixel(source, sx, sy + 1), fy);
+			uint32_t right = image_lerp(image_level_pixel(source, sx + 1, sy), image_level_pixel(source, sx + 1, sy + 1), fy);
+			out[x] = image_lerp(left, right, fx);
+		}
+	}
+}
+
+// Where the image goes in the element's bounds.
+Rect image_destination(Image *image) {
+	Rect bounds = image->element.bounds;
+	if (image->element.flags & IMAGE_STRETCH) return bounds;
+
+	// The largest size that fits, keeping the aspect ratio, centred.
+	int width = bounds.r - bounds.l, height = bounds.b - bounds.t;
+	int image_width = image->levels[0].width, image_height = image->levels[0].height;
+	if ((int64_t) width * image_height > (int64_t) height * image_width) {
+		width = (int) ((int64_t) height * image_width / image_height);
+	} else {
+		height = (int) ((int64_t) width * image_height / image_width);
+	}
+
+	int l = (bounds.l + bounds.r - width) / 2, t = (bounds.t + bounds.b - height) / 2;
+	return rect_make(l, l + width, t, t + height);
+}
+
+int image_message(Element *element, Message message, int data_int, void *data_ptr) {
+	Image *image = (Image*) element;
+	(void) data_int;
+
+	if (message == MSG_PAINT) {
+		Rect destination = image_destination(image);
+		ImageLevel *level = image_level_for_size(image, destination.r - destination.l, destination.b - destination.t);
+		draw_image((Painter*) data_ptr, destination, level, element->flags & IMAGE_BILINEAR);
+
+	} else if (message == MSG_GET_WIDTH) {
+		return image->levels[0].width;
+
+	} else if (message == MSG_GET_HEIGHT) {
+		return image->levels[0].height;
+
+	} else if (message == MSG_DESTROY) {
+		for (int i = 1; i < image->level_count; ++i) {
+			free((void*) image->levels[i].pixels);
+		}
+		platform_file_unmap(&image->file);
+	}
+
+	return 0;
+}
+
+Image *image_create_from_level(Element *parent, uint32_t flags, MappedFile *file, ImageLevel *level) {
+	Image *image = (Image*) element_create(sizeof(Image), parent, flags, image_message);
+	image->file = *file;
+	image->levels[0] = *level;
+	image->level_count = 1;
+	return image;
+}
+
+// Reads a number from a Netpbm header, skipping whitespace and comments. Returns -1 if there isn't one.
+int image_read_header_number(MappedFile *file, size_t *position) {
+	while (*position < file->size) {
+		char c = file->data[*position];
+		if (c == '#') while (*position < file->size && file->data[*position] != '\n') ++*position;
+		else if (c == ' ' || c == '\t' || c == '\r' || c == '\n') ++*position;
+		else break;
+	}
+
+	int value = -1;
+	while (*position < file->size && file->data[*position] >= '0' && file->data[*position] <= '9' && value < 1000000) {
+		value = (value == -1 ? 0 : value * 10) + (file->data[(*position)++] - '0');
+	}
+	return value;
+}
+
+// Loads a binary PPM (P6), PGM (P5) or PAM (P7) file with a maximum value of 255. 
+// Returns NULL if the file can't be opened or isn't one of those.
+Image *image_create(Element *parent, uint32_t flags, const char *path) {
+	MappedFile file;
+	if (!platform_file_map(&file, path)) return NULL;
+
+	ImageLevel level = { 0 };
+	size_t position = 2;
+	int max_value = -1, depth = 0;
+	char kind = file.size > 2 && file.data[0] == 'P' ? file.data[1] : 0;
+
+	if (kind == '5' || kind == '6') {
+		level.width = image_read_header_number(&file, &position);
+		level.height = image_read_header_number(&file, &position);
+		max_value = image_read_header_number(&file, &position);
+		position++; // A single whitespace character comes before the pixels.
+		depth = kind == '5' ? 1 : 3;
+	} else if (kind == '7') {
+		// PAM headers are lines of a keyword and a value, up to ENDHDR.
+		while (position < file.size) {
+			while (position < file.size && (file.data[position] == '\n' || file.data[position] == ' ')) ++position;
+			const char *line = file.data + position;
+			size_t remaining = file.size - position;
+			size_t keyword_length = 0;
+			while (keyword_length < remaining && line[keyword_length] > ' ') ++keyword_length;
+			position += keyword_length;
+
+			if (keyword_length == 6 && !memcmp(line, "ENDHDR", 6)) { position++; break; }
+			else if (keyword_length == 5 && !memcmp(line, "WIDTH", 5)) level.width = image_read_header_number(&file, &position);
+			else if (keyword_length == 6 && !memcmp(line, "HEIGHT", 6)) level.height = image_read_header_number(&file, &position);
+			else if (keyword_length == 5 && !memcmp(line, "DEPTH", 5)) depth = image_read_header_number(&file, &position);
+			else if (keyword_length == 6 && !memcmp(line, "MAXVAL", 6)) max_value = image_read_header_number(&file, &position);
+			else while (position < file.size && file.data[position] != '\n') ++position; // TUPLTYPE and comments.
+		}
+	}
+
+	level.format = depth == 1 ? IMAGE_FORMAT_GRAY : depth == 3 ? IMAGE_FORMAT_RGB : IMAGE_FORMAT_RGBA;
+	level.stride = (size_t) MAX(level.width, 0) * depth;
+	level.pixels = (const uint8_t*) file.data + position;
+
+	if (max_value != 255 || (depth != 1 && depth != 3 && depth != 4) || level.width <= 0 || level.height <= 0
+			|| position > file.size || (file.size - position) / level.stride < (size_t) level.height) {
+		platform_file_unmap(&file);
+		return NULL;
+	}
+
+	return image_create_from_level(parent, flags, &file, &level);
+}
+
+// Loads a file of BGRA pixels with no header, such as a dump of a window's bits.
+// Returns NULL if the file can't be opened or is too small.
+Image *image_create_raw(Element *parent, uint32_t flags, const char *path, int width, int height) {
+	MappedFile file;
+	if (!platform_file_map(&file, path)) return NULL;
+
+	ImageLevel level = { (const uint8_t*) file.data, width, height, (size_t) width * 4, IMAGE_FORMAT_BGRA };
+	if (width <= 0 || height <= 0 || file.size / level.stride < (size_t) height) {
+		platform_file_unmap(&file);
+		return NULL;
+	}
+
+	return image_create_from_level(parent, flags, &file, &level);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Drawing helpers
+//////////////////////////////////////////////////////////////////////////////
+
+// Taken from https://commons.wikimedia.org/wiki/File:Codepage-437.png
 // Public domain.
 const uint64_t _font[] = {
 	0x0000000000000000UL, 0x0000000000000000UL, 0xBD8181A5817E0000UL, 0x000000007E818199UL, 0xC3FFFFDBFF7E0000UL, 0x000000007EFFFFE7UL, 0x7F7F7F3600000000UL, 0x00000000081C3E7FUL, 
@@ -640,263 +3744,2161 @@ const uint64_t _font[] = {
 	0x1800181818180000UL, 0x0000000018181818UL, 0x18701818180E0000UL, 0x000000000E181818UL, 0x000000003B6E0000UL, 0x0000000000000000UL, 0x63361C0800000000UL, 0x00000000007F6363UL, 
 };
 
-void draw_block(Painter *painter, Rect rect, uint32_t color) {
-	// Intersect the rectangle we want to fill with the clip, i.e. the rectangle we're allowed to draw into.
-	rect = rect_intersection(painter->clip, rect);
+void draw_block(Painter *painter, Rect rect, uint32_t color) {
+	// Intersect the rectangle we want to fill with the clip, i.e. the rectangle we're allowed to draw into.
+	rect = rect_intersection(painter->clip, rect);
+
+	for (int y = rect.t; y < rect.b; ++y) {
+		for (int x = rect.l; x < rect.r; ++x) {
+			painter->bits[y * painter->width + x] = color;
+		}
+	}
+}
+
+// Draws a 1 pixel wide line including both end points, clipped to painter->clip.
+void draw_line(Painter *painter, int x0, int y0, int x1, int y1, uint32_t color) {
+	int dx = x1 > x0 ? x1 - x0 : x0 - x1, dy = y1 > y0 ? y0 - y1 : y1 - y0;
+	int step_x = x0 < x1 ? 1 : -1, step_y = y0 < y1 ? 1 : -1;
+	int error = dx + dy;
+
+	while (true) {
+		if (rect_contains(painter->clip, x0, y0)) {
+			painter->bits[y0 * painter->width + x0] = color;
+		}
+
+		if (x0 == x1 && y0 == y1) break;
+		int error2 = 2 * error;
+		if (error2 >= dy) error += dy, x0 += step_x;
+		if (error2 <= dx) error += dx, y0 += step_y;
+	}
+}
+
+void draw_rect(Painter *painter, Rect r, uint32_t fill_color, uint32_t border_color) {
+	// border top
+	draw_block(painter, (Rect){r.l, r.r, r.t, r.t+1}, border_color);
+	// border right
+	draw_block(painter, (Rect){r.r-1, r.r, r.t, r.b}, border_color);
+	// border bottom
+	draw_block(painter, (Rect){r.l, r.r, r.b-1, r.b}, border_color);
+	// border left
+	draw_block(painter, (Rect){r.l, r.l+1, r.t, r.b}, border_color);
+	// fill
+	draw_block(painter, (Rect){r.l+1, r.r-1, r.t+1, r.b-1}, fill_color);
+}
+
+// Draws a single glyph with its top-left corner at (x, y), clipped to painter->clip.
+void draw_glyph(Painter *painter, int x, int y, uint8_t glyph, uint32_t color) {
+	Rect rect = rect_intersection(painter->clip, rect_make(x, x + 8, y, y + 16));
+	uint8_t *data = (uint8_t*) _font + glyph * 16;
+
+	// Blit the glyph bits.
+	for (int i = rect.t; i < rect.b; ++i) {
+		uint32_t *bits = painter->bits + i * painter->width + rect.l;
+		uint8_t byte = data[i - y];
+
+		for (int j = rect.l; j < rect.r; ++j) {
+			if (byte & (1 << (j - x))) {
+				*bits = color;
+			}
+			++bits;
+		}
+	}
+}
+
+void draw_glyphs(Painter *painter, Rect bounds, uint8_t *glyphs, int glyph_count, uint32_t color, bool align_center) {
+	// setup the clipping region
+	Rect old_clip = painter->clip;
+	painter->clip = rect_intersection(old_clip, bounds);
+
+	// Work out where to start drawing the text within the provided bounds.
+	int x = bounds.l;
+	int y = (bounds.t + bounds.b - GLYPH_HEIGHT) / 2;
+	if (align_center) x += (int)(bounds.r - bounds.l - glyph_count * GLYPH_WIDTH) / 2;
+
+	// Skip the glyphs left of the clip, and stop once past its right edge.
+	int first = MAX(0, (painter->clip.l - x) / GLYPH_WIDTH);
+	for (int i = first; i < glyph_count && x + i * GLYPH_WIDTH < painter->clip.r; ++i) {
+		draw_glyph(painter, x + i * GLYPH_WIDTH, y, glyphs[i], color);
+	}
+
+	// Restore the old clipping region.
+	painter->clip = old_clip;
+}
+
+// Draws UTF-8 text. Elements that draw the same text repeatedly should decode it
+// once into a GlyphRun and use draw_glyphs instead.
+void draw_string(Painter *painter, Rect bounds, char *string, int bytes, uint32_t color, bool align_center) {
+	// setup the clipping region
+	Rect old_clip = painter->clip;
+	painter->clip = rect_intersection(old_clip, bounds);
+
+	// Count the glyphs to work out where to start drawing the text within the provided bounds.
+	int glyph_count = 0;
+	uint32_t codepoint;
+	for (int i = 0; i < bytes; ++glyph_count) {
+		i += utf8_decode(string + i, bytes - i, &codepoint);
+	}
+
+	int x = bounds.l;
+	int y = (bounds.t + bounds.b - GLYPH_HEIGHT) / 2;
+	if (align_center) x += (int)(bounds.r - bounds.l - glyph_count * GLYPH_WIDTH) / 2;
+
+	// For every character in the string...
+	for (int i = 0; i < bytes && x < painter->clip.r;) {
+		i += utf8_decode(string + i, bytes - i, &codepoint);
+		draw_glyph(painter, x, y, glyph_index(codepoint), color);
+
+		// Advance to the position of the next glyph.
+		x += GLYPH_WIDTH;
+	}
+
+	// Restore the old clipping region.
+	painter->clip = old_clip;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Core UI Code
+//////////////////////////////////////////////////////////////////////////////
+void ui_update(void);
+void ui_record_input(Window *window, Message message, int data_int, KeyTyped *key, bool has_position, int x, int y);
+void ui_record_resize(Window *window, int width, int height);
+void window_event_push(Window *window, WindowEvent *event);
+
+// element is NULL if mouse button not being pressed
+// button is the mouse button that went up OR down
+void ui_window_set_pressed(Window *window, Element *element, MouseButton button) {
+	Element *previous = window->pressed;
+	window->pressed = element;
+	window->pressed_mouse_button = button;
+	if (previous) element_message(previous, MSG_UPDATE, UPDATE_PRESSED, 0);
+	if (element)  element_message(element, MSG_UPDATE, UPDATE_PRESSED, 0);
+}
+
+// Resize the window's bitmap and lay it out again, on the thread that owns the window.
+// Returns false if the size hasn't changed.
+bool window_set_size(Window *window, int width, int height) {
+	if (window->width == width && window->height == height && window->bits) return false;
+	window->width = width;
+	window->height = height;
+	window->bits = (uint32_t*)realloc(window->bits, window->width * window->height * 4);
+	window->element.bounds = rect_make(0, window->width, 0, window->height);
+	window->element.clip = rect_make(0, window->width, 0, window->height);
+
+	if (window->paint_tile_count) {
+		// The tiles left to paint are for the old size. Repaint everything instead.
+		window->paint_tile_count = 0;
+		memset(window->paint_tiles, 0, window->paint_tiles_x * window->paint_tiles_y);
+		element_repaint(&window->element, NULL);
+	}
+
+	element_message(&window->element, MSG_LAYOUT, 0, 0);
+	return true;
+}
+
+// The platform layer calls this when the window might have changed size. Its own resources 
+// are updated on the window's MSG_LAYOUT (which may be on the window's thread, see window_thread_start).
+void ui_window_resize(Window *window, int width, int height) {
+	if (global_state.record_file) ui_record_resize(window, width, height);
+
+	if (window->threaded) {
+		WindowEvent event = { .kind = WINDOW_EVENT_RESIZE, .x = width, .y = height };
+		window_event_push(window, &event);
+	} else if (window_set_size(window, width, height)) {
+		ui_update();
+	}
+}
+
+// When the mouse leaves the window while a button is held, it's still dragging from where it was.
+void window_set_mouse(Window *window, int x, int y) {
+	if (x == -1 && y == -1 && window->pressed) return;
+	window->mouse_x = x;
+	window->mouse_y = y;
+}
+
+void ui_window_dispatch_input(Window *window, Message message, int data_int, void *data_ptr);
+void window_input_arrived(Window *window, Message message, uint64_t arrival);
+
+// When the input the platform layer is passing on arrived.
+uint64_t ui_input_arrival(void) {
+	return global_state.input_arrival ? global_state.input_arrival : platform_time_us();
+}
+
+// The platform layer calls this for input that doesn't come with a mouse position, like key presses.
+void ui_window_input_event(Window *window, Message message, int data_int, void *data_ptr) {	
+	if (global_state.record_file) {
+		ui_record_input(window, message, data_int, (KeyTyped *) data_ptr, false, 0, 0);
+	}
+
+	uint64_t arrival = ui_input_arrival();
+
+	if (window->threaded) {
+		WindowEvent event = { .kind = WINDOW_EVENT_INPUT, .message = message, .data_int = data_int, .arrival = arrival };
+
+		if (message == MSG_KEY_TYPED) {
+			event.key = *(KeyTyped *) data_ptr;
+			assert(event.key.bytes <= (int) sizeof(event.text));
+			memcpy(event.text, event.key.text, event.key.bytes);
+		}
+
+		window_event_push(window, &event);
+	} else {
+		window_input_arrived(window, message, arrival);
+		ui_window_dispatch_input(window, message, data_int, data_ptr);
+	}
+}
+
+// The platform layer calls this for mouse input at (x, y) in the window, or at (-1, -1) when the mouse leaves it.
+void ui_window_mouse_event(Window *window, Message message, int data_int, int x, int y) {
+	if (global_state.record_file) {
+		ui_record_input(window, message, data_int, NULL, true, x, y);
+	}
+
+	uint64_t arrival = ui_input_arrival();
+
+	if (window->threaded) {
+		WindowEvent event = { .kind = WINDOW_EVENT_INPUT, .message = message, .data_int = data_int, 
+			.x = x, .y = y, .has_position = true, .arrival = arrival };
+		window_event_push(window, &event);
+	} else {
+		window_set_mouse(window, x, y);
+		window_input_arrived(window, message, arrival);
+		ui_window_dispatch_input(window, message, data_int, NULL);
+	}
+}
+
+// Send the input to the elements it's for, on the thread that owns the window.
+void ui_window_dispatch_input(Window *window, Message message, int data_int, void *data_ptr) {	
+	if (message == MSG_KEY_TYPED && window->focused) {
+		element_message(window->focused, message, data_int, data_ptr);
+	}
+
+	if (window->pressed) {
+		if (message == MSG_MOUSE_MOVE) {
+			// Mouse move events become mouse drag messages, sent to the
+			// element we pressed the mouse button down over.
+			element_message(window->pressed, MSG_MOUSE_DRAG, data_int, data_ptr);
+		} else if (message == MSG_MOUSE_LEFT_UP && window->pressed_mouse_button == MOUSE_BUTTON_LEFT) {
+			if (window->hovered == window->pressed) {
+				// If left mouse is released on the same element that it was previously down on, 
+				// send a clicked message to that element.
+				element_message(window->pressed, MSG_CLICKED, data_int, data_ptr);
+			}
+			// stop pressing the element
+			element_message(window->pressed, MSG_MOUSE_LEFT_UP, data_int, data_ptr);
+			ui_window_set_pressed(window, NULL, MOUSE_BUTTON_LEFT);
+		} else if (message == MSG_MOUSE_MIDDLE_UP && window->pressed_mouse_button == MOUSE_BUTTON_MIDDLE) {
+			// If middle mouse is released on the same element that it was previously down on,
+			// stop pressing the element
+			element_message(window->pressed, MSG_MOUSE_MIDDLE_UP, data_int, data_ptr);
+			ui_window_set_pressed(window, NULL, MOUSE_BUTTON_MIDDLE);
+		} else if (message == MSG_MOUSE_RIGHT_UP && window->pressed_mouse_button == MOUSE_BUTTON_RIGHT) {
+			// If right mouse is released on the same element that it was previously down on,
+			// stop pressing the element
+			element_message(window->pressed, MSG_MOUSE_RIGHT_UP, data_int, data_ptr);
+			ui_window_set_pressed(window, NULL, MOUSE_BUTTON_RIGHT);
+		} 
+	}
+
+
+	if (window->pressed) {
+		// While a mouse button is held, the hovered element is either the pressed element,
+		// or the window element (at the root of the hierarchy).
+		// Other elements are not allowed to be considered hovered until the button is released.
+		// Here, we update the hovered field and send out MSG_UPDATE messages as necessary.
+		bool inside = rect_contains(window->pressed->clip, window->mouse_x, window->mouse_y);
+		if (inside && window->hovered == &window->element) {
+			window->hovered = window->pressed;
+			element_message(window->pressed, MSG_UPDATE, UPDATE_HOVERED, 0);
+		} else if (!inside && window->hovered == window->pressed) {
+			window->hovered = &window->element;
+			element_message(window->pressed, MSG_UPDATE, UPDATE_HOVERED, 0);
+		}
+
+	} else {
+		// No element is currently pressed.
+		Element *hovered = element_find_by_point(&window->element, window->mouse_x, window->mouse_y);
+
+		if (message == MSG_MOUSE_MOVE) {
+			element_message(hovered, message, data_int, data_ptr);
+		} else if (message == MSG_MOUSE_WHEEL) {
+			// Offer the wheel to the hovered element, then its ancestors, until one handles it.
+			for (Element *element = hovered; element; element = element->parent) {
+				if (element_message(element, message, data_int, data_ptr)) break;
+			}
+		} else if (message == MSG_MOUSE_LEFT_DOWN) {
+			// If the left mouse button is pressed, start pressing the hovered element.
+			ui_window_set_pressed(window, hovered, MOUSE_BUTTON_LEFT);
+			element_message(hovered, message, data_int, data_ptr);
+		} else if (message == MSG_MOUSE_MIDDLE_DOWN) {
+			// If the middle mouse button is pressed, start pressing the hovered element.
+			ui_window_set_pressed(window, hovered, MOUSE_BUTTON_MIDDLE);
+			element_message(hovered, message, data_int, data_ptr);
+		} else if (message == MSG_MOUSE_RIGHT_DOWN) {
+			// If the right mouse button is pressed, start pressing the hovered element.
+			ui_window_set_pressed(window, hovered, MOUSE_BUTTON_RIGHT);
+			element_message(hovered, message, data_int, data_ptr);
+		}
+
+		if (hovered != window->hovered) {
+			Element *previous = window->hovered;
+			window->hovered = hovered;
+			element_message(previous, MSG_UPDATE, UPDATE_HOVERED, 0);
+			element_message(hovered, MSG_UPDATE, UPDATE_HOVERED, 0);
+		}
+	}
+
+	// Process any queued repaints. (A window with its own thread does that after handling its events.)
+	if (!window->threaded) ui_update();
+}
+
+void ui_element_paint(Element *element, Painter *painter) {
+	// Compute the intersection of where the element is allowed to draw, element->clip,
+	// with the area requested to be drawn, painter->clip.
+	Rect clip = rect_intersection(element->clip, painter->clip);
+
+	// If the above regions do not overlap, return here,
+	// and do not recurse into our descendant elements
+	// (since their clip rectangles are contained within element->clip).
+	if (!rect_valid(clip)) {
+		return;
+	}
+
+	// Set the painter's clip and ask the element to paint itself.
+	painter->clip = clip;
+	element_message(element, MSG_PAINT, 0, painter);
+
+	// Recurse into each child, restoring the clip each time.
+	for (uintptr_t i = 0; i < element->child_count; ++i) {
+		painter->clip = clip;
+		ui_element_paint(element->children[i], painter);
+	}
+}
+
+void ui_element_layout(Element *element) {
+	if (element->flags & ELEMENT_DESTROY) {
+		return;
+	}
+
+	if (element->flags & ELEMENT_LAYOUT_DIRTY) {
+		element->flags &= ~ELEMENT_LAYOUT_DIRTY;
+
+		// If the element's size changed, its parent needs to arrange its children again,
+		// and so on up the hierarchy. Stop at the first element whose size didn't change.
+		Element *root = element;
+		while (root->parent && element_measure_changed(root)) {
+			root = root->parent;
+		}
+
+		// element_move() only sends MSG_LAYOUT to children whose bounds changed,
+		// so this doesn't descend any further than necessary.
+		element_message(root, MSG_LAYOUT, 0, 0);
+		element_repaint(root, NULL);
+	}
+
+	// Is there some descendent of this element that needs layout?
+	if (element->flags & ELEMENT_LAYOUT_DESCENDENT) {
+		element->flags &= ~ELEMENT_LAYOUT_DESCENDENT;
+		for (uintptr_t i = 0; i < element->child_count; ++i) {
+			ui_element_layout(element->children[i]);
+		}
+	}
+}
+
+bool ui_element_destroy(Element *element) {
+	// Is there some descendent of this element that needs to be destroyed?
+	if (element->flags & ELEMENT_DESTROY_DESCENDENT) {
+		// Clear the flag, ready for the next update cycle.
+		element->flags &= ~ELEMENT_DESTROY_DESCENDENT;
+
+		// For each child,
+		for (uintptr_t i = 0; i < element->child_count; ++i) { // Exercise to the reader: how can this specific line of code be optimized?
+			// Recurse. Was this specific element destroyed?
+			if (ui_element_destroy(element->children[i])) {
+				// Yes, so remove it from our list of children.
+				memmove(&element->children[i], &element->children[i + 1], sizeof(Element *) * (element->child_count - i - 1));
+				element->child_count--;
+				i--;
+			}
+		}
+	}
+
+	// Does this element need to be destroyed?
+	if (element->flags & ELEMENT_DESTROY) {
+		// Sent it the MSG_DESTROY message.
+		element_message(element, MSG_DESTROY, 0, 0);
+
+		// If this element is being pressed, clear the pressed field in the Window.
+		if (element->window->pressed == element) {
+			ui_window_set_pressed(element->window, NULL, 0);
+		}
+
+		// If this element has keyboard focus, clear the focused field in the Window.
+		if (element->window->focused == element) {
+			element->window->focused = NULL;
+		}
+
+		// If this element is being hovered, reset the hovered field in the Window to the default.
+		if (element->window->hovered == element) {
+			element->window->hovered = &element->window->element;
+		}
+
+		for (Element *ancestor = element->parent; ancestor; ancestor = ancestor->parent) {
+			atomic_add(&ancestor->descendant_count, -1);
+		}
+
+		// Make its handle invalid, and let the slot be reused.
+		if (element->handle_index) {
+			mutex_lock(&global_state.handle_mutex);
+			HandleSlot *slot = &global_state.handles[element->handle_index];
+			slot->element = NULL;
+			slot->window = NULL;
+			slot->generation++;
+			slot->next_free = global_state.handle_free;
+			global_state.handle_free = element->handle_index;
+			mutex_unlock(&global_state.handle_mutex);
+		}
+
+		// Free the element's children list, and the element structure itself.
+		free(element->children);
+		free(element);
+		return true;
+
+	} else {
+		// The element was not destroyed.
+		return false;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Posted messages
+//////////////////////////////////////////////////////////////////////////////
+// Other threads can't use elements directly, but they can hold handles and
+// post messages to them. Posting doesn't take a lock: the queue is Dmitry Vyukov's
+// intrusive MPSC queue, where a producer swaps itself in as the head and then
+// links the previous head to itself. The UI thread is woken on the first post
+// after it last drained the queue, and drains it once per frame, before ui_update.
+
+// Returns a handle for the element, giving it one if it doesn't have one yet. 
+// Only on the thread that owns the element's window.
+ElementHandle element_handle(Element *element) {
+	mutex_lock(&global_state.handle_mutex);
+
+	if (!element->handle_index) {
+		uint32_t index = global_state.handle_free;
+
+		if (index) {
+			global_state.handle_free = global_state.handles[index].next_free;
+		} else {
+			if (!global_state.handle_count) global_state.handle_count = 1; // Slot 0 is never used.
+			index = global_state.handle_count++;
+			global_state.handles = realloc(global_state.handles, sizeof(HandleSlot) * global_state.handle_count);
+			global_state.handles[index].generation = 1;
+		}
+
+		global_state.handles[index].element = element;
+		global_state.handles[index].window = element->window;
+		element->handle_index = index;
+	}
+
+	ElementHandle handle = ((uint64_t) global_state.handles[element->handle_index].generation << 32) | element->handle_index;
+	mutex_unlock(&global_state.handle_mutex);
+	return handle;
+}
+
+// Returns the slot if the handle still refers to an element. Call with handle_mutex locked.
+HandleSlot *handle_slot(ElementHandle handle) {
+	uint32_t index = (uint32_t) handle, generation = (uint32_t) (handle >> 32);
+	if (!index || index >= global_state.handle_count) return NULL;
+	HandleSlot *slot = &global_state.handles[index];
+	return slot->generation == generation && slot->element ? slot : NULL;
+}
+
+// Returns NULL if the element has been destroyed, or is about to be. 
+// Only on the thread that owns the element's window.
+Element *element_from_handle(ElementHandle handle) {
+	mutex_lock(&global_state.handle_mutex);
+	HandleSlot *slot = handle_slot(handle);
+	Element *element = slot ? slot->element : NULL;
+	mutex_unlock(&global_state.handle_mutex);
+	return element && !(element->flags & ELEMENT_DESTROY) ? element : NULL;
+}
+
+// Returns the window of the element, or NULL if it has been destroyed. Any thread.
+Window *handle_window(ElementHandle handle) {
+	mutex_lock(&global_state.handle_mutex);
+	HandleSlot *slot = handle_slot(handle);
+	Window *window = slot ? slot->window : NULL;
+	mutex_unlock(&global_state.handle_mutex);
+	return window;
+}
+
+// Send a message to the element on the thread that owns its window, if it still exists. UI thread only.
+// If the window has its own thread, the message is queued for it, so data_ptr has to stay valid 
+// until it's handled (except for MSG_TIMER's, which is copied).
+void ui_deliver_message(ElementHandle handle, Message message, int data_int, void *data_ptr) {
+	Window *window = handle_window(handle);
+
+	if (window && window->threaded) {
+		WindowEvent event = { .kind = WINDOW_EVENT_MESSAGE, .element = handle, .message = message, .data_int = data_int, .data_ptr = data_ptr };
+		if (message == MSG_TIMER) event.timer = *(TimerId *) data_ptr;
+		window_event_push(window, &event);
+	} else if (window) {
+		Element *element = element_from_handle(handle);
+		if (element) element_message(element, message, data_int, data_ptr);
+	}
+}
+
+void ui_post_push(PostedMessage *node) {
+	atomic_store_pointer(&node->next, NULL);
+	PostedMessage *previous = atomic_exchange_pointer(&global_state.post_head, node);
+	atomic_store_pointer(&previous->next, node);
+}
+
+// Returns NULL if the queue is empty, or if a producer is halfway through a push.
+PostedMessage *ui_post_pop(void) {
+	PostedMessage *tail = global_state.post_tail, *next = atomic_load_pointer(&tail->next);
+
+	if (tail == &global_state.post_stub) {
+		if (!next) return NULL;
+		global_state.post_tail = tail = next;
+		next = atomic_load_pointer(&tail->next);
+	}
+
+	if (!next) {
+		// tail is the last message, unless a producer is still linking in a new one. 
+		// Put the stub back behind it so that it can be taken off.
+		if (tail != atomic_load_pointer(&global_state.post_head)) return NULL;
+		ui_post_push(&global_state.post_stub);
+		next = atomic_load_pointer(&tail->next);
+		if (!next) return NULL;
+	}
+
+	global_state.post_tail = next;
+	return tail;
+}
+
+// Send a message to the element from any thread. It's delivered on the UI thread
+// before the next ui_update, unless the element has been destroyed by then, in 
+// which case it's dropped (so data_ptr shouldn't be the only reference to anything).
+void ui_post_message(ElementHandle handle, Message message, int data_int, void *data_ptr) {
+	PostedMessage *node = (PostedMessage*) malloc(sizeof(PostedMessage));
+	*node = (PostedMessage) { .handle = handle, .message = message, .data_int = data_int, .data_ptr = data_ptr };
+	ui_post_push(node);
+	atomic_add(&global_state.post_count, 1);
+	if (!atomic_exchange(&global_state.post_wake, 1)) platform_wake_ui_thread();
+}
+
+// Deliver the messages posted so far. Messages posted while this is running are left for the next frame.
+void ui_process_posted_messages(void) {
+	atomic_exchange(&global_state.post_wake, 0);
+	int32_t count = atomic_load(&global_state.post_count);
+
+	for (int32_t i = 0; i < count; ++i) {
+		PostedMessage *node = ui_post_pop();
+
+		if (!node) {
+			// A producer was interrupted in the middle of pushing. Come back for it.
+			if (!atomic_exchange(&global_state.post_wake, 1)) platform_wake_ui_thread();
+			break;
+		}
+
+		atomic_add(&global_state.post_count, -1);
+		ui_deliver_message(node->handle, node->message, node->data_int, node->data_ptr);
+		free(node);
+	}
+
+	if (atomic_load(&global_state.post_count) && !atomic_exchange(&global_state.post_wake, 1)) {
+		platform_wake_ui_thread();
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Timers
+//////////////////////////////////////////////////////////////////////////////
+// Starting and stopping a timer is O(1), and so is each tick, however many timers
+// there are. The message loop sleeps until the next slot with any timers in it 
+// comes up (see ui_timer_timeout), so with no timers due it uses no CPU.
+// Timers are bound to the element's handle and quietly go away with the element.
+// Window threads can start and stop timers too; they still expire on the UI thread, 
+// and MSG_TIMER is passed on to the window's thread by ui_deliver_message.
+
+uint32_t *timer_slot_head(uint16_t slot) {
+	return &global_state.timer_wheel[slot / TIMER_WHEEL_SLOTS][slot % TIMER_WHEEL_SLOTS];
+}
+
+void timer_unlink(uint32_t index) {
+	Timer *timer = &global_state.timers[index];
+	if (timer->prev) global_state.timers[timer->prev].next = timer->next;
+	else *timer_slot_head(timer->slot) = timer->next;
+	if (timer->next) global_state.timers[timer->next].prev = timer->prev;
+}
+
+// Puts the timer in the lowest level where its slot is less than a full turn away.
+// Timers too far in the future go in the furthest slot of the top level, and are put back in when it comes up.
+void timer_insert(uint32_t index) {
+	Timer *timer = &global_state.timers[index];
+	uint64_t now = global_state.timer_now, expires = MAX(timer->expires, now);
+	int level = 0;
+
+	while (level < TIMER_WHEEL_LEVELS - 1 
+			&& (expires >> (TIMER_WHEEL_BITS * level)) - (now >> (TIMER_WHEEL_BITS * level)) >= TIMER_WHEEL_SLOTS) {
+		++level;
+	}
+
+	uint64_t period = expires >> (TIMER_WHEEL_BITS * level);
+	if (period - (now >> (TIMER_WHEEL_BITS * level)) >= TIMER_WHEEL_SLOTS) {
+		period = (now >> (TIMER_WHEEL_BITS * level)) + TIMER_WHEEL_SLOTS - 1;
+	}
+
+	timer->slot = (uint16_t) (level * TIMER_WHEEL_SLOTS + (period & (TIMER_WHEEL_SLOTS - 1)));
+	uint32_t *head = timer_slot_head(timer->slot);
+	timer->prev = 0;
+	timer->next = *head;
+	if (*head) global_state.timers[*head].prev = index;
+	*head = index;
+}
+
+void timer_free(uint32_t index) {
+	Timer *timer = &global_state.timers[index];
+	timer->generation++;
+	timer->element = 0;
+	timer->next = global_state.timer_free;
+	global_state.timer_free = index;
+	global_state.timer_active--;
+}
+
+// The element gets MSG_TIMER after the given time, and then every time that passes again if repeat is set.
+TimerId element_timer_start(Element *element, uint32_t milliseconds, bool repeat) {
+	ElementHandle handle = element_handle(element);
+	uint64_t now = platform_time_ms();
+	mutex_lock(&global_state.timer_mutex);
+
+	// With no timers, the wheel doesn't keep up with the time, so it can just jump forward.
+	if (!global_state.timer_active) global_state.timer_now = MAX(global_state.timer_now, now);
+
+	uint32_t index = global_state.timer_free;
+	if (index) {
+		global_state.timer_free = global_state.timers[index].next;
+	} else {
+		if (!global_state.timer_count) global_state.timer_count = 1; // timers[0] is never used.
+		index = global_state.timer_count++;
+		global_state.timers = realloc(global_state.timers, sizeof(Timer) * global_state.timer_count);
+		global_state.timers[index].generation = 1;
+	}
+
+	Timer *timer = &global_state.timers[index];
+	timer->expires = MAX(now, global_state.timer_now) + MAX(milliseconds, 1);
+	timer->interval = repeat ? MAX(milliseconds, 1) : 0;
+	timer->element = handle;
+	global_state.timer_active++;
+	timer_insert(index);
+	TimerId id = ((uint64_t) timer->generation << 32) | index;
+	mutex_unlock(&global_state.timer_mutex);
+
+	// The UI thread might be asleep until a later timer.
+	if (thread_window) platform_wake_ui_thread();
+	return id;
+}
+
+// Does nothing if the timer has already gone (e.g. it only fired once).
+void ui_timer_stop(TimerId id) {
+	uint32_t index = (uint32_t) id;
+	mutex_lock(&global_state.timer_mutex);
+
+	if (index && index < global_state.timer_count) {
+		Timer *timer = &global_state.timers[index];
+
+		if (timer->generation == (uint32_t) (id >> 32) && timer->element) {
+			timer_unlink(index);
+			timer_free(index);
+		}
+	}
+
+	mutex_unlock(&global_state.timer_mutex);
+}
+
+// Returns the first tick after timer_now with anything to do, i.e. the next non-empty slot, which may be
+// a slot in a higher level that only has to be moved down, or UINT64_MAX if there are none. Call with timer_mutex held.
+uint64_t timer_next_tick(void) {
+	uint64_t now = global_state.timer_now, next = UINT64_MAX;
+
+	for (int level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+		uint64_t period = now >> (TIMER_WHEEL_BITS * level);
+
+		for (uint64_t i = 1; i <= TIMER_WHEEL_SLOTS; ++i) {
+			if (global_state.timer_wheel[level][(period + i) & (TIMER_WHEEL_SLOTS - 1)]) {
+				next = MIN(next, (period + i) << (TIMER_WHEEL_BITS * level));
+				break;
+			}
+		}
+	}
+
+	return next;
+}
+
+// Advance the wheel to the current time, sending MSG_TIMER for every timer that expired.
+// The ticks in between with nothing to do are skipped, so this doesn't get slower the longer it wasn't called.
+void ui_process_timers(void) {
+	uint64_t now = platform_time_ms();
+	mutex_lock(&global_state.timer_mutex);
+
+	while (global_state.timer_active) {
+		uint64_t tick = timer_next_tick();
+		if (tick > now) break;
+		global_state.timer_now = tick;
+
+		// When a level's period starts, its timers move down to the levels below. Top level first,
+		// so the timers that move down more than one level are handled on the way.
+		for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; --level) {
+			if (tick & (((uint64_t) 1 << (TIMER_WHEEL_BITS * level)) - 1)) continue;
+			uint32_t *head = &global_state.timer_wheel[level][(tick >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)];
+			uint32_t index = *head;
+			*head = 0;
+
+			while (index) {
+				uint32_t next = global_state.timers[index].next;
+				timer_insert(index);
+				index = next;
+			}
+		}
+
+		// Fire the timers due now. Message handlers can start and stop timers, so take them off one at a time.
+		uint32_t *head = &global_state.timer_wheel[0][tick & (TIMER_WHEEL_SLOTS - 1)];
+
+		while (*head) {
+			uint32_t index = *head;
+			Timer *timer = &global_state.timers[index];
+			timer_unlink(index);
+
+			Window *window = handle_window(timer->element);
+			bool alive = window && (window->threaded || element_from_handle(timer->element));
+			ElementHandle element = timer->element;
+			TimerId id = ((uint64_t) timer->generation << 32) | index;
+
+			if (alive && timer->interval) {
+				timer->expires += timer->interval;
+				if (timer->expires <= tick) timer->expires = tick + timer->interval; // Don't try to catch up.
+				timer_insert(index);
+			} else {
+				timer_free(index);
+			}
+
+			if (alive) {
+				mutex_unlock(&global_state.timer_mutex);
+				ui_deliver_message(element, MSG_TIMER, 0, &id);
+				mutex_lock(&global_state.timer_mutex);
+			}
+		}
+	}
+
+	// Nothing else is due before now, so the wheel can jump forward.
+	global_state.timer_now = MAX(global_state.timer_now, now);
+	mutex_unlock(&global_state.timer_mutex);
+}
+
+// Returns how long the message loop can sleep for before ui_process_timers has anything
+// to do, in milliseconds, or -1 if there are no timers. This is the time until the next 
+// non-empty slot comes up (see timer_next_tick).
+int ui_timer_timeout(void) {
+	mutex_lock(&global_state.timer_mutex);
+	uint64_t next = timer_next_tick();
+	bool active = global_state.timer_active;
+	mutex_unlock(&global_state.timer_mutex);
+	if (!active) return -1;
+	uint64_t time = platform_time_ms();
+	return next <= time ? 0 : (int) MIN(next - time, INT32_MAX);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Animation
+//////////////////////////////////////////////////////////////////////////////
+// An animation moves an int, float or color somewhere in an element's state (a position
+// offset, a color, an opacity it paints with, ...) to a new value over some time. 
+// Each window keeps the set of its running animations, and only those elements are looked at: 
+// on each frame, their values are updated, they get MSG_ANIMATE, and their bounds are repainted. 
+// The frames come from one clock every ANIMATION_FRAME_MS, and when nothing is animating the message 
+// loop goes back to sleeping until the next event or timer (see ui_wait_timeout).
+
+#define ANIMATION_FRAME_MS (16)
+
+// t goes from 0 (from) to 1 (to).
+uint32_t color_blend(uint32_t from, uint32_t to, float t) {
+	int weight = (int) (t * 256.0f + 0.5f);
+	if (weight < 0) weight = 0;
+	if (weight > 256) weight = 256;
+	uint32_t rb = ((from & 0xFF00FF) * (256 - weight) + (to & 0xFF00FF) * weight) >> 8;
+	uint32_t g = ((from & 0x00FF00) * (256 - weight) + (to & 0x00FF00) * weight) >> 8;
+	return (rb & 0xFF00FF) | (g & 0x00FF00);
+}
+
+// Frames are at multiples of ANIMATION_FRAME_MS, so the animations in every window step together.
+uint64_t animation_next_frame(uint64_t now) {
+	return (now / ANIMATION_FRAME_MS + 1) * ANIMATION_FRAME_MS;
+}
+
+Animation *animation_start(Element *element, void *target, AnimationKind kind, uint32_t milliseconds, Easing easing) {
+	Window *window = element->window;
+	Animation *animation = NULL;
+
+	// Animating a value that's already animating starts again from where it has got to.
+	for (uint32_t i = 0; i < window->animation_count; ++i) {
+		if (window->animations[i].target == target) {
+			animation = &window->animations[i];
+			break;
+		}
+	}
+
+	if (!animation) {
+		if (window->animation_count == window->animation_capacity) {
+			window->animation_capacity = window->animation_capacity ? window->animation_capacity * 2 : 16;
+			window->animations = realloc(window->animations, sizeof(Animation) * window->animation_capacity);
+		}
+
+		animation = &window->animations[window->animation_count++];
+	}
+
+	uint64_t now = platform_time_ms();
+
+	// Start the clock if it was stopped.
+	if (window->animation_frame < now) {
+		window->animation_frame = animation_next_frame(now);
+	}
+
+	*animation = (Animation) { 
+		.target = target, .element = element_handle(element), .kind = kind, 
+		.easing = easing, .start = now, .duration = MAX(milliseconds, 1), 
+	};
+
+	return animation;
+}
+
+// Move *target to the value to, over the given time. *target must stay valid as long as 
+// the element is alive; when the element is destroyed, its animations are dropped.
+// Only on the thread that owns the element's window.
+void element_animate_int(Element *element, int *target, int to, uint32_t milliseconds, Easing easing) {
+	Animation *animation = animation_start(element, target, ANIMATION_INT, milliseconds, easing);
+	animation->i.from = *target;
+	animation->i.to = to;
+}
+
+void element_animate_float(Element *element, float *target, float to, uint32_t milliseconds, Easing easing) {
+	Animation *animation = animation_start(element, target, ANIMATION_FLOAT, milliseconds, easing);
+	animation->f.from = *target;
+	animation->f.to = to;
+}
+
+void element_animate_color(Element *element, uint32_t *target, uint32_t to, uint32_t milliseconds, Easing easing) {
+	Animation *animation = animation_start(element, target, ANIMATION_COLOR, milliseconds, easing);
+	animation->c.from = *target;
+	animation->c.to = to;
+}
+
+// Leaves *target where it has got to.
+void element_animation_stop(Element *element, void *target) {
+	Window *window = element->window;
+
+	for (uint32_t i = 0; i < window->animation_count; ++i) {
+		if (window->animations[i].target == target) {
+			window->animations[i] = window->animations[--window->animation_count];
+			return;
+		}
+	}
+}
+
+// Step the window's animations if a frame is due. On the thread that owns the window.
+void window_process_animations(Window *window) {
+	if (!window->animation_count) return;
+	uint64_t now = platform_time_ms();
+	if (now < window->animation_frame) return;
+
+	// Skip the frames that were missed rather than trying to catch up.
+	window->animation_frame = animation_next_frame(now);
+
+	for (uint32_t i = 0; i < window->animation_count; ) {
+		// Copy the animation out, since MSG_ANIMATE can start and stop animations.
+		Animation animation = window->animations[i];
+		Element *element = element_from_handle(animation.element);
+
+		if (!element) {
+			window->animations[i] = window->animations[--window->animation_count];
+			continue;
+		}
+
+		bool done = now >= animation.start + animation.duration;
+		float t = done ? 1.0f : (float) (now - animation.start) / animation.duration;
+		if (animation.easing == EASE_IN_OUT) t = t * t * (3.0f - 2.0f * t);
+		else if (animation.easing == EASE_OUT) t = 1.0f - (1.0f - t) * (1.0f - t);
+
+		if (animation.kind == ANIMATION_INT) {
+			*(int *) animation.target = animation.i.from + (int) ((animation.i.to - animation.i.from) * t + (animation.i.to > animation.i.from ? 0.5f : -0.5f));
+		} else if (animation.kind == ANIMATION_FLOAT) {
+			*(float *) animation.target = done ? animation.f.to : animation.f.from + (animation.f.to - animation.f.from) * t;
+		} else if (animation.kind == ANIMATION_COLOR) {
+			*(uint32_t *) animation.target = color_blend(animation.c.from, animation.c.to, t);
+		}
+
+		if (done) {
+			window->animations[i] = window->animations[--window->animation_count];
+		} else {
+			i++;
+		}
+
+		// Repaint the old bounds as well, in case the element moves itself.
+		element_repaint(element, NULL);
+		element_message(element, MSG_ANIMATE, done, animation.target);
+		element_repaint(element, NULL);
+	}
+}
+
+// Returns how long until the window's next animation frame, or -1 if nothing is animating.
+int window_animation_timeout(Window *window) {
+	if (!window->animation_count) return -1;
+	uint64_t now = platform_time_ms();
+	return window->animation_frame <= now ? 0 : (int) (window->animation_frame - now);
+}
+
+// Step the animations of the windows that don't have their own thread.
+void ui_process_animations(void) {
+	for (uintptr_t i = 0; i < global_state.window_count; ++i) {
+		if (!global_state.windows[i]->threaded) window_process_animations(global_state.windows[i]);
+	}
+}
+
+// Returns how long until the next animation frame or timer, or -1 if there's nothing coming up.
+int ui_frame_timeout(void) {
+	// Some windows still have something to paint (see window_paint_tiles).
+	if (global_state.update_queue_count) return 0;
+
+	int timeout = ui_timer_timeout();
+
+	for (uintptr_t i = 0; i < global_state.window_count; ++i) {
+		if (global_state.windows[i]->threaded) continue;
+		int frame = window_animation_timeout(global_state.windows[i]);
+		if (frame != -1 && (timeout == -1 || frame < timeout)) timeout = frame;
+	}
+
+	return timeout;
+}
+
+// How long the message loop can sleep for: until the next animation frame or timer, or -1 for as long as it likes.
+// With idle work to do, the loop doesn't sleep at all (see ui_process_idle).
+int ui_wait_timeout(void) {
+	return global_state.idle_task_count ? 0 : ui_frame_timeout();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Tasks
+//////////////////////////////////////////////////////////////////////////////
+// Blocking work, like reading and writing files, goes to a fixed pool of worker
+// threads so that the UI thread keeps handling input and painting. Workers take
+// tasks off a single queue in the order they were submitted, and report back 
+// through ui_post_message, so completions arrive on the UI thread like any other message.
+
+#define TASK_WORKER_COUNT_MAX (8)
+
+void ui_task_thread(void *argument) {
+	while (true) {
+		mutex_lock(&global_state.task_mutex);
+
+		while (!global_state.task_head) {
+			condition_wait(&global_state.task_wake, &global_state.task_mutex);
+		}
+
+		Task *task = global_state.task_head;
+		global_state.task_head = task->next;
+		if (!global_state.task_head) global_state.task_tail = NULL;
+		mutex_unlock(&global_state.task_mutex);
+
+		int result = task->function(task->argument);
+		if (task->element) ui_post_message(task->element, MSG_TASK_COMPLETE, result, task->argument);
+		free(task);
+	}
+}
+
+// Run function(argument) on a worker thread. When it returns, the element (if not NULL) gets 
+// MSG_TASK_COMPLETE with its result, unless the element has been destroyed by then, in which 
+// case nothing is sent; the element isn't kept alive by the task, so the task shouldn't
+// rely on the completion handler to be the only thing that frees argument. Can be called from
+// window threads too. The workers are started on the first call, one per processor up to
+// TASK_WORKER_COUNT_MAX.
+void ui_task_submit(TaskFunction function, void *argument, Element *element) {
+	Task *task = (Task*) malloc(sizeof(Task));
+	*task = (Task) { .function = function, .argument = argument, .element = element ? element_handle(element) : 0 };
+
+	mutex_lock(&global_state.task_mutex);
+
+	// Start the workers the first time. Element handlers on threaded windows can get here
+	// at the same time as the UI thread, so this is done under the lock.
+	if (!global_state.task_worker_count) {
+		global_state.task_worker_count = MIN(MAX(platform_processor_count(), 2), TASK_WORKER_COUNT_MAX);
+
+		for (int i = 0; i < global_state.task_worker_count; ++i) {
+			Thread thread;
+			bool started = platform_thread_start(&thread, ui_task_thread, NULL);
+			assert(started);
+			(void) started;
+		}
+	}
+
+	if (global_state.task_tail) global_state.task_tail->next = task;
+	else global_state.task_head = task;
+	global_state.task_tail = task;
+	condition_signal(&global_state.task_wake);
+	mutex_unlock(&global_state.task_mutex);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Idle work
+//////////////////////////////////////////////////////////////////////////////
+// Work that can wait, like warming caches, laying out hidden tabs or building indexes,
+// is done in slices in the time between frames. A slice only starts when there's no
+// input waiting and the last frame took less than the task's budget, and it lasts at most
+// the budget, or until the next timer or animation frame. The callback does its work
+// in small steps, checking ui_idle_should_yield between them, and returns as soon as
+// that says so, which is also as soon as any input arrives.
+
+// What the message loop does after each batch of events.
+void ui_process_frame(void) {
+	uint64_t start = platform_time_ms();
+	ui_process_timers();
+	ui_process_posted_messages();
+	ui_process_animations();
+	ui_update();
+	global_state.frame_time = platform_time_ms() - start;
+}
+
+// Call the callback in the time between frames until it returns false. Tasks get the
+// time in the order they were scheduled. UI thread only.
+void ui_schedule_idle(IdleCallback callback, void *context, int budget) {
+	if (global_state.idle_task_count == global_state.idle_task_capacity) {
+		global_state.idle_task_capacity = global_state.idle_task_capacity ? global_state.idle_task_capacity * 2 : 8;
+		global_state.idle_tasks = realloc(global_state.idle_tasks, sizeof(IdleTask) * global_state.idle_task_capacity);
+	}
+
+	global_state.idle_tasks[global_state.idle_task_count++] = (IdleTask) { callback, context, MAX(budget, 1) };
+}
+
+// Returns true when an idle callback should stop and return.
+bool ui_idle_should_yield(void) {
+	return platform_time_ms() >= global_state.idle_deadline
+		|| atomic_load(&global_state.post_count) || platform_input_pending();
+}
+
+// Called by the message loop after a frame, to run a slice of idle work if there's time for it.
+void ui_process_idle(void) {
+	if (!global_state.idle_task_count || platform_input_pending()) return;
+	uint64_t start = platform_time_ms();
+	int next_frame = ui_frame_timeout();
+
+	while (global_state.idle_task_count) {
+		IdleTask task = global_state.idle_tasks[0];
+		if (global_state.frame_time >= (uint64_t) task.budget) break;
+		global_state.idle_deadline = start + (next_frame == -1 ? task.budget : MIN(task.budget, next_frame));
+		if (ui_idle_should_yield()) break;
+
+		if (!task.callback(task.context)) {
+			// The task is finished. (The callback might have scheduled more, so don't use the copy.)
+			global_state.idle_task_count--;
+			memmove(&global_state.idle_tasks[0], &global_state.idle_tasks[1], sizeof(IdleTask) * global_state.idle_task_count);
+		}
+	}
+
+	global_state.idle_deadline = 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Recording
+//////////////////////////////////////////////////////////////////////////////
+// Everything that goes into ui_window_input_event, ui_window_mouse_event and ui_window_resize 
+// can be written to a file, and played back later through the same functions, so a session 
+// can be captured once and replayed under a profiler or as a benchmark. 
+//
+// The file starts with RECORD_MAGIC, followed by one record per event:
+//	varint milliseconds since the previous record, varint window index, varint (message << 1 | has mouse position)
+//	MSG_NONE (a resize): varint width, varint height
+//	other messages: zigzag varint data_int
+//	with a mouse position: zigzag varint mouse x and y relative to the previous position recorded
+//	MSG_KEY_TYPED: byte key code, byte text length, the text
+// Messages are stored by value, so files only replay with the version of the library that recorded them.
+// The windows are identified by the order they were created in, so the replaying program has to create the same ones.
+
+#define RECORD_MAGIC "TOUIREC2"
+
+void record_write_varint(uint64_t value) {
+	while (value >= 0x80) {
+		putc((int) (value & 0x7F) | 0x80, global_state.record_file);
+		value >>= 7;
+	}
+
+	putc((int) value, global_state.record_file);
+}
+
+void record_write_signed(int64_t value) {
+	record_write_varint(((uint64_t) value << 1) ^ (uint64_t) (value >> 63));
+}
+
+void record_write_header(Window *window, Message message, bool has_position) {
+	uint64_t now = platform_time_ms();
+	record_write_varint(now - global_state.record_time);
+	global_state.record_time = now;
+
+	uintptr_t index = 0;
+	while (index < global_state.window_count && global_state.windows[index] != window) index++;
+	record_write_varint(index);
+	record_write_varint((uint64_t) message << 1 | has_position);
+}
+
+void ui_record_input(Window *window, Message message, int data_int, KeyTyped *key, bool has_position, int x, int y) {
+	record_write_header(window, message, has_position);
+	record_write_signed(data_int);
+
+	if (has_position) {
+		record_write_signed((int64_t) x - global_state.record_mouse_x);
+		record_write_signed((int64_t) y - global_state.record_mouse_y);
+		global_state.record_mouse_x = x;
+		global_state.record_mouse_y = y;
+	}
+
+	if (message == MSG_KEY_TYPED) {
+		putc(key->code, global_state.record_file);
+		putc(key->bytes, global_state.record_file);
+		fwrite(key->text, 1, key->bytes, global_state.record_file);
+	}
+}
+
+void ui_record_resize(Window *window, int width, int height) {
+	record_write_header(window, MSG_NONE, false);
+	record_write_varint(width);
+	record_write_varint(height);
+}
+
+// Start writing the input to a file. The current size of each window is recorded first.
+bool ui_record_start(const char *path) {
+	ui_record_stop();
+	global_state.record_file = fopen(path, "wb");
+	if (!global_state.record_file) return false;
+	fwrite(RECORD_MAGIC, 1, sizeof(RECORD_MAGIC) - 1, global_state.record_file);
+	global_state.record_time = platform_time_ms();
+	global_state.record_mouse_x = global_state.record_mouse_y = 0;
+
+	for (uintptr_t i = 0; i < global_state.window_count; ++i) {
+		ui_record_resize(global_state.windows[i], global_state.windows[i]->width, global_state.windows[i]->height);
+	}
+
+	return true;
+}
+
+void ui_record_stop(void) {
+	if (global_state.record_file) {
+		fclose(global_state.record_file);
+		global_state.record_file = NULL;
+	}
+}
+
+// Returns false at the end of the data, or if it's malformed.
+bool record_read_varint(const uint8_t **position, const uint8_t *end, uint64_t *value) {
+	*value = 0;
 
-	for (int y = rect.t; y < rect.b; ++y) {
-		for (int x = rect.l; x < rect.r; ++x) {
-			painter->bits[y * painter->width + x] = color;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (*position == end) return false;
+		uint8_t byte = *(*position)++;
+		*value |= (uint64_t) (byte & 0x7F) << shift;
+		if (~byte & 0x80) return true;
+	}
+
+	return false;
+}
+
+bool record_read_signed(const uint8_t **position, const uint8_t *end, int64_t *value) {
+	uint64_t zigzag;
+	if (!record_read_varint(position, end, &zigzag)) return false;
+	*value = (int64_t) (zigzag >> 1) ^ -(int64_t) (zigzag & 1);
+	return true;
+}
+
+// Feed a recording from ui_record_start back through the windows. With real_time set, the events are
+// spaced out as they were recorded (with timers and animations running in between), otherwise they're
+// replayed as fast as possible, with one update after each batch of events that arrived together.
+// Returns the number of events replayed, or -1 if the file couldn't be read.
+int ui_replay(const char *path, bool real_time) {
+	MappedFile file;
+	if (!platform_file_map(&file, path)) return -1;
+	size_t magic_bytes = sizeof(RECORD_MAGIC) - 1;
+
+	if (file.size < magic_bytes || memcmp(file.data, RECORD_MAGIC, magic_bytes)) {
+		platform_file_unmap(&file);
+		return -1;
+	}
+
+	const uint8_t *position = (const uint8_t *) file.data + magic_bytes, *end = (const uint8_t *) file.data + file.size;
+	uint64_t start = platform_time_ms(), time = 0;
+	int64_t mouse_x = 0, mouse_y = 0;
+	int count = 0;
+
+	while (true) {
+		uint64_t delay, index, message, width, height;
+		int64_t delta_x, delta_y, data_int;
+		if (!record_read_varint(&position, end, &delay)) break;
+		if (!record_read_varint(&position, end, &index)) break;
+		if (!record_read_varint(&position, end, &message)) break;
+		bool has_position = message & 1;
+		message >>= 1;
+
+		if (delay) {
+			// The events before this one arrived together.
+			if (count) ui_process_frame();
+			time += delay;
+
+			while (real_time) {
+				uint64_t now = platform_time_ms();
+				if (now >= start + time) break;
+				int timeout = ui_wait_timeout();
+				platform_thread_sleep(timeout == -1 ? (int) (start + time - now) : (int) MIN((uint64_t) timeout, start + time - now));
+				ui_process_frame();
+			}
+		}
+
+		Window *window = index < global_state.window_count ? global_state.windows[index] : NULL;
+
+		if (message == MSG_NONE) {
+			if (!record_read_varint(&position, end, &width)) break;
+			if (!record_read_varint(&position, end, &height)) break;
+			if (window) ui_window_resize(window, (int) width, (int) height);
+		} else {
+			if (!record_read_signed(&position, end, &data_int)) break;
+
+			if (has_position) {
+				if (!record_read_signed(&position, end, &delta_x)) break;
+				if (!record_read_signed(&position, end, &delta_y)) break;
+				mouse_x += delta_x;
+				mouse_y += delta_y;
+			}
+
+			KeyTyped key = { 0 };
+			char text[4];
+
+			if (message == MSG_KEY_TYPED) {
+				if (end - position < 2 || position[1] > sizeof(text) || end - position - 2 < position[1]) break;
+				key.code = (KeyKind) position[0];
+				key.bytes = position[1];
+				key.text = text;
+				memcpy(text, position + 2, key.bytes);
+				position += 2 + key.bytes;
+			}
+
+			if (window && has_position) {
+				ui_window_mouse_event(window, (Message) message, (int) data_int, (int) mouse_x, (int) mouse_y);
+			} else if (window) {
+				ui_window_input_event(window, (Message) message, (int) data_int, message == MSG_KEY_TYPED ? &key : NULL);
+			}
 		}
+
+		count++;
 	}
+
+	ui_process_frame();
+	platform_file_unmap(&file);
+	return count;
 }
 
-void draw_rect(Painter *painter, Rect r, uint32_t fill_color, uint32_t border_color) {
-	// border top
-	draw_block(painter, (Rect){r.l, r.r, r.t, r.t+1}, border_color);
-	// border right
-	draw_block(painter, (Rect){r.r-1, r.r, r.t, r.b}, border_color);
-	// border bottom
-	draw_block(painter, (Rect){r.l, r.r, r.b-1, r.b}, border_color);
-	// border left
-	draw_block(painter, (Rect){r.l, r.l+1, r.t, r.b}, border_color);
-	// fill
-	draw_block(painter, (Rect){r.l+1, r.r-1, r.t+1, r.b-1}, fill_color);
+// Called by the message loop before it starts. If the environment variable TOUI_RECORD is set, 
+// the input is recorded to the file it names. If TOUI_REPLAY is set, the file it names is replayed 
+// first, in real time unless TOUI_REPLAY_FAST is set too.
+void ui_recording_init(void) {
+	const char *record = getenv("TOUI_RECORD"), *replay = getenv("TOUI_REPLAY");
+	if (record) ui_record_start(record);
+	if (replay) ui_replay(replay, !getenv("TOUI_REPLAY_FAST"));
 }
 
-void draw_string(Painter *painter, Rect bounds, char *string, int bytes, uint32_t color, bool align_center) {
-	// setup the clipping region
-	Rect old_clip = painter->clip;
-	painter->clip = rect_intersection(old_clip, bounds);
+//////////////////////////////////////////////////////////////////////////////
+// Latency
+//////////////////////////////////////////////////////////////////////////////
+// The time from input arriving to its result being presented is what makes a program 
+// feel slow or fast. The platform layer stamps each input event with when it arrived
+// (using the window system's timestamp, so time spent waiting in the queue counts too), 
+// and the window remembers the earliest unpresented arrival for each kind of input. 
+// The next time the window presents, the latencies are added to the histograms. Input 
+// that doesn't lead to anything being painted isn't counted.
+
+void window_input_arrived(Window *window, Message message, uint64_t arrival) {
+	if (message < MSG_USER && !window->input_arrival[message]) {
+		window->input_arrival[message] = arrival;
+		window_queue_update(window); // Even if nothing changes, so the arrival is forgotten.
+	}
+}
 
-	// Work out where to start drawing the text within the provided bounds.
-	int x = bounds.l;
-	int y = (bounds.t + bounds.b - GLYPH_HEIGHT) / 2;
-	if (align_center) x += (int)(bounds.r - bounds.l - bytes * GLYPH_WIDTH) / 2;
+void window_input_presented(Window *window) {
+	uint64_t now = platform_time_us();
+	mutex_lock(&global_state.latency_mutex);
+
+	for (int i = 0; i < MSG_USER; i++) {
+		if (!window->input_arrival[i]) continue;
+		uint64_t latency = now > window->input_arrival[i] ? now - window->input_arrival[i] : 0;
+		window->input_arrival[i] = 0;
+
+		int bucket = 0;
+		while (bucket < LATENCY_BUCKETS - 1 && latency >= (2ull << bucket)) bucket++;
+
+		LatencyHistogram *histogram = &global_state.latency[i];
+		histogram->count++;
+		histogram->buckets[bucket]++;
+		histogram->total += latency;
+		histogram->max = MAX(histogram->max, latency);
+	}
+
+	mutex_unlock(&global_state.latency_mutex);
+}
+
+// Returns a copy of the latencies measured for a kind of input message, like MSG_KEY_TYPED.
+LatencyHistogram ui_latency_histogram(Message message) {
+	LatencyHistogram histogram = { 0 };
+	if (message >= MSG_USER) return histogram;
+	mutex_lock(&global_state.latency_mutex);
+	histogram = global_state.latency[message];
+	mutex_unlock(&global_state.latency_mutex);
+	return histogram;
+}
+
+void ui_latency_reset(void) {
+	mutex_lock(&global_state.latency_mutex);
+	memset(global_state.latency, 0, sizeof(global_state.latency));
+	mutex_unlock(&global_state.latency_mutex);
+}
+
+const char *latency_message_name(Message message) {
+	switch (message) {
+		case MSG_MOUSE_MOVE:        return "mouse move";
+		case MSG_MOUSE_LEFT_DOWN:   return "left down";
+		case MSG_MOUSE_LEFT_UP:     return "left up";
+		case MSG_MOUSE_MIDDLE_DOWN: return "middle down";
+		case MSG_MOUSE_MIDDLE_UP:   return "middle up";
+		case MSG_MOUSE_RIGHT_DOWN:  return "right down";
+		case MSG_MOUSE_RIGHT_UP:    return "right up";
+		case MSG_MOUSE_WHEEL:       return "wheel";
+		case MSG_KEY_TYPED:         return "key typed";
+		default:                    return "other";
+	}
+}
+
+// Returns the upper bound of the bucket the fraction of the latencies falls in.
+uint64_t latency_percentile(LatencyHistogram *histogram, double fraction) {
+	uint64_t seen = 0, wanted = (uint64_t) (histogram->count * fraction + 0.5);
+
+	for (int i = 0; i < LATENCY_BUCKETS - 1; i++) {
+		seen += histogram->buckets[i];
+		if (seen >= wanted) return MIN(2ull << i, histogram->max);
+	}
+
+	return histogram->max;
+}
+
+// Prints a summary and the histogram of each kind of input that has been measured.
+void ui_latency_print(FILE *file) {
+	fprintf(file, "input-to-present latency (microseconds):\n");
+
+	for (int i = 0; i < MSG_USER; i++) {
+		LatencyHistogram histogram = ui_latency_histogram((Message) i);
+		if (!histogram.count) continue;
+
+		fprintf(file, "%-12s count %u, mean %llu, p50 <%llu, p99 <%llu, max %llu\n", latency_message_name((Message) i), 
+				histogram.count, (unsigned long long) (histogram.total / histogram.count), 
+				(unsigned long long) latency_percentile(&histogram, 0.5), 
+				(unsigned long long) latency_percentile(&histogram, 0.99), (unsigned long long) histogram.max);
+
+		for (int j = 0; j < LATENCY_BUCKETS; j++) {
+			if (!histogram.buckets[j]) continue;
+			int bar = (int) ((uint64_t) histogram.buckets[j] * 40 / histogram.count);
+			fprintf(file, "  %8llu %8u %.*s\n", 1ull << j, histogram.buckets[j], MAX(bar, 1), 
+					"########################################");
+		}
+	}
+}
+
+void latency_print_at_exit(void) {
+	ui_latency_print(stderr);
+}
+
+// Called by the message loop before it starts. If the environment variable TOUI_LATENCY is set,
+// the latencies are printed to stderr when the program exits.
+void ui_latency_init(void) {
+	static bool registered;
+
+	if (getenv("TOUI_LATENCY") && !registered) {
+		registered = true;
+		atexit(latency_print_at_exit);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Window threads
+//////////////////////////////////////////////////////////////////////////////
+// Normally every window is laid out, painted and presented on the UI thread, one after 
+// the other, so one slow window holds up input in all the others. window_thread_start
+// gives a window a thread of its own. The UI thread still reads all the events from the
+// platform, but passes the window's input, resizes, posted messages and expired timers
+// on to the window's thread through a queue. What the library shares between threads
+// (element handles, timers, tasks, posted messages) is locked; anything the program
+// shares between windows, like its document, the program has to lock itself.
+
+bool ui_window_update(Window *window);
+
+void window_event_push(Window *window, WindowEvent *event) {
+	mutex_lock(&window->event_mutex);
+
+	if (window->event_count == window->event_capacity) {
+		window->event_capacity = window->event_capacity ? window->event_capacity * 2 : 64;
+		window->events = realloc(window->events, sizeof(WindowEvent) * window->event_capacity);
+	}
+
+	window->events[window->event_count++] = *event;
+	condition_signal(&window->event_wake);
+	mutex_unlock(&window->event_mutex);
+}
+
+void window_handle_event(Window *window, WindowEvent *event) {
+	if (event->kind == WINDOW_EVENT_INPUT) {
+		if (event->has_position) window_set_mouse(window, event->x, event->y);
+		event->key.text = event->text;
+		window_input_arrived(window, event->message, event->arrival);
+		ui_window_dispatch_input(window, event->message, event->data_int, event->message == MSG_KEY_TYPED ? &event->key : NULL);
+	} else if (event->kind == WINDOW_EVENT_RESIZE) {
+		window_set_size(window, event->x, event->y);
+	} else if (event->kind == WINDOW_EVENT_MESSAGE) {
+		Element *element = element_from_handle(event->element);
+		void *data_ptr = event->message == MSG_TIMER ? &event->timer : event->data_ptr;
+		if (element) element_message(element, event->message, event->data_int, data_ptr);
+	} else if (event->kind == WINDOW_EVENT_EXPOSE) {
+		element_repaint(&window->element, NULL);
+	}
+}
+
+void window_thread(void *argument) {
+	Window *window = (Window *) argument;
+	thread_window = window;
+	WindowEvent *events = NULL;
+	size_t capacity = 0;
+
+	while (true) {
+		bool destroyed = ui_window_update(window);
+		assert(!destroyed); // Windows with their own thread can't be destroyed.
+		(void) destroyed;
+
+		// Sleep until there are events, or the next animation frame is due. 
+		// If there's more to paint, just pick up any events that have arrived.
+		mutex_lock(&window->event_mutex);
+		int timeout = window->paint_tile_count ? 0 : window_animation_timeout(window);
+
+		if (!window->event_count && timeout) {
+			condition_wait_timeout(&window->event_wake, &window->event_mutex, timeout);
+		}
+
+		// Swap in the other array, so the UI thread can keep pushing while these are handled.
+		WindowEvent *swap_events = window->events;
+		size_t swap_capacity = window->event_capacity, count = window->event_count;
+		window->events = events;
+		window->event_capacity = capacity;
+		window->event_count = 0;
+		events = swap_events;
+		capacity = swap_capacity;
+		mutex_unlock(&window->event_mutex);
+
+		for (size_t i = 0; i < count; ++i) {
+			window_handle_event(window, &events[i]);
+		}
+
+		window_process_animations(window);
+	}
+}
+
+// Lay out, paint and present the window on a thread of its own from now on. UI thread only.
+// After this, the window's elements must only be used from their message handlers (which run
+// on the window's thread), and the window can't be destroyed. Returns false if the thread couldn't be started.
+bool window_thread_start(Window *window) {
+	if (window->threaded) return true;
+	mutex_init(&window->event_mutex);
+	condition_init(&window->event_wake);
+	window->threaded = true;
+
+	if (!platform_thread_start(&window->thread, window_thread, window)) {
+		window->threaded = false;
+		return false;
+	}
+
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Progressive painting
+//////////////////////////////////////////////////////////////////////////////
+// Repainting a large area of a complicated window can take longer than a frame, and
+// input waits until it's done. With progressive painting, a large update region is split
+// into tiles instead, which are painted and presented one at a time, starting with the ones
+// nearest to the mouse. Once the window's budget for a slice is used up, or input arrives, 
+// the rest are left for after the input has been handled. Smaller changes that come in 
+// meanwhile are painted straight away, so the window stays responsive.
+
+#define PAINT_TILE_SIZE (128)
+
+// Paint large update regions of the window in slices of at most budget milliseconds, or
+// everything at once if budget is 0. Call on the thread that owns the window.
+void window_progressive_paint_enable(Window *window, int budget) {
+	window->paint_budget = MAX(budget, 0);
+
+	if (!window->paint_budget && window->paint_tile_count) {
+		// Paint whatever is left in the next update.
+		window->paint_tile_count = 0;
+		memset(window->paint_tiles, 0, window->paint_tiles_x * window->paint_tiles_y);
+		element_repaint(&window->element, NULL);
+	}
+}
+
+// Whether the region is big enough to be painted in tiles.
+bool window_paint_progressively(Window *window, Rect region) {
+	if (!window->paint_budget) return false;
+	region = rect_intersection(region, rect_make(0, window->width, 0, window->height));
+	return (int64_t) (region.r - region.l) * (region.b - region.t) > 4 * PAINT_TILE_SIZE * PAINT_TILE_SIZE;
+}
+
+void window_paint_tiles_mark(Window *window, Rect region) {
+	int tiles_x = (window->width + PAINT_TILE_SIZE - 1) / PAINT_TILE_SIZE;
+	int tiles_y = (window->height + PAINT_TILE_SIZE - 1) / PAINT_TILE_SIZE;
+
+	if (tiles_x != window->paint_tiles_x || tiles_y != window->paint_tiles_y) {
+		// The window has been resized, which repaints all of it anyway.
+		window->paint_tiles = realloc(window->paint_tiles, tiles_x * tiles_y);
+		memset(window->paint_tiles, 0, tiles_x * tiles_y);
+		window->paint_tiles_x = tiles_x;
+		window->paint_tiles_y = tiles_y;
+		window->paint_tile_count = 0;
+	}
+
+	region = rect_intersection(region, rect_make(0, window->width, 0, window->height));
+
+	for (int y = region.t / PAINT_TILE_SIZE; y <= (region.b - 1) / PAINT_TILE_SIZE; y++) {
+		for (int x = region.l / PAINT_TILE_SIZE; x <= (region.r - 1) / PAINT_TILE_SIZE; x++) {
+			uint8_t *tile = &window->paint_tiles[y * tiles_x + x];
+			if (!*tile) window->paint_tile_count++;
+			*tile = 1;
+		}
+	}
+}
+
+// Whether there is input waiting for the window.
+bool window_input_pending(Window *window) {
+	if (!window->threaded) return platform_input_pending();
+	mutex_lock(&window->event_mutex);
+	bool pending = window->event_count != 0;
+	mutex_unlock(&window->event_mutex);
+	return pending;
+}
+
+// Paint the region of the window and present it.
+void window_paint_region(Window *window, Rect region) {
+	// Setup the painter using the window's buffer.
+	Painter painter;
+	painter.bits = window->bits;
+	painter.width = window->width;
+	painter.height = window->height;
+	painter.clip = rect_intersection(rect_make(0, window->width, 0, window->height), region);
+
+	// Paint everything in the region.
+	ui_element_paint(&window->element, &painter);
+
+	// Tell the platform layer to put the result onto the screen.
+	window->update_region = region;
+	platform_window_end_paint(window, &painter);
+	window_input_presented(window);
+}
+
+// Paint and present the tiles nearest the mouse first, until the budget is used up or there's input.
+void window_paint_tiles(Window *window) {
+	uint64_t start = platform_time_ms();
+	int mouse_x = MAX(window->mouse_x, 0), mouse_y = MAX(window->mouse_y, 0);
+
+	while (window->paint_tile_count) {
+		int nearest = -1;
+		int64_t nearest_distance = 0;
+
+		for (int i = 0; i < window->paint_tiles_x * window->paint_tiles_y; i++) {
+			if (!window->paint_tiles[i]) continue;
+			int64_t dx = (i % window->paint_tiles_x) * PAINT_TILE_SIZE + PAINT_TILE_SIZE / 2 - mouse_x;
+			int64_t dy = (i / window->paint_tiles_x) * PAINT_TILE_SIZE + PAINT_TILE_SIZE / 2 - mouse_y;
+
+			if (nearest == -1 || dx * dx + dy * dy < nearest_distance) {
+				nearest = i;
+				nearest_distance = dx * dx + dy * dy;
+			}
+		}
+
+		int l = (nearest % window->paint_tiles_x) * PAINT_TILE_SIZE, t = (nearest / window->paint_tiles_x) * PAINT_TILE_SIZE;
+		window->paint_tiles[nearest] = 0;
+		window->paint_tile_count--;
+
+		// Tiles are clipped to the window, and any that are outside it are skipped.
+		Rect tile = rect_intersection(rect_make(l, l + PAINT_TILE_SIZE, t, t + PAINT_TILE_SIZE), window->element.bounds);
+		if (!rect_valid(tile)) continue;
+		window_paint_region(window, tile);
+
+		if (platform_time_ms() - start >= (uint64_t) window->paint_budget || window_input_pending(window)) {
+			break;
+		}
+	}
+
+	window->update_region = rect_make(0, 0, 0, 0);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Parallel layout
+//////////////////////////////////////////////////////////////////////////////
+// Once a panel has assigned the bounds of its children, their subtrees can be laid
+// out independently. When enabled, element_arrange() turns subtrees with at least 
+// parallel_layout_threshold descendants into tasks for a work-stealing thread pool, 
+// and the outermost MSG_LAYOUT waits for them (helping out) before returning.
+// Message handlers run on the pool's threads during the pass, so MSG_LAYOUT must
+// only touch the element's own subtree. It may create, destroy and invalidate elements
+// in it; the marks that would spread to the ancestors of the task are applied afterwards.
+
+bool ui_parallel_layout_push(Element *element, Rect bounds) {
+	LayoutWorker *worker = layout_worker;
+	mutex_lock(&worker->mutex);
+
+	if (worker->tail == worker->capacity) {
+		// Move the remaining tasks to the front before growing.
+		memmove(worker->tasks, worker->tasks + worker->head, sizeof(LayoutTask) * (worker->tail - worker->head));
+		worker->tail -= worker->head;
+		worker->head = 0;
+
+		if (worker->tail == worker->capacity) {
+			worker->capacity = worker->capacity ? worker->capacity * 2 : 64;
+			worker->tasks = realloc(worker->tasks, sizeof(LayoutTask) * worker->capacity);
+		}
+	}
+
+	worker->tasks[worker->tail++] = (LayoutTask){ .element = element, .bounds = bounds };
+	mutex_unlock(&worker->mutex);
+
+	atomic_add(&global_state.layout_tasks_pending, 1);
+	atomic_add(&global_state.layout_tasks_queued, 1);
+
+	// Wake up a sleeping worker.
+	mutex_lock(&global_state.layout_mutex);
+	condition_signal(&global_state.layout_wake);
+	mutex_unlock(&global_state.layout_mutex);
+	return true;
+}
+
+// Take a task from the back of our own deque, or steal one from the front of another's.
+bool ui_parallel_layout_take(LayoutWorker *worker, LayoutTask *task) {
+	int index = (int) (worker - global_state.layout_workers);
+
+	for (int i = 0; i < global_state.layout_worker_count; ++i) {
+		LayoutWorker *victim = &global_state.layout_workers[(index + i) % global_state.layout_worker_count];
+		bool found = false;
+		mutex_lock(&victim->mutex);
+
+		if (victim->head != victim->tail) {
+			*task = victim == worker ? victim->tasks[--victim->tail] : victim->tasks[victim->head++];
+			found = true;
+		}
+
+		mutex_unlock(&victim->mutex);
+
+		if (found) {
+			atomic_add(&global_state.layout_tasks_queued, -1);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void ui_parallel_layout_run(LayoutTask task) {
+	layout_worker->task = task.element;
+	element_move(task.element, task.bounds, false);
+	layout_worker->task = NULL;
+	atomic_add(&global_state.layout_tasks_pending, -1);
+}
+
+void ui_parallel_layout_thread(void *argument) {
+	layout_worker = (LayoutWorker *) argument;
+
+	// Everything this thread lays out is nested inside a pass started on the UI thread.
+	layout_depth = 1;
+
+	while (true) {
+		LayoutTask task;
+
+		if (ui_parallel_layout_take(layout_worker, &task)) {
+			ui_parallel_layout_run(task);
+		} else {
+			// Sleep until there's something to steal.
+			mutex_lock(&global_state.layout_mutex);
+			while (!atomic_load(&global_state.layout_tasks_queued)) {
+				condition_wait(&global_state.layout_wake, &global_state.layout_mutex);
+			}
+			mutex_unlock(&global_state.layout_mutex);
+		}
+	}
+}
+
+void ui_parallel_layout_begin(void) {
+	layout_worker = &global_state.layout_workers[0];
+}
+
+void ui_parallel_layout_end(Window *window) {
+	// Help with the remaining tasks until they're all finished.
+	while (atomic_load(&global_state.layout_tasks_pending)) {
+		LayoutTask task;
+
+		if (ui_parallel_layout_take(layout_worker, &task)) {
+			ui_parallel_layout_run(task);
+		} else {
+			platform_thread_yield();
+		}
+	}
+
+	layout_worker = NULL;
+
+	// Merge the repaints, invalidations and statistics of every thread.
+	for (int i = 0; i < global_state.layout_worker_count; ++i) {
+		LayoutWorker *worker = &global_state.layout_workers[i];
+		measure_count += worker->measure_count;
+		measure_cache_hits += worker->measure_cache_hits;
+		worker->measure_count = worker->measure_cache_hits = 0;
+
+		for (int j = 0; j < worker->mark_count; ++j) {
+			element_mark_ancestors(worker->marks[j].element, worker->marks[j].measure, worker->marks[j].flags);
+		}
+		worker->mark_count = 0;
+
+		if (rect_valid(worker->repaint)) {
+			element_repaint(&window->element, &worker->repaint);
+			worker->repaint = rect_make(0, 0, 0, 0);
+		}
+	}
+
+	// Layouts invalidated or destroyed during the pass didn't queue the window themselves.
+	if (window->element.flags & (ELEMENT_LAYOUT_DIRTY | ELEMENT_LAYOUT_DESCENDENT | ELEMENT_DESTROY_DESCENDENT)) {
+		window_queue_update(window);
+	}
+}
+
+// Lay out large sibling subtrees on thread_count threads (including the UI thread),
+// if they have at least threshold descendants. A thread_count of 0 uses one thread 
+// per processor, and 1 turns parallel layout off again. The threads are started
+// the first time this is called, so later calls can't add more.
+void ui_parallel_layout_enable(int thread_count, uint32_t threshold) {
+	if (thread_count == 0) thread_count = platform_processor_count();
+	global_state.parallel_layout_threshold = threshold;
+
+	if (!global_state.layout_workers && thread_count > 1) {
+		mutex_init(&global_state.layout_mutex);
+		condition_init(&global_state.layout_wake);
+		global_state.layout_workers = calloc(thread_count, sizeof(LayoutWorker));
+		global_state.layout_worker_count = thread_count;
+
+		for (int i = 0; i < thread_count; ++i) {
+			mutex_init(&global_state.layout_workers[i].mutex);
+		}
+
+		for (int i = 1; i < thread_count; ++i) {
+			Thread thread;
+			platform_thread_start(&thread, ui_parallel_layout_thread, &global_state.layout_workers[i]);
+		}
+	}
+
+	global_state.parallel_layout = thread_count > 1 && global_state.layout_workers;
+}
+
+// Destroy, lay out and repaint what has changed in the window, on the thread that owns it. 
+// Returns true if the whole window was destroyed.
+bool ui_window_update(Window *window) {
+	// destroy all elements marked for destruction
+	if (ui_element_destroy(&window->element)) {
+		return true;
+	}
+
+	// Lay out the parts of the hierarchy that were invalidated.
+	ui_element_layout(&window->element);
+
+	// Is there anything marked for repaint?
+	if (rect_valid(window->update_region)) {
+		Rect region = window->update_region;
+
+		if (window_paint_progressively(window, region)) {
+			window_paint_tiles_mark(window, region);
+		} else {
+			window_paint_region(window, region);
+		}
+
+		// Clear the update region, ready for the next input event cycle.
+		window->update_region = rect_make(0, 0, 0, 0);
+	} else if (!window->paint_tile_count) {
+		// The input didn't change anything on the screen.
+		memset(window->input_arrival, 0, sizeof(window->input_arrival));
+	}
+
+	if (window->paint_tile_count) {
+		window_paint_tiles(window);
+	}
+
+	return false;
+}
+
+// Add the window to the windows the next ui_update visits, because something 
+// in it has to be destroyed, laid out or repainted. Windows with their own thread 
+// update themselves, so they're never queued.
+void window_queue_update(Window *window) {
+	if (window->threaded || window->update_queued) return;
+	window->update_queued = true;
+
+	if (global_state.update_queue_count == global_state.update_queue_capacity) {
+		global_state.update_queue_capacity = global_state.update_queue_capacity ? global_state.update_queue_capacity * 2 : 8;
+		global_state.update_queue = realloc(global_state.update_queue, sizeof(Window *) * global_state.update_queue_capacity);
+	}
+
+	global_state.update_queue[global_state.update_queue_count++] = window;
+}
+
+// Update the windows that don't have their own thread and have something to update.
+void ui_update(void) {
+	// Swap in the spare array, so anything queued while updating waits for the next update.
+	Window **queue = global_state.update_queue;
+	size_t count = global_state.update_queue_count, capacity = global_state.update_queue_capacity;
+	global_state.update_queue = global_state.update_spare;
+	global_state.update_queue_capacity = global_state.update_spare_capacity;
+	global_state.update_queue_count = 0;
+	global_state.update_spare = queue;
+	global_state.update_spare_capacity = capacity;
+
+	for (uintptr_t i = 0; i < count; ++i) {
+		Window *window = queue[i];
+		if (window->threaded) continue;
+		window->update_queued = false;
+
+		if (ui_window_update(window)) {
+			// The whole window has been destroyed, so removed it from our list,
+			// and from the queue, if its elements queued it again while being destroyed.
+			for (uintptr_t j = 0; j < global_state.window_count; ++j) {
+				if (global_state.windows[j] != window) continue;
+				global_state.windows[j] = global_state.windows[global_state.window_count - 1];
+				--global_state.window_count;
+				break;
+			}
+
+			for (uintptr_t j = 0; j < global_state.update_queue_count; ++j) {
+				if (global_state.update_queue[j] != window) continue;
+				global_state.update_queue[j] = global_state.update_queue[--global_state.update_queue_count];
+				break;
+			}
+		} else if (window->paint_tile_count) {
+			// There's more to paint after the input has been handled.
+			window_queue_update(window);
+		}
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Threads
+//////////////////////////////////////////////////////////////////////////////
+typedef struct {
+	ThreadFunction function;
+	void *argument;
+} ThreadStart;
+
+#ifdef PLATFORM_WIN32
+
+DWORD WINAPI platform_thread_entry(void *start_pointer) {
+	ThreadStart start = *(ThreadStart *) start_pointer;
+	free(start_pointer);
+	start.function(start.argument);
+	return 0;
+}
+
+bool platform_thread_start(Thread *thread, ThreadFunction function, void *argument) {
+	ThreadStart *start = malloc(sizeof(ThreadStart));
+	*start = (ThreadStart){ .function = function, .argument = argument };
+	*thread = CreateThread(NULL, 0, platform_thread_entry, start, 0, NULL);
+	if (!*thread) free(start);
+	return *thread != NULL;
+}
+
+void platform_thread_join(Thread thread) {
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+}
+
+void platform_thread_yield(void) { SwitchToThread(); }
+void platform_thread_sleep(int milliseconds) { Sleep(milliseconds); }
+uint64_t platform_time_ms(void) { return GetTickCount64(); }
+
+uint64_t platform_time_us(void) {
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+	if (!frequency.QuadPart) QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (uint64_t) (counter.QuadPart / frequency.QuadPart * 1000000 + counter.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart);
+}
+
+int platform_processor_count(void) {
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int) info.dwNumberOfProcessors;
+}
+
+void mutex_init(Mutex *mutex) { InitializeSRWLock(mutex); }
+void mutex_lock(Mutex *mutex) { AcquireSRWLockExclusive(mutex); }
+void mutex_unlock(Mutex *mutex) { ReleaseSRWLockExclusive(mutex); }
+void condition_init(ConditionVariable *condition) { InitializeConditionVariable(condition); }
+void condition_wait(ConditionVariable *condition, Mutex *mutex) { SleepConditionVariableSRW(condition, mutex, INFINITE, 0); }
+void condition_signal(ConditionVariable *condition) { WakeConditionVariable(condition); }
+
+// Returns after the given time even if the condition wasn't signalled. -1 waits for as long as it takes.
+void condition_wait_timeout(ConditionVariable *condition, Mutex *mutex, int milliseconds) {
+	SleepConditionVariableSRW(condition, mutex, milliseconds == -1 ? INFINITE : (DWORD) milliseconds, 0);
+}
+
+#else
+
+void *platform_thread_entry(void *start_pointer) {
+	ThreadStart start = *(ThreadStart *) start_pointer;
+	free(start_pointer);
+	start.function(start.argument);
+	return NULL;
+}
+
+bool platform_thread_start(Thread *thread, ThreadFunction function, void *argument) {
+	ThreadStart *start = malloc(sizeof(ThreadStart));
+	*start = (ThreadStart){ .function = function, .argument = argument };
+	bool success = 0 == pthread_create(thread, NULL, platform_thread_entry, start);
+	if (!success) free(start);
+	return success;
+}
+
+void platform_thread_join(Thread thread) { pthread_join(thread, NULL); }
+void platform_thread_yield(void) { sched_yield(); }
+void platform_thread_sleep(int milliseconds) { usleep(milliseconds * 1000); }
+
+uint64_t platform_time_ms(void) {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t) time.tv_sec * 1000 + time.tv_nsec / 1000000;
+}
+
+uint64_t platform_time_us(void) {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t) time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
+int platform_processor_count(void) {
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (int) count : 1;
+}
 
-	// For every character in the string...
-	for (uintptr_t i = 0; i < bytes; ++i) {
-		uint8_t c = string[i];
-		if (c > 127) c = '?';
-
-		// Work out where the corresponding glyph is to be drawn.
-		Rect rect = rect_intersection(painter->clip, rect_make(x, x + 8, y, y + 16));
-		uint8_t *data = (uint8_t*) _font + c * 16;
-
-		// Blit the glyph bits.
-		for (int i = rect.t; i < rect.b; ++i) {
-			uint32_t *bits = painter->bits + i * painter->width + rect.l;
-			uint8_t byte = data[i - y];
-
-			for (int j = rect.l; j < rect.r; ++j) {
-				if (byte & (1 << (j - x))) {
-					*bits = color;
-				}
-				++bits;
-			}
-		}
+void mutex_init(Mutex *mutex) { pthread_mutex_init(mutex, NULL); }
+void mutex_lock(Mutex *mutex) { pthread_mutex_lock(mutex); }
+void mutex_unlock(Mutex *mutex) { pthread_mutex_unlock(mutex); }
+void condition_init(ConditionVariable *condition) { pthread_cond_init(condition, NULL); }
+void condition_wait(ConditionVariable *condition, Mutex *mutex) { pthread_cond_wait(condition, mutex); }
+void condition_signal(ConditionVariable *condition) { pthread_cond_signal(condition); }
+
+// Returns after the given time even if the condition wasn't signalled. -1 waits for as long as it takes.
+void condition_wait_timeout(ConditionVariable *condition, Mutex *mutex, int milliseconds) {
+	if (milliseconds == -1) {
+		pthread_cond_wait(condition, mutex);
+		return;
+	}
 
-		// Advance to the position of the next glyph.
-		x += GLYPH_WIDTH;
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += milliseconds / 1000;
+	deadline.tv_nsec += (long) (milliseconds % 1000) * 1000000;
+
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
 	}
 
-	// Restore the old clipping region.
-	painter->clip = old_clip;
+	pthread_cond_timedwait(condition, mutex, &deadline);
 }
 
+#endif
+
 //////////////////////////////////////////////////////////////////////////////
-// Core UI Code
+// Files
 //////////////////////////////////////////////////////////////////////////////
-void ui_update(void);
+// Files are opened so that other processes can keep writing to them. If a mapped
+// file is truncated, reading the part that was cut off is a fault, so code reading
+// a file that might be truncated at any time should open it with platform_file_open
+// instead, and read it with platform_file_read, which returns the number of bytes it could read.
+#ifdef PLATFORM_WIN32
 
-// element is NULL if mouse button not being pressed
-// button is the mouse button that went up OR down
-void ui_window_set_pressed(Window *window, Element *element, MouseButton button) {
-	Element *previous = window->pressed;
-	window->pressed = element;
-	window->pressed_mouse_button = button;
-	if (previous) element_message(previous, MSG_UPDATE, UPDATE_PRESSED, 0);
-	if (element)  element_message(element, MSG_UPDATE, UPDATE_PRESSED, 0);
+bool platform_file_map_view(MappedFile *file) {
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file->file, &size)) return false;
+	file->size = (size_t) size.QuadPart;
+	file->data = NULL;
+	file->mapping = NULL;
+	if (!file->size) return true;
+
+	file->mapping = CreateFileMappingA(file->file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!file->mapping) return false;
+	file->data = MapViewOfFile(file->mapping, FILE_MAP_READ, 0, 0, file->size);
+	return file->data != NULL;
 }
 
-void ui_window_input_event(Window *window, Message message, int data_int, void *data_ptr) {	
-	if (window->pressed) {
-		if (message == MSG_MOUSE_MOVE) {
-			// Mouse move events become mouse drag messages, sent to the
-			// element we pressed the mouse button down over.
-			element_message(window->pressed, MSG_MOUSE_DRAG, data_int, data_ptr);
-		} else if (message == MSG_MOUSE_LEFT_UP && window->pressed_mouse_button == MOUSE_BUTTON_LEFT) {
-			if (window->hovered == window->pressed) {
-				// If left mouse is released on the same element that it was previously down on, 
-				// send a clicked message to that element.
-				element_message(window->pressed, MSG_CLICKED, data_int, data_ptr);
-			}
-			// stop pressing the element
-			element_message(window->pressed, MSG_MOUSE_LEFT_UP, data_int, data_ptr);
-			ui_window_set_pressed(window, NULL, MOUSE_BUTTON_LEFT);
-		} else if (message == MSG_MOUSE_MIDDLE_UP && window->pressed_mouse_button == MOUSE_BUTTON_MIDDLE) {
-			// If middle mouse is released on the same element that it was previously down on,
-			// stop pressing the element
-			element_message(window->pressed, MSG_MOUSE_MIDDLE_UP, data_int, data_ptr);
-			ui_window_set_pressed(window, NULL, MOUSE_BUTTON_MIDDLE);
-		} else if (message == MSG_MOUSE_RIGHT_UP && window->pressed_mouse_button == MOUSE_BUTTON_RIGHT) {
-			// If right mouse is released on the same element that it was previously down on,
-			// stop pressing the element
-			element_message(window->pressed, MSG_MOUSE_RIGHT_UP, data_int, data_ptr);
-			ui_window_set_pressed(window, NULL, MOUSE_BUTTON_RIGHT);
-		} 
-	}
-
+void platform_file_unmap_view(MappedFile *file) {
+	if (file->data) UnmapViewOfFile(file->data);
+	if (file->mapping) CloseHandle(file->mapping);
+}
 
-	if (window->pressed) {
-		// While a mouse button is held, the hovered element is either the pressed element,
-		// or the window element (at the root of the hierarchy).
-		// Other elements are not allowed to be considered hovered until the button is released.
-		// Here, we update the hovered field and send out MSG_UPDATE messages as necessary.
-		bool inside = rect_contains(window->pressed->clip, window->mouse_x, window->mouse_y);
-		if (inside && window->hovered == &window->element) {
-			window->hovered = window->pressed;
-			element_message(window->pressed, MSG_UPDATE, UPDATE_HOVERED, 0);
-		} else if (!inside && window->hovered == window->pressed) {
-			window->hovered = &window->element;
-			element_message(window->pressed, MSG_UPDATE, UPDATE_HOVERED, 0);
-		}
+bool platform_file_map(MappedFile *file, const char *path) {
+	file->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 
+			NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file->file == INVALID_HANDLE_VALUE) return false;
 
-	} else {
-		// No element is currently pressed.
-		Element *hovered = element_find_by_point(&window->element, window->mouse_x, window->mouse_y);
+	if (!platform_file_map_view(file)) {
+		platform_file_unmap_view(file);
+		CloseHandle(file->file);
+		return false;
+	}
 
-		if (message == MSG_MOUSE_MOVE) {
-			element_message(hovered, message, data_int, data_ptr);
-		} else if (message == MSG_MOUSE_LEFT_DOWN) {
-			// If the left mouse button is pressed, start pressing the hovered element.
-			ui_window_set_pressed(window, hovered, MOUSE_BUTTON_LEFT);
-			element_message(hovered, message, data_int, data_ptr);
-		} else if (message == MSG_MOUSE_MIDDLE_DOWN) {
-			// If the middle mouse button is pressed, start pressing the hovered element.
-			ui_window_set_pressed(window, hovered, MOUSE_BUTTON_MIDDLE);
-			element_message(hovered, message, data_int, data_ptr);
-		} else if (message == MSG_MOUSE_RIGHT_DOWN) {
-			// If the right mouse button is pressed, start pressing the hovered element.
-			ui_window_set_pressed(window, hovered, MOUSE_BUTTON_RIGHT);
-			element_message(hovered, message, data_int, data_ptr);
-		}
+	return true;
+}
 
-		if (hovered != window->hovered) {
-			Element *previous = window->hovered;
-			window->hovered = hovered;
-			element_message(previous, MSG_UPDATE, UPDATE_HOVERED, 0);
-			element_message(hovered, MSG_UPDATE, UPDATE_HOVERED, 0);
-		}
+// Map the file again if its size changed. Returns true if it did.
+bool platform_file_remap(MappedFile *file) {
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file->file, &size) || (size_t) size.QuadPart == file->size) return false;
+	platform_file_unmap_view(file);
+	if (!platform_file_map_view(file)) {
+		platform_file_unmap_view(file);
+		file->data = NULL;
+		file->size = 0;
 	}
-
-	// Process any queued repaints.
-	ui_update();
+	return true;
 }
 
-void ui_element_paint(Element *element, Painter *painter) {
-	// Compute the intersection of where the element is allowed to draw, element->clip,
-	// with the area requested to be drawn, painter->clip.
-	Rect clip = rect_intersection(element->clip, painter->clip);
+void platform_file_unmap(MappedFile *file) {
+	platform_file_unmap_view(file);
+	CloseHandle(file->file);
+}
 
-	// If the above regions do not overlap, return here,
-	// and do not recurse into our descendant elements
-	// (since their clip rectangles are contained within element->clip).
-	if (!rect_valid(clip)) {
-		return;
-	}
+bool platform_file_open(FileReader *file, const char *path) {
+	file->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 
+			NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file->file == INVALID_HANDLE_VALUE) return false;
+	file->size = 0;
+	platform_file_refresh(file);
+	return true;
+}
 
-	// Set the painter's clip and ask the element to paint itself.
-	painter->clip = clip;
-	element_message(element, MSG_PAINT, 0, painter);
+// Get the file's size again. Returns true if it changed. If it can't be found, the old size is kept.
+bool platform_file_refresh(FileReader *file) {
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file->file, &size) || (size_t) size.QuadPart == file->size) return false;
+	file->size = (size_t) size.QuadPart;
+	return true;
+}
 
-	// Recurse into each child, restoring the clip each time.
-	for (uintptr_t i = 0; i < element->child_count; ++i) {
-		painter->clip = clip;
-		ui_element_paint(element->children[i], painter);
-	}
+void platform_file_close(FileReader *file) {
+	CloseHandle(file->file);
 }
 
-bool ui_element_destroy(Element *element) {
-	// Is there some descendent of this element that needs to be destroyed?
-	if (element->flags & ELEMENT_DESTROY_DESCENDENT) {
-		// Clear the flag, ready for the next update cycle.
-		element->flags &= ~ELEMENT_DESTROY_DESCENDENT;
+size_t platform_file_read(FileReader *file, size_t offset, void *buffer, size_t bytes) {
+	size_t total = 0;
 
-		// For each child,
-		for (uintptr_t i = 0; i < element->child_count; ++i) { // Exercise to the reader: how can this specific line of code be optimized?
-			// Recurse. Was this specific element destroyed?
-			if (ui_element_destroy(element->children[i])) {
-				// Yes, so remove it from our list of children.
-				memmove(&element->children[i], &element->children[i + 1], sizeof(Element *) * (element->child_count - i - 1));
-				element->child_count--;
-				i--;
-			}
-		}
+	while (total < bytes) {
+		OVERLAPPED overlapped = { 0 };
+		overlapped.Offset = (DWORD) (offset + total);
+		overlapped.OffsetHigh = (DWORD) ((uint64_t) (offset + total) >> 32);
+		DWORD read = 0;
+		if (!ReadFile(file->file, (char*) buffer + total, (DWORD) MIN(bytes - total, 1 << 30), &read, &overlapped) || !read) break;
+		total += read;
 	}
 
-	// Does this element need to be destroyed?
-	if (element->flags & ELEMENT_DESTROY) {
-		// Sent it the MSG_DESTROY message.
-		element_message(element, MSG_DESTROY, 0, 0);
+	return total;
+}
 
-		// If this element is being pressed, clear the pressed field in the Window.
-		if (element->window->pressed == element) {
-			ui_window_set_pressed(element->window, NULL, 0);
-		}
+#else
 
-		// If this element is being hovered, reset the hovered field in the Window to the default.
-		if (element->window->hovered == element) {
-			element->window->hovered = &element->window->element;
-		}
+bool platform_file_map_view(MappedFile *file) {
+	struct stat status;
+	if (fstat(file->fd, &status)) return false;
+	file->size = (size_t) status.st_size;
+	file->data = NULL;
+	if (!file->size) return true;
 
-		// Free the element's children list, and the element structure itself.
-		free(element->children);
-		free(element);
-		return true;
+	void *data = mmap(NULL, file->size, PROT_READ, MAP_SHARED, file->fd, 0);
+	if (data == MAP_FAILED) return false;
+	file->data = (char*) data;
+	return true;
+}
 
-	} else {
-		// The element was not destroyed.
+bool platform_file_map(MappedFile *file, const char *path) {
+	file->fd = open(path, O_RDONLY);
+	if (file->fd == -1) return false;
+
+	if (!platform_file_map_view(file)) {
+		close(file->fd);
 		return false;
 	}
-}
 
-void ui_update(void) {
-	for (uintptr_t i = 0; i < global_state.window_count; ++i) {
-		Window *window = global_state.windows[i];
+	return true;
+}
 
-		// destroy all elements marked for destruction
-		if (ui_element_destroy(&window->element)) {
+// Map the file again if its size changed. Returns true if it did.
+bool platform_file_remap(MappedFile *file) {
+	struct stat status;
+	if (fstat(file->fd, &status) || (size_t) status.st_size == file->size) return false;
+	if (file->data) munmap(file->data, file->size);
+	if (!platform_file_map_view(file)) {
+		file->data = NULL;
+		file->size = 0;
+	}
+	return true;
+}
 
-			// The whole window has been destroyed, so removed it from our list.
-			global_state.windows[i] = global_state.windows[global_state.window_count - 1];
-			--global_state.window_count;
-			--i;
+void platform_file_unmap(MappedFile *file) {
+	if (file->data) munmap(file->data, file->size);
+	close(file->fd);
+}
 
+bool platform_file_open(FileReader *file, const char *path) {
+	file->fd = open(path, O_RDONLY);
+	if (file->fd == -1) return false;
+	file->size = 0;
+	platform_file_refresh(file);
+	return true;
+}
 
-		// Is there anything marked for repaint?
-		} else if (rect_valid(window->update_region)) {
-			// Setup the painter using the window's buffer.
-			Painter painter;
-			painter.bits = window->bits;
-			painter.width = window->width;
-			painter.height = window->height;
-			painter.clip = rect_intersection(
-				rect_make(0, window->width, 0, window->height), 
-				window->update_region);
+// Get the file's size again. Returns true if it changed. If it can't be found, the old size is kept.
+bool platform_file_refresh(FileReader *file) {
+	struct stat status;
+	if (fstat(file->fd, &status) || (size_t) status.st_size == file->size) return false;
+	file->size = (size_t) status.st_size;
+	return true;
+}
 
-			// Paint everything in the update region.
-			ui_element_paint(&window->element, &painter);
+void platform_file_close(FileReader *file) {
+	close(file->fd);
+}
 
-			// Tell the platform layer to put the result onto the screen.
-			platform_window_end_paint(window, &painter);
+size_t platform_file_read(FileReader *file, size_t offset, void *buffer, size_t bytes) {
+	size_t total = 0;
 
-			// Clear the update region, ready for the next input event cycle.
-			window->update_region = rect_make(0, 0, 0, 0);
-		}
+	while (total < bytes) {
+		ssize_t result = pread(file->fd, (char*) buffer + total, bytes - total, (off_t) (offset + total));
+		if (result <= 0) break;
+		total += (size_t) result;
 	}
+
+	return total;
 }
 
+#endif
+
 //////////////////////////////////////////////////////////////////////////////
 // Platform specific code
 //////////////////////////////////////////////////////////////////////////////
@@ -953,13 +5955,7 @@ LRESULT CALLBACK win32_window_proc(HWND hwnd, UINT message, WPARAM wParam, LPARA
 	} else if (message == WM_SIZE) {
 		RECT client;
 		GetClientRect(hwnd, &client);
-		window->width = client.right;
-		window->height = client.bottom;
-		window->bits = (uint32_t*)realloc(window->bits, window->width * window->height * 4);
-		window->element.bounds = rect_make(0, window->width, 0, window->height);
-		window->element.clip = rect_make(0, window->width, 0, window->height);
-		element_message(&window->element, MSG_LAYOUT, 0, 0);
-		ui_update();
+		ui_window_resize(window, client.right, client.bottom);
 	} else if (message == WM_MOUSEMOVE) {
 		if (!window->tracking_leave) {
 			window->tracking_leave = true;
@@ -972,37 +5968,51 @@ LRESULT CALLBACK win32_window_proc(HWND hwnd, UINT message, WPARAM wParam, LPARA
 		POINT cursor;
 		GetCursorPos(&cursor);
 		ScreenToClient(hwnd, &cursor);
-		window->mouse_x = cursor.x;
-		window->mouse_y = cursor.y;
-		ui_window_input_event(window, MSG_MOUSE_MOVE, 0, 0);
+		ui_window_mouse_event(window, MSG_MOUSE_MOVE, 0, cursor.x, cursor.y);
 	} else if (message == WM_MOUSELEAVE) {
 		window->tracking_leave = false;
-		if (!window->pressed) {
-			window->mouse_x = -1;
-			window->mouse_y = -1;
-		}
-		ui_window_input_event(window, MSG_MOUSE_MOVE, 0, 0);
-	} else if (message == WM_LBUTTONDOWN) {
+		ui_window_mouse_event(window, MSG_MOUSE_MOVE, 0, -1, -1);
+	} else if (message == WM_LBUTTONDOWN || message == WM_MBUTTONDOWN || message == WM_RBUTTONDOWN) {
 		SetCapture(hwnd);
-		ui_window_input_event(window, MSG_MOUSE_LEFT_DOWN, 0, 0);
-	} else if (message == WM_LBUTTONUP) {
-		if (window->pressed_mouse_button == MOUSE_BUTTON_LEFT) 
+		ui_window_mouse_event(window, 
+			message == WM_LBUTTONDOWN ? MSG_MOUSE_LEFT_DOWN : message == WM_MBUTTONDOWN ? MSG_MOUSE_MIDDLE_DOWN : MSG_MOUSE_RIGHT_DOWN, 
+			0, (short) LOWORD(lParam), (short) HIWORD(lParam));
+	} else if (message == WM_LBUTTONUP || message == WM_MBUTTONUP || message == WM_RBUTTONUP) {
+		// wParam has the buttons that are still down. (The window's pressed_mouse_button 
+		// can't be used here, since the window might belong to another thread.)
+		if (!(wParam & (MK_LBUTTON | MK_MBUTTON | MK_RBUTTON))) 
 			ReleaseCapture();
-		ui_window_input_event(window, MSG_MOUSE_LEFT_UP, 0, 0);
-	} else if (message == WM_MBUTTONDOWN) {
-		SetCapture(hwnd);
-		ui_window_input_event(window, MSG_MOUSE_MIDDLE_DOWN, 0, 0);
-	} else if (message == WM_MBUTTONUP) {
-		if (window->pressed_mouse_button == MOUSE_BUTTON_MIDDLE) 
-			ReleaseCapture();
-		ui_window_input_event(window, MSG_MOUSE_MIDDLE_UP, 0, 0);
-	} else if (message == WM_RBUTTONDOWN) {
-		SetCapture(hwnd);
-		ui_window_input_event(window, MSG_MOUSE_RIGHT_DOWN, 0, 0);
-	} else if (message == WM_RBUTTONUP) {
-		if (window->pressed_mouse_button == MOUSE_BUTTON_RIGHT) 
-			ReleaseCapture();
-		ui_window_input_event(window, MSG_MOUSE_RIGHT_UP, 0, 0);
+		ui_window_mouse_event(window, 
+			message == WM_LBUTTONUP ? MSG_MOUSE_LEFT_UP : message == WM_MBUTTONUP ? MSG_MOUSE_MIDDLE_UP : MSG_MOUSE_RIGHT_UP, 
+			0, (short) LOWORD(lParam), (short) HIWORD(lParam));
+	} else if (message == WM_MOUSEWHEEL) {
+		ui_window_input_event(window, MSG_MOUSE_WHEEL, -GET_WHEEL_DELTA_WPARAM(wParam) / WHEEL_DELTA, 0);
+	} else if (message == WM_KEYDOWN) {
+		KeyTyped key = {0};
+		if (wParam == VK_BACK) key.code = KEY_BACKSPACE;
+		else if (wParam == VK_DELETE) key.code = KEY_DELETE;
+		else if (wParam == VK_LEFT) key.code = KEY_LEFT;
+		else if (wParam == VK_RIGHT) key.code = KEY_RIGHT;
+		else if (wParam == VK_UP) key.code = KEY_UP;
+		else if (wParam == VK_DOWN) key.code = KEY_DOWN;
+		else if (wParam == VK_HOME) key.code = KEY_HOME;
+		else if (wParam == VK_END) key.code = KEY_END;
+		else if (wParam == VK_RETURN) key.code = KEY_ENTER;
+		if (key.code) ui_window_input_event(window, MSG_KEY_TYPED, 0, &key);
+	} else if (message == WM_CHAR) {
+		// Control characters are handled as WM_KEYDOWN above. Surrogate pairs are not supported.
+		if (wParam >= 32 && wParam != 127 && (wParam < 0xD800 || wParam > 0xDFFF)) {
+			char text[4];
+			KeyTyped key = { .code = KEY_NONE, .text = text, .bytes = utf8_encode((uint32_t) wParam, text) };
+			ui_window_input_event(window, MSG_KEY_TYPED, 0, &key);
+		}
+	} else if (message == WM_PAINT && window->threaded) {
+		// The bitmap belongs to the window's thread, so let it repaint.
+		PAINTSTRUCT paint;
+		BeginPaint(hwnd, &paint);
+		EndPaint(hwnd, &paint);
+		WindowEvent event = { .kind = WINDOW_EVENT_EXPOSE };
+		window_event_push(window, &event);
 	} else if (message == WM_PAINT) {
 		PAINTSTRUCT paint;
 		HDC dc = BeginPaint(hwnd, &paint);
@@ -1045,13 +6055,38 @@ Window *platform_create_window(const char *title, int width, int height) {
 
 int platform_message_loop(void) {
 	MSG message = {0};
+	ui_latency_init();
+	ui_recording_init();
+
+	while (true) {
+		// Sleep until there's a message, or the next timer or animation frame is due.
+		int timeout = ui_wait_timeout();
+		MsgWaitForMultipleObjectsEx(0, NULL, timeout == -1 ? INFINITE : (DWORD) timeout, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+
+		while (PeekMessage(&message, NULL, 0, 0, PM_REMOVE)) {
+			if (message.message == WM_QUIT) {
+				return (int)message.wParam;
+			}
+
+			// Thread messages from platform_wake_ui_thread only have to wake the loop.
+			if (!message.hwnd && message.message == WM_APP) {
+				continue;
+			}
+
+			// The message's time is from GetTickCount, so work out how long ago that was.
+			global_state.input_arrival = platform_time_us() - (uint64_t) (DWORD) (GetTickCount() - message.time) * 1000;
+			TranslateMessage(&message);
+			DispatchMessage(&message);
+			global_state.input_arrival = 0;
+		}
 
-	while (GetMessage(&message, NULL, 0, 0)) {
-		TranslateMessage(&message);
-		DispatchMessage(&message);
+		ui_process_frame();
+		ui_process_idle();
 	}
+}
 
-	return (int)message.wParam;
+bool platform_input_pending(void) {
+	return HIWORD(GetQueueStatus(QS_ALLINPUT)) != 0;
 }
 
 void platform_init(void) {
@@ -1060,6 +6095,18 @@ void platform_init(void) {
 	window_class.hCursor = LoadCursor(NULL, IDC_ARROW);
 	window_class.lpszClassName = "UILibraryTutorial";
 	RegisterClass(&window_class);
+	global_state.ui_thread_id = GetCurrentThreadId();
+	mutex_init(&global_state.handle_mutex);
+	mutex_init(&global_state.timer_mutex);
+	mutex_init(&global_state.latency_mutex);
+	mutex_init(&global_state.task_mutex);
+	condition_init(&global_state.task_wake);
+}
+
+// Thread messages are dropped while a modal loop is running (e.g. while a window is 
+// being resized), so they are only used to wake the loop; the messages themselves are in the queue.
+void platform_wake_ui_thread(void) {
+	PostThreadMessage(global_state.ui_thread_id, WM_APP, 0, 0);
 }
 
 #endif
@@ -1075,9 +6122,18 @@ int platform_window_message(Element *element, Message message, int data_int, voi
 		window->image->data = NULL;
 		XDestroyImage(window->image);
 		XDestroyWindow(global_state.display, window->window);
-	} else if (message == MSG_LAYOUT && element->child_count > 0) {
-		element_move(element->children[0], element->bounds, false);
-		element_repaint(element, NULL);
+	} else if (message == MSG_LAYOUT) {
+		// The bitmap might have been reallocated by ui_window_resize.
+		Window *window = (Window *) element;
+		window->image->width = window->width;
+		window->image->height = window->height;
+		window->image->bytes_per_line = window->width * 4;
+		window->image->data = (char *) window->bits;
+
+		if (element->child_count > 0) {
+			element_move(element->children[0], element->bounds, false);
+			element_repaint(element, NULL);
+		}
 	}
 	return 0;
 }
@@ -1088,6 +6144,26 @@ void platform_window_end_paint(Window *window, Painter *painter) {
 	XPutImage(global_state.display, window->window, DefaultGC(global_state.display, 0), window->image, 
 		window->update_region.l, window->update_region.t, window->update_region.l, window->update_region.t,
 		window->update_region.r - window->update_region.l, window->update_region.b - window->update_region.t);
+
+	// The UI thread only flushes the connection when it has events to handle.
+	if (window->threaded) XFlush(global_state.display);
+}
+
+// Converts the X server's timestamp of an input event to platform_time_us(). The server's clock
+// is only milliseconds, and it might not be the same clock as ours, so the offset between them is
+// estimated as the smallest difference seen between an event's timestamp and when we read it.
+uint64_t x_event_arrival(Time time) {
+	uint64_t now = platform_time_us();
+	int64_t offset = (int64_t) now - (int64_t) ((uint64_t) (uint32_t) time * 1000);
+
+	// If the difference suddenly grows by a lot, the server's clock wrapped around or was reset.
+	if (!global_state.x_time_known || offset < global_state.x_time_offset || offset > global_state.x_time_offset + 10000000) {
+		global_state.x_time_offset = offset;
+		global_state.x_time_known = true;
+	}
+
+	uint64_t arrival = (uint64_t) ((int64_t) ((uint64_t) (uint32_t) time * 1000) + global_state.x_time_offset);
+	return MIN(arrival, now);
 }
 
 Window *find_window(X11Window window) {
@@ -1119,75 +6195,208 @@ Window *platform_create_window(const char *title, int width, int height) {
 		| EnterWindowMask | LeaveWindowMask | ButtonMotionMask | KeymapStateMask 
 		| FocusChangeMask | PropertyChangeMask);
 	XMapRaised(global_state.display, window->window);
-	XSetWMProtocols(global_state.display, window->window, &global_state.windowClosedID, 1);
+	XSetWMProtocols(global_state.display, window->window, &global_state.window_closed_id, 1);
 	window->image = XCreateImage(global_state.display, global_state.visual, 24, ZPixmap, 0, NULL, 10, 10, 32, 0);
 	return window;
 }
 
 int platform_message_loop(void) {
 	ui_update();
+	ui_latency_init();
+	ui_recording_init();
+
+	struct pollfd fds[2] = {
+		{ .fd = ConnectionNumber(global_state.display), .events = POLLIN },
+		{ .fd = global_state.wake_fd, .events = POLLIN },
+	};
+
 	while (true) {
-		XEvent event;
-		XNextEvent(global_state.display, &event);
-
-		if (event.type == ClientMessage && (Atom) event.xclient.data.l[0] == global_state.windowClosedID) {
-			return 0;
-		} else if (event.type == Expose) {
-			Window *window = find_window(event.xexpose.window);
-			if (!window) continue;
-			XPutImage(global_state.display, window->window, DefaultGC(global_state.display, 0), 
-					window->image, 0, 0, 0, 0, window->width, window->height);
-		} else if (event.type == ConfigureNotify) {
-			Window *window = find_window(event.xconfigure.window);
-			if (!window) continue;
-
-			if (window->width != event.xconfigure.width || window->height != event.xconfigure.height) {
-				window->width = event.xconfigure.width;
-				window->height = event.xconfigure.height;
-				window->bits = (uint32_t*)realloc(window->bits, window->width * window->height * 4);
-				window->image->width = window->width;
-				window->image->height = window->height;
-				window->image->bytes_per_line = window->width * 4;
-				window->image->data = (char *) window->bits;
-				window->element.bounds = rect_make(0, window->width, 0, window->height);
-				window->element.clip = rect_make(0, window->width, 0, window->height);
-				element_message(&window->element, MSG_LAYOUT, 0, 0);
-				ui_update();
-			}
-		} else if (event.type == MotionNotify) {
-			Window *window = find_window(event.xmotion.window);
-			if (!window) continue;
-			window->mouse_x = event.xmotion.x;
-			window->mouse_y = event.xmotion.y;
-			ui_window_input_event(window, MSG_MOUSE_MOVE, 0, 0);
-		} else if (event.type == LeaveNotify) {
-			Window *window = find_window(event.xcrossing.window);
-			if (!window) continue;
-
-			if (!window->pressed) {
-				window->mouse_x = -1;
-				window->mouse_y = -1;
+		// Sleep until there's an X event or a posted message, or the next timer or animation frame is due. 
+		// Xlib might have read events into its own queue already, in which case there's no need to wait.
+		if (!XPending(global_state.display)) {
+			poll(fds, 2, ui_wait_timeout());
+
+			if (fds[1].revents & POLLIN) {
+				uint64_t count;
+				ssize_t bytes = read(global_state.wake_fd, &count, sizeof(count));
+				(void) bytes;
 			}
+		}
 
-			ui_window_input_event(window, MSG_MOUSE_MOVE, 0, 0);
-		} else if (event.type == ButtonPress || event.type == ButtonRelease) {
-			Window *window = find_window(event.xbutton.window);
-			if (!window) continue;
-			window->mouse_x = event.xbutton.x;
-			window->mouse_y = event.xbutton.y;
-			if (event.xbutton.button >= 1 && event.xbutton.button <= 3) {
-				ui_window_input_event(window, 
-					(Message)((event.type == ButtonPress ? MSG_MOUSE_LEFT_DOWN : MSG_MOUSE_LEFT_UP) 
-					+ event.xbutton.button * 2 - 2), 0, 0);
+		// Handle all the events that have arrived, then the timers, posted messages and animations, then update once.
+		while (XPending(global_state.display)) {
+			XEvent event;
+			XNextEvent(global_state.display, &event);
+
+			if (event.type == ClientMessage && (Atom) event.xclient.data.l[0] == global_state.window_closed_id) {
+				return 0;
+			} else if (event.type == Expose) {
+				Window *window = find_window(event.xexpose.window);
+				if (!window) continue;
+
+				if (window->threaded) {
+					// The image belongs to the window's thread, so let it repaint.
+					WindowEvent expose = { .kind = WINDOW_EVENT_EXPOSE };
+					window_event_push(window, &expose);
+				} else {
+					XPutImage(global_state.display, window->window, DefaultGC(global_state.display, 0), 
+							window->image, 0, 0, 0, 0, window->width, window->height);
+				}
+			} else if (event.type == ConfigureNotify) {
+				Window *window = find_window(event.xconfigure.window);
+				if (!window) continue;
+
+				ui_window_resize(window, event.xconfigure.width, event.xconfigure.height);
+			} else if (event.type == MotionNotify) {
+				Window *window = find_window(event.xmotion.window);
+				if (!window) continue;
+				global_state.input_arrival = x_event_arrival(event.xmotion.time);
+				ui_window_mouse_event(window, MSG_MOUSE_MOVE, 0, event.xmotion.x, event.xmotion.y);
+			} else if (event.type == LeaveNotify) {
+				Window *window = find_window(event.xcrossing.window);
+				if (!window) continue;
+				global_state.input_arrival = x_event_arrival(event.xcrossing.time);
+				ui_window_mouse_event(window, MSG_MOUSE_MOVE, 0, -1, -1);
+			} else if (event.type == ButtonPress || event.type == ButtonRelease) {
+				Window *window = find_window(event.xbutton.window);
+				if (!window) continue;
+				int x = event.xbutton.x, y = event.xbutton.y;
+				global_state.input_arrival = x_event_arrival(event.xbutton.time);
+				if (event.xbutton.button >= 1 && event.xbutton.button <= 3) {
+					ui_window_mouse_event(window, 
+						(Message)((event.type == ButtonPress ? MSG_MOUSE_LEFT_DOWN : MSG_MOUSE_LEFT_UP) 
+						+ event.xbutton.button * 2 - 2), 0, x, y);
+				} else if ((event.xbutton.button == 4 || event.xbutton.button == 5) && event.type == ButtonPress) {
+					// Buttons 4 and 5 are the mouse wheel scrolling up and down.
+					ui_window_mouse_event(window, MSG_MOUSE_WHEEL, event.xbutton.button == 4 ? -1 : 1, x, y);
+				}
+			} else if (event.type == KeyPress) {
+				Window *window = find_window(event.xkey.window);
+				if (!window) continue;
+
+				char latin1[32], text[4];
+				KeySym symbol = NoSymbol;
+				int bytes = XLookupString(&event.xkey, latin1, sizeof(latin1), &symbol, NULL);
+				KeyTyped key = { .code = KEY_NONE, .text = text };
+
+				if (symbol == XK_BackSpace) key.code = KEY_BACKSPACE;
+				else if (symbol == XK_Delete) key.code = KEY_DELETE;
+				else if (symbol == XK_Left) key.code = KEY_LEFT;
+				else if (symbol == XK_Right) key.code = KEY_RIGHT;
+				else if (symbol == XK_Up) key.code = KEY_UP;
+				else if (symbol == XK_Down) key.code = KEY_DOWN;
+				else if (symbol == XK_Home) key.code = KEY_HOME;
+				else if (symbol == XK_End) key.code = KEY_END;
+				else if (symbol == XK_Return || symbol == XK_KP_Enter) key.code = KEY_ENTER;
+				else if (symbol >= 0x01000000) key.bytes = utf8_encode((uint32_t) symbol & 0xFFFFFF, text); // Unicode keysyms.
+				else if (bytes == 1 && (uint8_t) latin1[0] >= 32 && latin1[0] != 127) key.bytes = utf8_encode((uint8_t) latin1[0], text);
+
+				if (key.code || key.bytes) {
+					global_state.input_arrival = x_event_arrival(event.xkey.time);
+					ui_window_input_event(window, MSG_KEY_TYPED, 0, &key);
+				}
 			}
+
+			global_state.input_arrival = 0;
 		}
+
+		ui_process_frame();
+		ui_process_idle();
 	}
 }
 
+// Checks the connection for events without blocking.
+bool platform_input_pending(void) {
+	return XEventsQueued(global_state.display, QueuedAfterReading) > 0;
+}
+
 void platform_init(void) {
+	// Windows with their own thread present from that thread.
+	XInitThreads();
+	mutex_init(&global_state.handle_mutex);
+	mutex_init(&global_state.timer_mutex);
+	mutex_init(&global_state.latency_mutex);
+	mutex_init(&global_state.task_mutex);
+	condition_init(&global_state.task_wake);
 	global_state.display = XOpenDisplay(NULL);
 	global_state.visual = XDefaultVisual(global_state.display, 0);
-	global_state.windowClosedID = XInternAtom(global_state.display, "WM_DELETE_WINDOW", 0);
+	global_state.window_closed_id = XInternAtom(global_state.display, "WM_DELETE_WINDOW", 0);
+	global_state.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+void platform_wake_ui_thread(void) {
+	uint64_t one = 1;
+	ssize_t written = write(global_state.wake_fd, &one, sizeof(one));
+	(void) written; // Fails only if the counter is about to overflow, which still wakes the loop.
+}
+
+#endif
+
+#ifdef PLATFORM_HEADLESS
+
+// Windows are only bitmaps, and the only input comes from replaying a recording (see ui_recording_init).
+// This is for profiling and benchmarking without a display.
+
+int platform_window_message(Element *element, Message message, int data_int, void *data_ptr) {
+	(void) data_int;
+	(void) data_ptr;
+	if (message == MSG_DESTROY) {
+		free(((Window *) element)->bits);
+	} else if (message == MSG_LAYOUT && element->child_count > 0) {
+		element_move(element->children[0], element->bounds, false);
+		element_repaint(element, NULL);
+	}
+	return 0;
+}
+
+void platform_window_end_paint(Window *window, Painter *painter) {
+	(void) window;
+	(void) painter;
+}
+
+Window *platform_create_window(const char *title, int width, int height) {
+	(void) title;
+	Window *window = (Window *) element_create(sizeof(Window), NULL, 0, platform_window_message);
+	window->element.window = window;
+	window->hovered = &window->element;
+
+	global_state.window_count++;
+	global_state.windows = realloc(global_state.windows, sizeof(Window *) * global_state.window_count);
+	global_state.windows[global_state.window_count - 1] = window;
+
+	ui_window_resize(window, width, height);
+	return window;
+}
+
+// Replays TOUI_REPLAY, if it's set, and returns.
+int platform_message_loop(void) {
+	// Like the first resize from a real window, once the program has created its elements.
+	for (uintptr_t i = 0; i < global_state.window_count; ++i) {
+		if (global_state.windows[i]->threaded) continue;
+		element_message(&global_state.windows[i]->element, MSG_LAYOUT, 0, 0);
+	}
+
+	ui_update();
+	ui_latency_init();
+	ui_recording_init();
+	ui_record_stop();
+	return 0;
+}
+
+void platform_init(void) {
+	mutex_init(&global_state.handle_mutex);
+	mutex_init(&global_state.timer_mutex);
+	mutex_init(&global_state.latency_mutex);
+	mutex_init(&global_state.task_mutex);
+	condition_init(&global_state.task_wake);
+}
+
+bool platform_input_pending(void) {
+	return false;
+}
+
+// There's no loop to wake; posted messages are handled between the events of a replay.
+void platform_wake_ui_thread(void) {
 }
 
 #endif